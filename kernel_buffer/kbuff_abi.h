@@ -0,0 +1,57 @@
+/**
+ * @file    kbuff_abi.h
+ * @version 0.1
+ * @brief   The layout of the kernel_buffer ring as seen
+ *          through mmap, shared with user space.
+ *
+ *          The mapping is one header page followed by the
+ *          data, size bytes long, and has to be made with
+ *          MAP_SHARED, a private mapping fails with EINVAL.
+ *          Map the header page alone first to learn the
+ *          size. head and tail are free running byte
+ *          counts, the data of byte n lives at
+ *          data[ n & (size - 1) ] and head - tail bytes
+ *          are waiting to be read.
+ *
+ *          A mapping may take the place of the reader or of
+ *          the writer, never both and never alongside
+ *          read()/write() on the same side. The producer
+ *          fills data and then publishes head with a release
+ *          store, the consumer reads head with an acquire
+ *          load, and the other way round for tail. After
+ *          moving an index call KBUFF_IOC_NOTIFY so sleepers
+ *          in read() and write() look again.
+ **/
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#ifndef _KBUFF_ABI_H_
+#define _KBUFF_ABI_H_
+
+#define     KBUFF_RING_MAGIC    0x46465542
+
+/**
+ * Ring header, at offset 0 of the mapping. head and
+ * tail sit on their own cache lines so the reader
+ * and the writer do not bounce one between them.
+ *
+ * @param   magic   KBUFF_RING_MAGIC.
+ * @param   size    Bytes of data, a power of two.
+ * @param   head    Bytes written so far, moved by the writer.
+ * @param   tail    Bytes read so far, moved by the reader.
+ **/
+struct kbuff_ring {
+    __u32   magic;
+    __u32   size;
+    __u32   pad0[ 14 ];
+    __u32   head;
+    __u32   pad1[ 15 ];
+    __u32   tail;
+    __u32   pad2[ 15 ];
+};
+
+#define     KBUFF_IOC_MAGIC     'k'
+#define     KBUFF_IOC_NOTIFY    _IO( KBUFF_IOC_MAGIC, 1 )
+
+#endif
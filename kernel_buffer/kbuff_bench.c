@@ -0,0 +1,491 @@
+/**
+ * @file        kbuff_bench.c
+ * @version     0.1
+ * @brief       A benchmark client for /dev/kbuffer and
+ *              /dev/sled. Every thread opens the device on
+ *              its own and repeats one operation for the
+ *              given time, then the ops/s, MB/s and latency
+ *              percentiles of all the threads are printed.
+ *
+ *              kbuffer : an operation writes a message to the
+ *                        thread's FIFO and reads it back, a
+ *                        chunk at a time so messages larger
+ *                        than the FIFO go through as well.
+ *              sled    : an operation writes one sled_batch of
+ *                        as many commands as fit the message
+ *                        size, at least one.
+ *
+ *              The operations are issued with blocking calls
+ *              (sync), with O_NONBLOCK calls waiting in epoll
+ *              (epoll) or through an io_uring (uring).
+ *
+ *  usage : kbuff_bench [-T kbuffer|sled] [-m sync|epoll|uring]
+ *                      [-s bytes] [-t threads] [-d seconds]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/types.h>
+#include "sled_abi.h"
+
+#if defined( __has_include )
+#if __has_include( <linux/io_uring.h> ) && defined( __NR_io_uring_setup )
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+#define KBUFF_FILE      "/dev/kbuffer"
+#define SLED_FILE       "/dev/sled"
+
+/**
+ * Latency histogram, 16 linear buckets for every
+ * power of two of nanoseconds, so every bucket is
+ * within 1/16th of the values it holds.
+ **/
+#define HIST_SUB        16
+#define HIST_BUCKETS    ( 64 * HIST_SUB )
+
+/**
+ * The most bytes written to the FIFO before they are
+ * read back. The module never makes a FIFO smaller
+ * than a page, so a chunk always fits the empty FIFO
+ * and the write never waits on the reader, which is
+ * the same thread.
+ **/
+#define KBUFF_CHUNK     4096
+
+enum target { TARGET_KBUFF, TARGET_SLED };
+enum mode   { MODE_SYNC, MODE_EPOLL, MODE_URING };
+
+struct worker {
+    pthread_t   thread;
+    int         fd;
+    int         epfd;
+    char        *out;
+    char        *in;
+    size_t      len;
+    uint64_t    ops;
+    uint64_t    bytes;
+    uint64_t    errors;
+    uint64_t    hist[ HIST_BUCKETS ];
+#ifdef HAVE_IO_URING
+    struct uring {
+        int                 fd;
+        unsigned            *sq_tail;
+        unsigned            *sq_mask;
+        unsigned            *sq_array;
+        unsigned            *cq_head;
+        unsigned            *cq_tail;
+        unsigned            *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+    } ring;
+#endif
+};
+
+static enum target target = TARGET_KBUFF;
+static enum mode mode = MODE_SYNC;
+static size_t msg_size = 64;
+static int threads = 1;
+static int duration = 5;
+static volatile int stop;
+
+static uint64_t now_ns( void ){
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned hist_index( uint64_t ns ){
+    int msb;
+
+    if( ns < HIST_SUB )
+        return ns;
+    msb = 63 - __builtin_clzll( ns );
+    return msb * HIST_SUB + ( ( ns >> ( msb - 4 ) ) & ( HIST_SUB - 1 ) );
+}
+
+static uint64_t hist_value( unsigned index ){
+    unsigned msb = index / HIST_SUB;
+
+    if( index < HIST_SUB )
+        return index;
+    return (uint64_t)( HIST_SUB + index % HIST_SUB ) << ( msb - 4 );
+}
+
+static uint64_t hist_percentile( const uint64_t *hist, uint64_t total, double p ){
+    uint64_t rank = total * p, seen = 0;
+    unsigned i;
+
+    for( i=0; i<HIST_BUCKETS; i++ ){
+        seen += hist[i];
+        if( seen > rank )
+            return hist_value( i );
+    }
+    return 0;
+}
+
+/**
+ * Sync and epoll
+ *
+ * A whole buffer goes through, a non blocking call
+ * which cannot make progress waits in epoll first.
+ **/
+static int wait_ready( struct worker *w, uint32_t events ){
+    struct epoll_event ev = { .events = events, .data.ptr = w };
+    struct epoll_event got;
+
+    if( epoll_ctl( w->epfd, EPOLL_CTL_MOD, w->fd, &ev ) )
+        return -1;
+    while( epoll_wait( w->epfd, &got, 1, 100 ) == 0 ){
+        if( stop )
+            return -1;
+    }
+    return 0;
+}
+
+static int io_all( struct worker *w, char *buff, size_t len, int writing ){
+    ssize_t ret;
+
+    while( len ){
+        if( stop )
+            return -1;
+        ret = writing ? write( w->fd, buff, len ) : read( w->fd, buff, len );
+        if( ret < 0 && errno == EAGAIN && mode == MODE_EPOLL ){
+            if( wait_ready( w, writing ? EPOLLOUT : EPOLLIN ) )
+                return -1;
+            continue;
+        }
+        if( ret <= 0 )
+            return -1;
+        buff += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int op_calls( struct worker *w ){
+    size_t at, len;
+
+    if( target == TARGET_SLED )
+        return io_all( w, w->out, w->len, 1 );
+
+    for( at=0; at<w->len; at+=len ){
+        len = w->len - at < KBUFF_CHUNK ? w->len - at : KBUFF_CHUNK;
+        if( io_all( w, w->out + at, len, 1 ) ||
+            io_all( w, w->in + at, len, 0 ) )
+            return -1;
+    }
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * io_uring, driven with the raw system calls so
+ * no library is needed.
+ **/
+static int uring_setup( struct uring *u ){
+    struct io_uring_params p;
+    size_t sq_len, cq_len;
+    char *sq, *cq;
+
+    memset( &p, 0, sizeof( p ) );
+    u->fd = syscall( __NR_io_uring_setup, 4, &p );
+    if( u->fd < 0 )
+        return -1;
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+    sq = mmap( NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               u->fd, IORING_OFF_SQ_RING );
+    cq = mmap( NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               u->fd, IORING_OFF_CQ_RING );
+    u->sqes = mmap( NULL, p.sq_entries * sizeof( struct io_uring_sqe ),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    u->fd, IORING_OFF_SQES );
+    if( sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED )
+        return -1;
+
+    u->sq_tail  = (unsigned *)( sq + p.sq_off.tail );
+    u->sq_mask  = (unsigned *)( sq + p.sq_off.ring_mask );
+    u->sq_array = (unsigned *)( sq + p.sq_off.array );
+    u->cq_head  = (unsigned *)( cq + p.cq_off.head );
+    u->cq_tail  = (unsigned *)( cq + p.cq_off.tail );
+    u->cq_mask  = (unsigned *)( cq + p.cq_off.ring_mask );
+    u->cqes     = (struct io_uring_cqe *)( cq + p.cq_off.cqes );
+    return 0;
+}
+
+static void uring_queue( struct uring *u, int op, int fd, char *buff,
+                         size_t len, int flags ){
+    unsigned tail = *u->sq_tail;
+    unsigned index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[ index ];
+
+    memset( sqe, 0, sizeof( *sqe ) );
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buff;
+    sqe->len = len;
+    sqe->off = -1;
+    sqe->flags = flags;
+    u->sq_array[ index ] = index;
+    __atomic_store_n( u->sq_tail, tail + 1, __ATOMIC_RELEASE );
+}
+
+/**
+ * Submits what is queued and waits for as many
+ * completions, returns the bytes they moved.
+ **/
+static ssize_t uring_run( struct uring *u, unsigned count ){
+    unsigned head, tail;
+    ssize_t moved = 0;
+    unsigned done = 0;
+    int ret;
+
+    ret = syscall( __NR_io_uring_enter, u->fd, count, count,
+                   IORING_ENTER_GETEVENTS, NULL, 0 );
+    if( ret < 0 )
+        return -1;
+
+    while( done < count ){
+        head = *u->cq_head;
+        tail = __atomic_load_n( u->cq_tail, __ATOMIC_ACQUIRE );
+        if( head == tail ){
+            if( syscall( __NR_io_uring_enter, u->fd, 0, 1,
+                         IORING_ENTER_GETEVENTS, NULL, 0 ) < 0 )
+                return -1;
+            continue;
+        }
+        for( ; head != tail; head++, done++ ){
+            ret = u->cqes[ head & *u->cq_mask ].res;
+            if( ret < 0 )
+                moved = -1;
+            else if( moved >= 0 )
+                moved += ret;
+        }
+        __atomic_store_n( u->cq_head, head, __ATOMIC_RELEASE );
+    }
+    return moved;
+}
+
+static int op_uring( struct worker *w ){
+    size_t at, len;
+
+    if( target == TARGET_SLED ){
+        uring_queue( &w->ring, IORING_OP_WRITE, w->fd, w->out, w->len, 0 );
+        return uring_run( &w->ring, 1 ) == (ssize_t) w->len ? 0 : -1;
+    }
+
+    for( at=0; at<w->len; at+=len ){
+        if( stop )
+            return -1;
+        len = w->len - at < KBUFF_CHUNK ? w->len - at : KBUFF_CHUNK;
+        uring_queue( &w->ring, IORING_OP_WRITE, w->fd, w->out + at, len,
+                     IOSQE_IO_LINK );
+        uring_queue( &w->ring, IORING_OP_READ, w->fd, w->in + at, len, 0 );
+        if( uring_run( &w->ring, 2 ) != (ssize_t)( 2 * len ) )
+            return -1;
+    }
+    return 0;
+}
+#endif
+
+/**
+ * Worker
+ **/
+static void *run_worker( void *arg ){
+    struct worker *w = arg;
+    uint64_t start;
+    int ret;
+
+    while( !stop ){
+        start = now_ns();
+#ifdef HAVE_IO_URING
+        if( mode == MODE_URING )
+            ret = op_uring( w );
+        else
+#endif
+            ret = op_calls( w );
+        if( ret ){
+            //An operation cut short by the end of the run is no error
+            if( !stop )
+                w->errors++;
+            continue;
+        }
+        w->hist[ hist_index( now_ns() - start ) ]++;
+        w->ops++;
+        w->bytes += w->len;
+    }
+    return NULL;
+}
+
+/**
+ * The message a worker writes, a run of bytes for the
+ * FIFO or a batch of short blinks for the leds.
+ **/
+static size_t build_message( struct worker *w ){
+    struct sled_batch *batch;
+    size_t count, i;
+
+    if( target == TARGET_KBUFF ){
+        w->out = malloc( msg_size );
+        w->in = malloc( msg_size );
+        memset( w->out, 'k', msg_size );
+        return msg_size;
+    }
+
+    count = msg_size > sizeof( *batch ) ?
+            ( msg_size - sizeof( *batch ) ) / sizeof( struct sled_cmd ) : 1;
+    if( count == 0 )
+        count = 1;
+    if( count > SLED_MAX_BATCH )
+        count = SLED_MAX_BATCH;
+
+    batch = calloc( 1, sizeof( *batch ) + count * sizeof( struct sled_cmd ) );
+    batch->magic = SLED_BATCH_MAGIC;
+    batch->count = count;
+    for( i=0; i<count; i++ ){
+        batch->cmds[i].channel = i % 3;
+        batch->cmds[i].brightness = 255;
+        batch->cmds[i].repeat = 1;
+        batch->cmds[i].on_us = 1000;
+        batch->cmds[i].off_us = 1000;
+    }
+    w->out = (char *) batch;
+    return sizeof( *batch ) + count * sizeof( struct sled_cmd );
+}
+
+static int setup_worker( struct worker *w ){
+    const char *file = target == TARGET_KBUFF ? KBUFF_FILE : SLED_FILE;
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = w };
+    int flags = target == TARGET_KBUFF ? O_RDWR : O_WRONLY;
+
+    if( mode == MODE_EPOLL )
+        flags |= O_NONBLOCK;
+    w->fd = open( file, flags );
+    if( w->fd < 0 ){
+        fprintf( stderr, "Failed to open %s : %s\n", file, strerror( errno ) );
+        return -1;
+    }
+    w->len = build_message( w );
+
+    if( mode == MODE_EPOLL ){
+        w->epfd = epoll_create1( 0 );
+        if( w->epfd < 0 || epoll_ctl( w->epfd, EPOLL_CTL_ADD, w->fd, &ev ) )
+            return -1;
+    }
+#ifdef HAVE_IO_URING
+    if( mode == MODE_URING && uring_setup( &w->ring ) ){
+        perror( "io_uring_setup" );
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static void usage( const char *name ){
+    fprintf( stderr, "usage : %s [-T kbuffer|sled] [-m sync|epoll|uring] "
+                     "[-s bytes] [-t threads] [-d seconds]\n", name );
+    exit( EXIT_FAILURE );
+}
+
+int main( int argc, char *argv[] ){
+    static uint64_t hist[ HIST_BUCKETS ];
+    struct worker *workers;
+    uint64_t ops = 0, bytes = 0, errors = 0;
+    double elapsed;
+    uint64_t start;
+    int opt, i, j;
+
+    while( ( opt = getopt( argc, argv, "T:m:s:t:d:" ) ) != -1 ){
+        switch( opt ){
+            case 'T':
+                if( !strcmp( optarg, "kbuffer" ) )
+                    target = TARGET_KBUFF;
+                else if( !strcmp( optarg, "sled" ) )
+                    target = TARGET_SLED;
+                else
+                    usage( argv[0] );
+                break;
+            case 'm':
+                if( !strcmp( optarg, "sync" ) )
+                    mode = MODE_SYNC;
+                else if( !strcmp( optarg, "epoll" ) )
+                    mode = MODE_EPOLL;
+                else if( !strcmp( optarg, "uring" ) )
+                    mode = MODE_URING;
+                else
+                    usage( argv[0] );
+                break;
+            case 's':
+                msg_size = strtoul( optarg, NULL, 0 );
+                break;
+            case 't':
+                threads = atoi( optarg );
+                break;
+            case 'd':
+                duration = atoi( optarg );
+                break;
+            default:
+                usage( argv[0] );
+        }
+    }
+    if( msg_size == 0 || threads <= 0 || duration <= 0 )
+        usage( argv[0] );
+#ifndef HAVE_IO_URING
+    if( mode == MODE_URING ){
+        fprintf( stderr, "Built without io_uring\n" );
+        return EXIT_FAILURE;
+    }
+#endif
+
+    workers = calloc( threads, sizeof( *workers ) );
+    for( i=0; i<threads; i++ ){
+        if( setup_worker( &workers[i] ) )
+            return EXIT_FAILURE;
+    }
+
+    start = now_ns();
+    for( i=0; i<threads; i++ )
+        pthread_create( &workers[i].thread, NULL, run_worker, &workers[i] );
+    sleep( duration );
+    stop = 1;
+    for( i=0; i<threads; i++ )
+        pthread_join( workers[i].thread, NULL );
+    elapsed = ( now_ns() - start ) / 1e9;
+
+    for( i=0; i<threads; i++ ){
+        ops += workers[i].ops;
+        bytes += workers[i].bytes;
+        errors += workers[i].errors;
+        for( j=0; j<HIST_BUCKETS; j++ )
+            hist[j] += workers[i].hist[j];
+    }
+
+    printf( "\t%s, %s, %zu byte messages, %d threads, %d s\n",
+            target == TARGET_KBUFF ? KBUFF_FILE : SLED_FILE,
+            mode == MODE_SYNC ? "sync" : mode == MODE_EPOLL ? "epoll" : "uring",
+            workers[0].len, threads, duration );
+    printf( "\t%12.0f ops/s %10.2f MB/s %8llu errors\n",
+            ops / elapsed, bytes / elapsed / 1e6, (unsigned long long) errors );
+    if( ops )
+        printf( "\tlatency ns : p50 %llu | p99 %llu | p999 %llu\n",
+                (unsigned long long) hist_percentile( hist, ops, 0.50 ),
+                (unsigned long long) hist_percentile( hist, ops, 0.99 ),
+                (unsigned long long) hist_percentile( hist, ops, 0.999 ) );
+
+    return errors && !ops ? EXIT_FAILURE : EXIT_SUCCESS;
+}
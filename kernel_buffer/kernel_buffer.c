@@ -2,11 +2,28 @@
  * @file    kernel_buffer.c
  * @author  Eshan Shafeeq
  * @date    21/03/2016
- * @version 0.1
+ * @version 0.4
  * @brief   A character device driver to implement the fops
  *          structure, communication between user space and
  *          kernel space, Dynamic allocation of major number
  *          and registration of a character device.
+ *
+ *          Every open of /dev/kbuffer gets a byte stream FIFO
+ *          of its own: what is written through a file is read
+ *          back through the same file once, in order, and no
+ *          other opener can see it. Readers block while the
+ *          FIFO is empty and writers while it is full, unless
+ *          the file is O_NONBLOCK. Reads and writes may be
+ *          partial, like on a pipe.
+ *
+ *          /dev/kbuffer_broadcast is shared instead: every
+ *          write is delivered whole to the FIFO of every file
+ *          open for reading, or dropped for a reader which
+ *          has no room for it.
+ *
+ *          A FIFO can also be mapped, see kbuff_abi.h, and
+ *          spliced to and from pipes without passing through
+ *          user memory.
  */
 
 #include <linux/kernel.h>
@@ -14,11 +31,28 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/device.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/rculist.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
 #include <asm/uaccess.h>
+#include "kbuff_abi.h"
 
 #define DEVICE_NAME "kbuffer"
+#define BROADCAST_NAME "kbuffer_broadcast"
 #define CLASS_NAME  "kbuffClass"
 
+#define PRIVATE_MINOR   0
+#define BROADCAST_MINOR 1
+
 //Module Description
 //------------------
 MODULE_LICENSE("GPL");
@@ -29,13 +63,64 @@ MODULE_DESCRIPTION("Character Device Driver to hold a   \
 MODULE_VERSION("0.1");
 //MODULE_SUPPORTED_DEVICE(DEVICE_NAME);
 
+//Module Parameters
+//-----------------
+//@param buffer_size  : The size of the FIFO of every
+//                      open file in bytes, rounded up
+//                      to a power of two.
+static unsigned int buffer_size = 65536;
+module_param(buffer_size, uint, 0444);
+MODULE_PARM_DESC(buffer_size, "Size of the FIFO in bytes, 64KiB by default");
+
+//Open File Context
+//-----------------
+//@param ring         : The header page of the FIFO,
+//                      followed by its data. NULL for
+//                      a broadcast file open write only.
+//@param data         : The data of the FIFO.
+//@param read_lock    : Serializes the readers, the
+//                      FIFO is lock free for a single
+//                      reader and a single writer.
+//@param write_lock   : Serializes the writers of a
+//                      private file.
+//@param produce_lock : Serializes the broadcast writers
+//                      filling this FIFO.
+//@param readq        : Readers waiting for data.
+//@param writeq       : Writers waiting for room.
+//@param broadcast    : Whether the file is open on
+//                      /dev/kbuffer_broadcast.
+//@param bounce       : A broadcast writer copies from
+//                      user space once, into here.
+//@param dropped      : Broadcast writes this reader
+//                      had no room for.
+//@param node         : On the list of broadcast readers.
+//@param rcu          : To free the context once no
+//                      broadcast writer can see it.
+struct kbuff_ctx {
+    struct kbuff_ring   *ring;
+    char                *data;
+    struct mutex        read_lock;
+    struct mutex        write_lock;
+    spinlock_t          produce_lock;
+    wait_queue_head_t   readq;
+    wait_queue_head_t   writeq;
+    bool                broadcast;
+    char                *bounce;
+    atomic64_t          dropped;
+    struct list_head    node;
+    struct rcu_head     rcu;
+};
+
 //Module Variables
 //----------------
 //@param major_number : To store the major number
 //                      assigned to the module.
-//@param kbuffer      : To store the buffer of bytes
-//                      received from the user.
-//@param kbuff_len    : To store the size of kbuffer
+//@param ring_mask    : buffer_size - 1, kept here as
+//                      the headers can be written by
+//                      user space.
+//@param readers      : The broadcast files open for
+//                      reading, walked under RCU.
+//@param readers_lock : Protects changes to readers.
 //@param open_counter : To keep count of the number 
 //                      of times the device has been
 //                      opened.
@@ -44,27 +129,41 @@ MODULE_VERSION("0.1");
 //@param kbuff_device : To hold the registered device
 //                      structure reference.
 static int major_number;
-static char kbuff[256] = {0};
-static short kbuff_len;
-static int open_counter=0;
+static u32 ring_mask;
+static LIST_HEAD(readers);
+static DEFINE_SPINLOCK(readers_lock);
+static atomic_t open_counter = ATOMIC_INIT(0);
 
 static struct class* kbuff_class = NULL;
 static struct device* kbuff_device = NULL;
+static struct device* kbuff_broadcast_device = NULL;
 
 //Prototype Functions
 //-------------------
 static int      device_open(struct inode *, struct file *);
 static int      device_release(struct inode *, struct file *);
-static ssize_t  device_read(struct file *, char *, size_t, loff_t *);
-static ssize_t  device_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t  device_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t  device_write_iter(struct kiocb *, struct iov_iter *);
+static unsigned int device_poll(struct file *, poll_table *);
+static long     device_ioctl(struct file *, unsigned int, unsigned long);
+static int      device_mmap(struct file *, struct vm_area_struct *);
 
 //File Operations Structure
 //-------------------------
+//read() and write() go through the iter operations too,
+//which is what lets splice move pipe pages in and out.
 static struct file_operations fops = {
-    .open       =   device_open,
-    .release    =   device_release,
-    .read       =   device_read,
-    .write      =   device_write
+    .owner          =   THIS_MODULE,
+    .open           =   device_open,
+    .release        =   device_release,
+    .read_iter      =   device_read_iter,
+    .write_iter     =   device_write_iter,
+    .splice_read    =   generic_file_splice_read,
+    .splice_write   =   iter_file_splice_write,
+    .poll           =   device_poll,
+    .unlocked_ioctl =   device_ioctl,
+    .mmap           =   device_mmap,
+    .llseek         =   no_llseek
 };
 
 //Print Operations to the kernel buffer
@@ -93,6 +192,17 @@ static void kern_alert(const char *format, ...){
 
 static int __init kernel_buffer_init(void){
     kern_info("Module Initializing");
+
+    // Every open file gets a header page and a power of
+    // two of data, in memory which can be mapped
+
+    BUILD_BUG_ON(sizeof(struct kbuff_ring) > PAGE_SIZE);
+    if ( buffer_size < PAGE_SIZE )
+        buffer_size = PAGE_SIZE;
+    buffer_size = roundup_pow_of_two(buffer_size);
+    ring_mask = buffer_size - 1;
+
+    kern_info("FIFOs of %u bytes", buffer_size);
     
     // Dynamically obtain a major number
 
@@ -117,8 +227,8 @@ static int __init kernel_buffer_init(void){
 
     // Registering the device driver
 
-    kbuff_device = device_create(kbuff_class, NULL, MKDEV(major_number, 0),
-            NULL, DEVICE_NAME);
+    kbuff_device = device_create(kbuff_class, NULL,
+            MKDEV(major_number, PRIVATE_MINOR), NULL, DEVICE_NAME);
     if ( IS_ERR(kbuff_device) ){
         class_destroy(kbuff_class);
         unregister_chrdev(major_number, DEVICE_NAME);
@@ -126,17 +236,26 @@ static int __init kernel_buffer_init(void){
         return PTR_ERR(kbuff_device);
     }
 
-    kern_info("Successfully Registered the Device");
-    kern_info("Please create a device node inorder to begin communication");
-    kern_info("sudo mknod /dev/kbuffer -m 666 c %d 1", major_number);
+    kbuff_broadcast_device = device_create(kbuff_class, NULL,
+            MKDEV(major_number, BROADCAST_MINOR), NULL, BROADCAST_NAME);
+    if ( IS_ERR(kbuff_broadcast_device) ){
+        device_destroy(kbuff_class, MKDEV(major_number, PRIVATE_MINOR));
+        class_destroy(kbuff_class);
+        unregister_chrdev(major_number, DEVICE_NAME);
+        kern_alert("Failed to create and register the broadcast device");
+        return PTR_ERR(kbuff_broadcast_device);
+    }
+
+    kern_info("Successfully Registered the Devices");
 
     return 0;
 }
 
 static void __exit kernel_buffer_exit(void){
-    // Remove the device
+    // Remove the devices
 
-    device_destroy(kbuff_class, MKDEV(major_number, 0));
+    device_destroy(kbuff_class, MKDEV(major_number, BROADCAST_MINOR));
+    device_destroy(kbuff_class, MKDEV(major_number, PRIVATE_MINOR));
 
     //Remove the class
     
@@ -147,46 +266,352 @@ static void __exit kernel_buffer_exit(void){
 
     unregister_chrdev(major_number, DEVICE_NAME);
 
+    // Let the last broadcast readers be freed
+
+    rcu_barrier();
+
+    kern_info("Device was opened %d times", atomic_read(&open_counter));
     kern_info("Module Exit | Bye Bye");   
 }
 
+//context free
+//------------
+static void ctx_free(struct kbuff_ctx *ctx){
+    vfree(ctx->ring);
+    vfree(ctx->bounce);
+    kfree(ctx);
+}
+
+static void ctx_free_rcu(struct rcu_head *rcu){
+    ctx_free(container_of(rcu, struct kbuff_ctx, rcu));
+}
+
+//context alloc
+//-------------
+//A broadcast file open write only needs no FIFO.
+static struct kbuff_ctx *ctx_alloc(bool broadcast, bool reader){
+    struct kbuff_ctx *ctx;
+
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx)
+        return NULL;
+
+    mutex_init(&ctx->read_lock);
+    mutex_init(&ctx->write_lock);
+    spin_lock_init(&ctx->produce_lock);
+    init_waitqueue_head(&ctx->readq);
+    init_waitqueue_head(&ctx->writeq);
+    INIT_LIST_HEAD(&ctx->node);
+    ctx->broadcast = broadcast;
+
+    if (!broadcast || reader){
+        ctx->ring = vmalloc_user(PAGE_SIZE + buffer_size);
+        if (!ctx->ring){
+            kfree(ctx);
+            return NULL;
+        }
+        ctx->ring->magic = KBUFF_RING_MAGIC;
+        ctx->ring->size = buffer_size;
+        ctx->data = (char *)ctx->ring + PAGE_SIZE;
+    }
+    return ctx;
+}
+
 //device open
 //-----------
+//The device is a stream, there is no position to seek to.
 static int device_open(struct inode *ptr_inode, struct file *ptr_file){
-    kern_info("Device has been opened %d times", open_counter++);
-    return 0;
+    bool broadcast = iminor(ptr_inode) == BROADCAST_MINOR;
+    bool reader = ptr_file->f_mode & FMODE_READ;
+    struct kbuff_ctx *ctx;
+
+    ctx = ctx_alloc(broadcast, reader);
+    if (!ctx)
+        return -ENOMEM;
+
+    if (broadcast && reader){
+        spin_lock(&readers_lock);
+        list_add_tail_rcu(&ctx->node, &readers);
+        spin_unlock(&readers_lock);
+    }
+
+    ptr_file->private_data = ctx;
+    atomic_inc(&open_counter);
+    return nonseekable_open(ptr_inode, ptr_file);
 }
 
 //device release
 //--------------
+//A broadcast reader is freed after a grace period, a
+//writer may still be filling its FIFO.
 static int device_release(struct inode *ptr_inode, struct file *ptr_file){
-    kern_info("Device has been successfully closed");
+    struct kbuff_ctx *ctx = ptr_file->private_data;
+
+    if (ctx->broadcast && ctx->ring){
+        spin_lock(&readers_lock);
+        list_del_rcu(&ctx->node);
+        spin_unlock(&readers_lock);
+        if (atomic64_read(&ctx->dropped))
+            kern_info("Broadcast reader dropped %lld writes",
+                      (long long)atomic64_read(&ctx->dropped));
+        call_rcu(&ctx->rcu, ctx_free_rcu);
+    }else{
+        ctx_free(ctx);
+    }
     return 0;
 }
 
+//ring helpers
+//------------
+//head and tail may have been scribbled on through a
+//mapping, so the distance between them is clamped to
+//the size of the ring.
+static inline u32 ring_used(u32 head, u32 tail){
+    return min(head - tail, ring_mask + 1);
+}
+
+static inline bool ring_empty(struct kbuff_ctx *ctx){
+    return READ_ONCE(ctx->ring->head) == READ_ONCE(ctx->ring->tail);
+}
+
+static inline bool ring_full(struct kbuff_ctx *ctx){
+    return ring_used(READ_ONCE(ctx->ring->head),
+                     READ_ONCE(ctx->ring->tail)) > ring_mask;
+}
+
+//ring read
+//---------
+//Copies out what is waiting, in up to two pieces as it
+//may wrap around the end of the data. Read lock held.
+static size_t ring_read(struct kbuff_ctx *ctx, struct iov_iter *to){
+    u32 tail = READ_ONCE(ctx->ring->tail);
+    u32 head = smp_load_acquire(&ctx->ring->head);
+    size_t len = min_t(size_t, iov_iter_count(to), ring_used(head, tail));
+    size_t off = tail & ring_mask;
+    size_t first = min_t(size_t, len, ring_mask + 1 - off);
+    size_t copied;
+
+    copied = copy_to_iter(ctx->data + off, first, to);
+    if (copied == first && len > first)
+        copied += copy_to_iter(ctx->data, len - first, to);
+
+    smp_store_release(&ctx->ring->tail, tail + copied);
+    return copied;
+}
+
+//ring write
+//----------
+//Copies in what fits, the mirror of ring_read().
+//Write lock held.
+static size_t ring_write(struct kbuff_ctx *ctx, struct iov_iter *from){
+    u32 head = READ_ONCE(ctx->ring->head);
+    u32 tail = smp_load_acquire(&ctx->ring->tail);
+    size_t room = ring_mask + 1 - ring_used(head, tail);
+    size_t len = min_t(size_t, iov_iter_count(from), room);
+    size_t off = head & ring_mask;
+    size_t first = min_t(size_t, len, ring_mask + 1 - off);
+    size_t copied;
+
+    copied = copy_from_iter(ctx->data + off, first, from);
+    if (copied == first && len > first)
+        copied += copy_from_iter(ctx->data, len - first, from);
+
+    smp_store_release(&ctx->ring->head, head + copied);
+    return copied;
+}
+
+//ring put
+//--------
+//Copies a whole broadcast write into a reader's FIFO,
+//or nothing when it does not fit. Produce lock held.
+static bool ring_put(struct kbuff_ctx *ctx, const char *buff, size_t len){
+    u32 head = READ_ONCE(ctx->ring->head);
+    u32 tail = smp_load_acquire(&ctx->ring->tail);
+    size_t off = head & ring_mask;
+    size_t first = min_t(size_t, len, ring_mask + 1 - off);
+
+    if (ring_mask + 1 - ring_used(head, tail) < len)
+        return false;
+
+    memcpy(ctx->data + off, buff, first);
+    memcpy(ctx->data, buff + first, len - first);
+    smp_store_release(&ctx->ring->head, head + len);
+    return true;
+}
+
 //device read
 //-----------
-static ssize_t device_read(struct file *ptr_file, char *buffer, 
-        size_t buff_len, loff_t *offset){
-    int ret;
-    ret = copy_to_user(buffer, kbuff, kbuff_len);
-    if (ret){
+//Waits for data unless O_NONBLOCK, then copies out as
+//much as is there, up to what was asked for.
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to){
+    struct file *ptr_file = iocb->ki_filp;
+    struct kbuff_ctx *ctx = ptr_file->private_data;
+    size_t copied;
+
+    if (!ctx->ring)
+        return -EBADF;
+    if (iov_iter_count(to) == 0)
+        return 0;
+
+    if (mutex_lock_interruptible(&ctx->read_lock))
+        return -ERESTARTSYS;
+
+    while (ring_empty(ctx)){
+        mutex_unlock(&ctx->read_lock);
+        if (ptr_file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(ctx->readq, !ring_empty(ctx)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&ctx->read_lock))
+            return -ERESTARTSYS;
+    }
+
+    copied = ring_read(ctx, to);
+    mutex_unlock(&ctx->read_lock);
+    if (copied == 0){
         kern_alert("Failed to send data to user");
         return -EFAULT;
     }
-    return 0; 
+
+    wake_up_interruptible(&ctx->writeq);
+    return copied;
+}
+
+//broadcast write
+//---------------
+//Copies the write in once and hands it to every reader.
+//Writes longer than a FIFO are cut short, they could
+//never be delivered whole.
+static ssize_t broadcast_write(struct kbuff_ctx *ctx, struct iov_iter *from){
+    size_t len = min_t(size_t, iov_iter_count(from), buffer_size);
+    struct kbuff_ctx *reader;
+    bool put;
+
+    if (mutex_lock_interruptible(&ctx->write_lock))
+        return -ERESTARTSYS;
+
+    if (!ctx->bounce){
+        ctx->bounce = vmalloc(buffer_size);
+        if (!ctx->bounce){
+            mutex_unlock(&ctx->write_lock);
+            return -ENOMEM;
+        }
+    }
+    if (copy_from_iter(ctx->bounce, len, from) != len){
+        mutex_unlock(&ctx->write_lock);
+        return -EFAULT;
+    }
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(reader, &readers, node){
+        spin_lock(&reader->produce_lock);
+        put = ring_put(reader, ctx->bounce, len);
+        spin_unlock(&reader->produce_lock);
+
+        if (put)
+            wake_up_interruptible(&reader->readq);
+        else
+            atomic64_inc(&reader->dropped);
+    }
+    rcu_read_unlock();
+
+    mutex_unlock(&ctx->write_lock);
+    return len;
 }
 
 //device write
 //------------
-static ssize_t device_write(struct file *ptr_file, const char *buffer,
-        size_t buff_len, loff_t *offset){
-    sprintf(kbuff, "%s :- %d bytes", buffer, buff_len);
-    kbuff_len = strlen(kbuff);
+//Waits for room unless O_NONBLOCK, then copies in as
+//much as fits, up to what was given.
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from){
+    struct file *ptr_file = iocb->ki_filp;
+    struct kbuff_ctx *ctx = ptr_file->private_data;
+    size_t copied;
+
+    if (iov_iter_count(from) == 0)
+        return 0;
+    if (ctx->broadcast)
+        return broadcast_write(ctx, from);
+
+    if (mutex_lock_interruptible(&ctx->write_lock))
+        return -ERESTARTSYS;
+
+    while (ring_full(ctx)){
+        mutex_unlock(&ctx->write_lock);
+        if (ptr_file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(ctx->writeq, !ring_full(ctx)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&ctx->write_lock))
+            return -ERESTARTSYS;
+    }
+
+    copied = ring_write(ctx, from);
+    mutex_unlock(&ctx->write_lock);
+    if (copied == 0){
+        kern_alert("Failed to receive data from user");
+        return -EFAULT;
+    }
+
+    wake_up_interruptible(&ctx->readq);
+    return copied;
+}
+
+//device poll
+//-----------
+//A broadcast write never waits, it drops instead.
+static unsigned int device_poll(struct file *ptr_file, poll_table *wait){
+    struct kbuff_ctx *ctx = ptr_file->private_data;
+    unsigned int mask = 0;
+
+    if (ctx->broadcast)
+        mask |= POLLOUT | POLLWRNORM;
+    if (!ctx->ring)
+        return mask;
+
+    poll_wait(ptr_file, &ctx->readq, wait);
+    poll_wait(ptr_file, &ctx->writeq, wait);
+    if (!ring_empty(ctx))
+        mask |= POLLIN | POLLRDNORM;
+    if (!ctx->broadcast && !ring_full(ctx))
+        mask |= POLLOUT | POLLWRNORM;
+
+    return mask;
+}
+
+//device ioctl
+//------------
+//A mapping moved head or tail, wake up whoever waits on it.
+static long device_ioctl(struct file *ptr_file, unsigned int cmd,
+        unsigned long arg){
+    struct kbuff_ctx *ctx = ptr_file->private_data;
+
+    if (cmd != KBUFF_IOC_NOTIFY)
+        return -ENOTTY;
+
+    wake_up_interruptible(&ctx->readq);
+    wake_up_interruptible(&ctx->writeq);
+    return 0;
+}
+
+//device mmap
+//-----------
+//Maps the header page and the data in one go, or the
+//header page alone to find out the size of the data.
+//Only shared mappings, a private one would get its own
+//copy of a page on the first store and the indexes
+//would stop moving between the driver and the client.
+static int device_mmap(struct file *ptr_file, struct vm_area_struct *vma){
+    struct kbuff_ctx *ctx = ptr_file->private_data;
+    unsigned long len = vma->vm_end - vma->vm_start;
 
-    kern_info("Received %lu characters from the user", buff_len);
+    if (!ctx->ring)
+        return -ENODEV;
+    if (vma->vm_pgoff != 0 || !(vma->vm_flags & VM_SHARED) ||
+        (len != PAGE_SIZE && len != PAGE_SIZE + buffer_size))
+        return -EINVAL;
 
-    return buff_len;
+    return remap_vmalloc_range(vma, ctx->ring, 0);
 }
 
 module_init(kernel_buffer_init);
@@ -14,6 +14,10 @@
 #include <linux/timer.h>
 #include <linux/init.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/gpio/driver.h>
+#include <linux/moduleparam.h>
+#include <linux/version.h>
 
 #define DELAY_TIME 50
 /*
@@ -27,6 +31,23 @@ static struct gpio leds[] = {
     {   22, GPIOF_OUT_INIT_LOW, "LED4" }
 };
 
+static struct gpio_desc *led_descs[ ARRAY_SIZE(leds) ];
+
+/*
+ * The pins of the leds, the Pi header by
+ * default. With chip they are line offsets
+ * on the gpio chip of that label, e.g. the
+ * gpio-mockup or gpio-sim test chips.
+ */
+static int gpios[ ARRAY_SIZE(leds) ] = { 4, 17, 27, 22 };
+static int led_count = ARRAY_SIZE(leds);
+module_param_array(gpios, int, &led_count, 0444);
+MODULE_PARM_DESC(gpios, "Gpio numbers of the leds, 4,17,27,22 by default");
+
+static char *chip;
+module_param(chip, charp, 0444);
+MODULE_PARM_DESC(chip, "Label of the gpio chip the gpios are line offsets on");
+
 static struct timer_list interrupt_routine;
 
 /**
@@ -51,45 +72,84 @@ static void kern_alert(const char *format, ...){
 }
 
 
+/**
+ * Turn the gpios parameter into the
+ * global gpio numbers of leds[]
+ *
+ */
+static int chip_match(struct gpio_chip *gc, void *label){
+    return gc->label && !strcmp(gc->label, label);
+}
+
+static int setup_leds(void){
+    struct gpio_chip *gc = NULL;
+    int i, j;
+
+    //The tick shifts by the led number, so it needs one
+    if( led_count <= 0 ){
+        kern_alert("No gpios given");
+        return -EINVAL;
+    }
+    if( chip && *chip ){
+        gc = gpiochip_find(chip, chip_match);
+        if( !gc ){
+            kern_alert("No gpio chip labelled %s", chip);
+            return -ENODEV;
+        }
+    }
+    for( i=0; i<led_count; i++ ){
+        if( gc && (gpios[i] < 0 || gpios[i] >= gc->ngpio) ){
+            kern_alert("Line %d is not on %s", gpios[i], chip);
+            return -EINVAL;
+        }
+        for( j=0; j<i; j++ ){
+            if( gpios[j] == gpios[i] ){
+                kern_alert("Gpio %d is given twice", gpios[i]);
+                return -EINVAL;
+            }
+        }
+        leds[i].gpio = gc ? gc->base + gpios[i] : gpios[i];
+    }
+    return 0;
+}
+
+
+/**
+ * Set all the leds from a bitmask, bit i
+ * is leds[i]. Applied with a single array
+ * call so the gpio driver can update all
+ * the pins at once, with a per pin loop as
+ * the fallback on kernels without it.
+ *
+ */
+static void set_leds(unsigned long mask){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+    int values[ ARRAY_SIZE(leds) ];
+    size_t i;
+
+    for(i=0; i<led_count; i++)
+        values[i] = (mask >> i) & 1;
+    gpiod_set_array_value(led_count, led_descs, values);
+#else
+    size_t i;
+
+    for(i=0; i<led_count; i++)
+        gpio_set_value(leds[i].gpio, (mask >> i) & 1);
+#endif
+}
+
+
 /**
  * Timer interrupt routine
  * implementation
  *
  */
 static void interrupt_routine_function( unsigned long value ){
-    //call the apropriate method
-    switch(value){
-        case 0:
-            gpio_set_value(leds[0].gpio, 1);
-            gpio_set_value(leds[1].gpio, 0);
-            gpio_set_value(leds[2].gpio, 0);
-            gpio_set_value(leds[3].gpio, 0);
-            break;
-
-        case 1:
-            gpio_set_value(leds[0].gpio, 0);
-            gpio_set_value(leds[1].gpio, 1);
-            gpio_set_value(leds[2].gpio, 0);
-            gpio_set_value(leds[3].gpio, 0);
-            break;
-
-        case 2:
-            gpio_set_value(leds[0].gpio, 0);
-            gpio_set_value(leds[1].gpio, 0);
-            gpio_set_value(leds[2].gpio, 1);
-            gpio_set_value(leds[3].gpio, 0);
-            break;
-
-        case 3:
-            gpio_set_value(leds[0].gpio, 0);
-            gpio_set_value(leds[1].gpio, 0);
-            gpio_set_value(leds[2].gpio, 0);
-            gpio_set_value(leds[3].gpio, 1);
-            break;
-    }
+    //light the led of this step, all the others go off
+    set_leds(1UL << value);
 
     interrupt_routine.data = ++value;
-    if(value == 4)
+    if(value == led_count)
         interrupt_routine.data = 0;
     interrupt_routine.expires = jiffies + (DELAY_TIME);
     add_timer(&interrupt_routine);
@@ -103,13 +163,20 @@ static void interrupt_routine_function( unsigned long value ){
 static int __init led_controller_init(void){
     
     int ret=0;
+    size_t i;
 
     kern_info("Module Initializing");
-    ret = gpio_request_array( leds, ARRAY_SIZE(leds) );
+    ret = setup_leds();
+    if ( ret )
+        return ret;
+    ret = gpio_request_array( leds, led_count );
     if ( ret ){
         kern_alert("Uable to request for leds!");
         return ret;
     }
+    for( i=0; i<led_count; i++ ){
+        led_descs[i] = gpio_to_desc(leds[i].gpio);
+    }
 
     init_timer(&interrupt_routine);
     interrupt_routine.function = interrupt_routine_function;
@@ -128,8 +195,8 @@ static int __init led_controller_init(void){
 static void __exit led_controller_terminate(void){
     
     del_timer_sync(&interrupt_routine);
-    gpio_set_value(leds[0].gpio, 0);
-    gpio_free_array( leds, ARRAY_SIZE(leds) );
+    set_leds(0);
+    gpio_free_array( leds, led_count );
     kern_info("Module terminating | Bye bye");
     return;
 }
@@ -1,6 +1,8 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/gpio.h>
+#include <linux/gpio/driver.h>
+#include <linux/moduleparam.h>
 #include <linux/time.h>
 #include <linux/init.h>
 
@@ -12,19 +14,68 @@ static struct gpio leds[] = {
     {   22, GPIOF_OUT_INIT_LOW, "LED 3"}
 };
 
+// Pins of the leds, line offsets on chip when it is given
+static int gpios[ ARRAY_SIZE(leds) ] = { 4, 17, 27, 22 };
+static int led_count = ARRAY_SIZE(leds);
+module_param_array(gpios, int, &led_count, 0444);
+MODULE_PARM_DESC(gpios, "Gpio numbers of the leds, 4,17,27,22 by default");
+
+static char *chip;
+module_param(chip, charp, 0444);
+MODULE_PARM_DESC(chip, "Label of the gpio chip the gpios are line offsets on");
+
+static int chip_match(struct gpio_chip *gc, void *label){
+    return gc->label && !strcmp(gc->label, label);
+}
+
+//Turn the gpios parameter into global gpio numbers
+static int setup_leds(void){
+    struct gpio_chip *gc = NULL;
+    int i, j;
+
+    if (led_count <= 0){
+        printk(KERN_ALERT "LED: No gpios given\n");
+        return -EINVAL;
+    }
+    if (chip && *chip){
+        gc = gpiochip_find(chip, chip_match);
+        if (!gc){
+            printk(KERN_ALERT "LED: No gpio chip labelled %s\n", chip);
+            return -ENODEV;
+        }
+    }
+    for ( i=0; i<led_count; i++ ){
+        if (gc && (gpios[i] < 0 || gpios[i] >= gc->ngpio)){
+            printk(KERN_ALERT "LED: Line %d is not on %s\n", gpios[i], chip);
+            return -EINVAL;
+        }
+        for ( j=0; j<i; j++ ){
+            if (gpios[j] == gpios[i]){
+                printk(KERN_ALERT "LED: Gpio %d is given twice\n", gpios[i]);
+                return -EINVAL;
+            }
+        }
+        leds[i].gpio = gc ? gc->base + gpios[i] : gpios[i];
+    }
+    return 0;
+}
+
 
 //Module initlization
 static int __init led_init(void){
     int ret=0;
     int i=0;
-    ret = gpio_request_array(leds, ARRAY_SIZE(leds));
+    ret = setup_leds();
+    if ( ret < 0 )
+        return ret;
+    ret = gpio_request_array(leds, led_count);
     if ( ret < 0 ){
         printk(KERN_ALERT "LED: Unable to request for leds\n");
         return ret;
     }
     printk(KERN_INFO "LED: Leds have been successfully initialized\n");
 
-    for ( i=0; i<ARRAY_SIZE(leds); i++ ){
+    for ( i=0; i<led_count; i++ ){
         gpio_set_value(leds[i].gpio, 1);
     }
     return 0;
@@ -34,11 +85,11 @@ static int __init led_init(void){
 static void __exit led_terminate(void){
     int i;
 
-    for( i=0; i<ARRAY_SIZE(leds); i++){
+    for( i=0; i<led_count; i++){
         gpio_set_value(leds[i].gpio, 0);
     }
 
-    gpio_free_array(leds, ARRAY_SIZE(leds));
+    gpio_free_array(leds, led_count);
 }
 
 MODULE_LICENSE("GPL");
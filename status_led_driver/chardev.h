@@ -17,8 +17,16 @@
 #include <linux/fs.h>
 #include <asm/uaccess.h>
 #include <linux/device.h>
+#include <linux/cdev.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/atomic.h>
 #include "printops.h"
-#include "command_process.h"
+#include "command_queue.h"
+#include "pattern.h"
+#include "program.h"
+#include "control.h"
 
 #ifndef _CHARDEV_H_
 #define _CHARDEV_H_
@@ -26,6 +34,24 @@
 
 #define DEVICE_NAME     "sled"
 #define DEVICE_CLASS    "sled_class"
+#define CMD_BUFF_LEN    16
+
+/**
+ * Sled File
+ * ---------
+ *  The state of an open file.
+ *
+ *  @param  channel     : The channel of the device, -1 for
+ *                          /dev/sled.
+ *  @param  id          : Tags the work written through the file,
+ *                          ids are never reused.
+ *  @param  autocancel  : Whether closing the file stops its work.
+ **/
+struct sled_file {
+    int     channel;
+    u64     id;
+    bool    autocancel;
+};
 
 
 /**
@@ -33,6 +59,10 @@
  * -----------------------
  *  @param  major_number        : To store the major number assigned
  *                                  to this device;
+ *  @param  sled_cdev           : The cdev behind every minor, 0 is
+ *                                  /dev/sled for all the leds and
+ *                                  N+1 is /dev/sledN for leds[N].
+ *  @param  sled_minors         : The number of minors registered.
  *  @param  cmd_buff            : A buffer to store the command from
  *                                  the user.
  *  @param  cmd_buff_len        : To store the length of the buffer
@@ -43,11 +73,14 @@
  **/
 
 static int      major_number;
+static struct   cdev    sled_cdev;
+static unsigned int     sled_minors;
 //static char     cmd_buff;
 //static short    cmd_buff_length;
 
 static struct   class*  cmd_device_class    = NULL;
 static struct   device* cmd_device          = NULL;
+static atomic64_t       sled_file_ids       = ATOMIC64_INIT( 0 );
 
 /**
  * Prototype Functions [FOPS]
@@ -66,16 +99,27 @@ static ssize_t  device_write(   struct file *,
                                 const char *,
                                 size_t,
                                 loff_t * );
+static unsigned int device_poll( struct file *,
+                                 poll_table * );
+static long     device_ioctl(   struct file *,
+                                unsigned int,
+                                unsigned long );
+static int      device_mmap(    struct file *,
+                                struct vm_area_struct * );
 
 /**
  * File Operations Structure
  * -------------------------
  **/
 static struct file_operations fops = {
+    .owner      =   THIS_MODULE,
     .open       =   device_open,
     .release    =   device_release,
     .read       =   device_read,
-    .write      =   device_write
+    .write      =   device_write,
+    .poll       =   device_poll,
+    .unlocked_ioctl =   device_ioctl,
+    .mmap       =   device_mmap
 };
 
 /**
@@ -83,16 +127,53 @@ static struct file_operations fops = {
  * ----------------
  **/
 static int device_open( struct inode *ptr_inode, struct file *ptr_file ){
-    kern_info( 0, "Device has been opened");
+    struct sled_file *file;
+
+    file = kzalloc( sizeof( *file ), GFP_KERNEL );
+    if( !file )
+        return -ENOMEM;
+    file->channel = (int) iminor( ptr_inode ) - 1;
+    file->id = atomic64_inc_return( &sled_file_ids );
+    ptr_file->private_data = file;
+
+    kern_dbg( "Device has been opened");
     return 0;
 }
 
+/**
+ * File Channel
+ * ------------
+ *  The channel a file was opened for, -1 for /dev/sled
+ *  where the commands pick their own channel.
+ **/
+static inline int file_channel( struct file *ptr_file ){
+    return ((struct sled_file *) ptr_file->private_data)->channel;
+}
+
+/**
+ * File Owner
+ * ----------
+ *  The id the work written through a file is tagged with.
+ **/
+static inline u64 file_owner( struct file *ptr_file ){
+    return ((struct sled_file *) ptr_file->private_data)->id;
+}
+
 /**
  * Char device Release
  * -------------------
+ *  Stops the work of the file if it asked for it with
+ *  SLED_IOC_AUTOCANCEL. Otherwise its commands carry on,
+ *  which is what "echo 3 6 1 > /dev/sled" relies on.
  **/
 static int device_release( struct inode *ptr_inode, struct file *ptr_file ){
-    kern_info( 0, "Device has been released");
+    struct sled_file *file = ptr_file->private_data;
+
+    if( file->autocancel )
+        cancel_commands( file->id, -1 );
+    kfree( file );
+
+    kern_dbg( "Device has been released");
     return 0;
 }
 
@@ -105,56 +186,368 @@ static ssize_t device_read( struct file *ptr_file, char *buff,
     return 0;
 }
 
+/**
+ * Write Batch
+ * -----------
+ *  Checks a binary batch which has been copied from
+ *  user space and queues all of its commands. On the
+ *  device of a single led the channel of every command
+ *  is replaced by the one of the device.
+ **/
+static ssize_t write_batch( struct sled_batch *batch, size_t buff_len,
+                            int channel, u64 owner, bool nonblock ){
+    unsigned int i;
+    int ret;
+
+    if( batch->count > SLED_MAX_BATCH ||
+        buff_len != sizeof( *batch ) + batch->count * sizeof( batch->cmds[0] ) ){
+        stat_inc( STAT_REJECTED );
+        return -EINVAL;
+    }
+
+    for( i=0; i<batch->count; i++ ){
+        if( channel >= 0 )
+            batch->cmds[i].channel = channel;
+        if( !validate_command( &batch->cmds[i] ) ){
+            stat_add( STAT_REJECTED, batch->count );
+            return -EINVAL;
+        }
+    }
+
+    ret = enqueue_commands( batch->cmds, batch->count, owner, nonblock );
+    if( ret )
+        return ret;
+
+    return buff_len;
+}
+
+/**
+ * Write Program
+ * -------------
+ *  Plays a text pattern, see program.h. It is queued
+ *  on the channels straight away, after the commands
+ *  written before it have left the command queue. For
+ *  O_NONBLOCK the write fails with -EAGAIN rather than
+ *  wait for them.
+ **/
+static ssize_t write_program( const char *text, size_t buff_len, int channel,
+                              u64 owner, bool nonblock ){
+    int ret;
+
+    if( !nonblock )
+        flush_work( &cmd_work );
+    else if( !cmd_queue_drained() )
+        return -EAGAIN;
+    ret = play_program( text, channel, owner );
+    if( ret ){
+        stat_inc( STAT_REJECTED );
+        return ret;
+    }
+
+    stat_inc( STAT_ACCEPTED );
+    return buff_len;
+}
+
+/**
+ * Write Text
+ * ----------
+ *  Decodes text commands, one per line, and queues
+ *  them as a whole like a batch. A text which does not
+ *  parse is dropped and counted, the write still takes
+ *  it as it always did for a single command.
+ **/
+static ssize_t write_text( const char *text, size_t buff_len, int channel,
+                           u64 owner, bool nonblock ){
+    struct sled_cmd small[ TEXT_CMDS( CMD_BUFF_LEN ) ];
+    struct sled_cmd *cmds = small;
+    size_t max = TEXT_CMDS( buff_len );
+    ssize_t ret;
+    int count, err;
+
+    if( max > ARRAY_SIZE( small ) ){
+        cmds = kmalloc_array( max, sizeof( *cmds ), GFP_KERNEL );
+        if( !cmds )
+            return -ENOMEM;
+    }
+
+    ret = buff_len;
+    count = parse_commands( text, buff_len, channel, cmds, max );
+    if( count > 0 ){
+        err = enqueue_commands( cmds, count, owner, nonblock );
+        if( err )
+            ret = err;
+    }else{
+        stat_inc( STAT_REJECTED );
+    }
+
+    if( cmds != small )
+        kfree( cmds );
+    return ret;
+}
+
+/**
+ * Stop Text
+ * ---------
+ *  Tells whether a write is "stop", which stops all
+ *  the work on the leds of the device.
+ **/
+static inline bool stop_text( const char *text, size_t buff_len ){
+    return ( buff_len == 4 || ( buff_len == 5 && text[4] == '\n' ) ) &&
+           !strncmp( text, "stop", 4 );
+}
+
 /**
  * Char device Write
  * -----------------
+ *  The commands are decoded and queued, the write never
+ *  waits for the blink. A write is either text commands,
+ *  a text pattern, "stop" or a binary sled_batch, told
+ *  apart by the magic at the start of the buffer and the
+ *  digit a text command starts with. If the queue is full
+ *  the write waits for room, or fails with -EAGAIN for
+ *  O_NONBLOCK.
  **/
 static ssize_t device_write( struct file *ptr_file, const char *buff,
                              size_t buff_len,       loff_t *offset ){
-    kern_info( 0, "Recieved %d bytes from user", buff_len );
-    process_command( buff, buff_len );
+    bool nonblock = ptr_file->f_flags & O_NONBLOCK;
+    int channel = file_channel( ptr_file );
+    u64 owner = file_owner( ptr_file );
+    char cmd_buff[ CMD_BUFF_LEN ] __aligned( 4 );
+    struct sled_batch *batch;
+    ssize_t ret;
 
-    return buff_len;
+    kern_dbg( "Recieved %zu bytes from user", buff_len );
+    if( buff_len == 0 )
+        return 0;
+
+    //Binary batch or long text, copied in with a single copy_from_user
+    if( buff_len >= CMD_BUFF_LEN ){
+        if( buff_len > sizeof( *batch ) + SLED_MAX_BATCH * sizeof( batch->cmds[0] ) )
+            return -E2BIG;
+
+        batch = memdup_user_nul( buff, buff_len );
+        if( IS_ERR( batch ) )
+            return PTR_ERR( batch );
+
+        ret = -EINVAL;
+        if( batch->magic == SLED_BATCH_MAGIC )
+            ret = write_batch( batch, buff_len, channel, owner, nonblock );
+        else if( !program_text( (char *) batch ) )
+            ret = write_text( (char *) batch, buff_len, channel, owner, nonblock );
+        else if( buff_len <= PROGRAM_MAX_TEXT )
+            ret = write_program( (char *) batch, buff_len, channel, owner,
+                                 nonblock );
+        else
+            stat_inc( STAT_REJECTED );
+        kfree( batch );
+        return ret;
+    }
+
+    if( copy_from_user( cmd_buff, buff, buff_len ) )
+        return -EFAULT;
+    cmd_buff[ buff_len ] = '\0';
+
+    if( buff_len >= sizeof( *batch ) &&
+        ((struct sled_batch *) cmd_buff)->magic == SLED_BATCH_MAGIC )
+        return write_batch( (struct sled_batch *) cmd_buff, buff_len,
+                            channel, owner, nonblock );
+
+    if( stop_text( cmd_buff, buff_len ) ){
+        cancel_commands( 0, channel );
+        return buff_len;
+    }
+
+    if( program_text( cmd_buff ) )
+        return write_program( cmd_buff, buff_len, channel, owner, nonblock );
+
+    return write_text( cmd_buff, buff_len, channel, owner, nonblock );
+}
+
+/**
+ * Char device Poll
+ * ----------------
+ *  The device is writable while the command
+ *  queue has room for another command.
+ **/
+static unsigned int device_poll( struct file *ptr_file, poll_table *wait ){
+    unsigned int mask = 0;
+
+    poll_wait( ptr_file, &cmd_wait, wait );
+    if( !cmd_queue_full() )
+        mask |= POLLOUT | POLLWRNORM;
+
+    return mask;
+}
+
+
+/**
+ * Char device Ioctl
+ * -----------------
+ *  Stops work and sets the autocancel flag of the
+ *  file. Everything else uploads, triggers, pauses,
+ *  resumes and cancels the preloaded patterns.
+ **/
+static long device_ioctl( struct file *ptr_file, unsigned int cmd,
+                          unsigned long arg ){
+    struct sled_file *file = ptr_file->private_data;
+
+    if( _IOC_TYPE( cmd ) != SLED_IOC_MAGIC )
+        return -ENOTTY;
+
+    switch( cmd ){
+        case SLED_IOC_STOP:
+            if( arg & ~SLED_STOP_ALL )
+                return -EINVAL;
+            return cancel_commands( arg ? 0 : file->id, file->channel );
+        case SLED_IOC_AUTOCANCEL:
+            file->autocancel = !!arg;
+            return 0;
+    }
+    return pattern_ioctl( cmd, arg, file->channel );
 }
 
 
+/**
+ * Control page mapping open
+ * -------------------------
+ *  Every mapping holds the leds and keeps
+ *  the control page sampled.
+ **/
+static void control_vm_open( struct vm_area_struct *vma ){
+    unsigned long flags;
+    size_t i;
+
+    for( i=0; i<CHANNEL_COUNT; i++ ){
+        spin_lock_irqsave( &channels[i].lock, flags );
+        hold_channel_led( &channels[i] );
+        spin_unlock_irqrestore( &channels[i].lock, flags );
+    }
+    start_control();
+}
+
+/**
+ * Control page mapping close
+ * --------------------------
+ **/
+static void control_vm_close( struct vm_area_struct *vma ){
+    unsigned long flags;
+    size_t i;
+
+    stop_control();
+    for( i=0; i<CHANNEL_COUNT; i++ ){
+        spin_lock_irqsave( &channels[i].lock, flags );
+        drop_channel_led( &channels[i] );
+        spin_unlock_irqrestore( &channels[i].lock, flags );
+    }
+}
+
+static const struct vm_operations_struct control_vm_ops = {
+    .open       =   control_vm_open,
+    .close      =   control_vm_close
+};
+
+/**
+ * Char device Mmap
+ * ----------------
+ *  Maps the control page, see struct sled_control.
+ *  Only shared mappings, a private one would get a
+ *  copy of the page on the first store and the driver
+ *  would never see it.
+ **/
+static int device_mmap( struct file *ptr_file, struct vm_area_struct *vma ){
+    int ret;
+
+    if( vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE ||
+        !( vma->vm_flags & VM_SHARED ) )
+        return -EINVAL;
+
+    ret = remap_pfn_range( vma, vma->vm_start,
+                           virt_to_phys( control ) >> PAGE_SHIFT,
+                           PAGE_SIZE, vma->vm_page_prot );
+    if( ret )
+        return ret;
+
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_ops = &control_vm_ops;
+    control_vm_open( vma );
+
+    return 0;
+}
+
+
+/**
+ * Remove the devices
+ * ------------------
+ *  Destroys the device nodes of the first count minors.
+ **/
+static void remove_devices( unsigned int count ){
+    while( count-- )
+        device_destroy( cmd_device_class, MKDEV( major_number, count ) );
+}
+
 /**
  * Setup character device function
  * -------------------------------
+ *  Registers /dev/sled, which takes commands for
+ *  every led, and one /dev/sledN per led.
  **/
 static int setup_chardev(void){
-    kern_info( 0, "Character device setup");
+    dev_t devt;
+    unsigned int i;
+    int ret;
+
+    kern_info( "Character device setup");
     
-    //Major number setup
-    major_number = register_chrdev( 0, DEVICE_NAME, &fops );
-    if( major_number < 0 ){
-        kern_alert( 0, "Failed to obtain a MAJOR_NUMBER");
-        return major_number;
+    //Major number setup, one minor per led plus the group
+    sled_minors = CHANNEL_COUNT + 1;
+    ret = alloc_chrdev_region( &devt, 0, sled_minors, DEVICE_NAME );
+    if( ret < 0 ){
+        kern_alert( "Failed to obtain a MAJOR_NUMBER");
+        return ret;
     }
+    major_number = MAJOR( devt );
+
+    kern_info( "Successfully Obtained the MAJOR_NUMBER : %d", major_number );
 
-    kern_info( 3, "Successfully Obtained the MAJOR_NUMBER : %d", major_number );
+    cdev_init( &sled_cdev, &fops );
+    sled_cdev.owner = THIS_MODULE;
+    ret = cdev_add( &sled_cdev, devt, sled_minors );
+    if( ret < 0 ){
+        unregister_chrdev_region( devt, sled_minors );
+        kern_alert( "Failed to add the cdev");
+        return ret;
+    }
 
     //Device class setup
     cmd_device_class = class_create( THIS_MODULE, DEVICE_CLASS );
     if( IS_ERR( cmd_device_class ) ){
-        unregister_chrdev( major_number, DEVICE_NAME );
-        kern_alert( 0, "Failed to register the DEVICE CLASS");
+        cdev_del( &sled_cdev );
+        unregister_chrdev_region( devt, sled_minors );
+        kern_alert( "Failed to register the DEVICE CLASS");
         return PTR_ERR( cmd_device_class );
     }
 
-    kern_info( 0, "Successfully Registered the DEIVCE CLASS");
+    kern_info( "Successfully Registered the DEIVCE CLASS");
 
     //Deivce Registration setup
-    cmd_device = device_create( cmd_device_class, NULL, MKDEV( major_number, 0 ),
-                                NULL,                              DEVICE_NAME );
-    if( IS_ERR( cmd_device ) ){
-        class_destroy( cmd_device_class );
-        unregister_chrdev( major_number, DEVICE_NAME );
-        kern_alert( 0, "Failed to register device");
-        return PTR_ERR( cmd_device );
+    for( i=0; i<sled_minors; i++ ){
+        if( i == 0 )
+            cmd_device = device_create( cmd_device_class, NULL, MKDEV( major_number, 0 ),
+                                        NULL,                              DEVICE_NAME );
+        else
+            cmd_device = device_create( cmd_device_class, NULL, MKDEV( major_number, i ),
+                                        NULL,                DEVICE_NAME "%u", i - 1 );
+        if( IS_ERR( cmd_device ) ){
+            remove_devices( i );
+            class_destroy( cmd_device_class );
+            cdev_del( &sled_cdev );
+            unregister_chrdev_region( devt, sled_minors );
+            kern_alert( "Failed to register device");
+            return PTR_ERR( cmd_device );
+        }
     }
 
-    kern_info( 0, "Successfully Registered the DEVICE");
+    kern_info( "Successfully Registered %u DEVICES", sled_minors );
 
     return 0;
 }
@@ -165,16 +558,17 @@ static int setup_chardev(void){
  **/
 static void remove_chardev(void){
     
-    kern_info( 0, "Character device removal");
+    kern_info( "Character device removal");
 
-    //Remove the device
-    device_destroy( cmd_device_class, MKDEV( major_number, 0) );
+    //Remove the devices
+    remove_devices( sled_minors );
 
     //Remove class
     class_unregister( cmd_device_class );
     class_destroy( cmd_device_class );
 
-    //Unregbister Major number
-    unregister_chrdev( major_number, DEVICE_NAME );
+    //Unregister the cdev and the minors
+    cdev_del( &sled_cdev );
+    unregister_chrdev_region( MKDEV( major_number, 0 ), sled_minors );
 }
 #endif
@@ -12,114 +12,286 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
 #include "printops.h"
 #include "interrupt.h"
 
 #ifndef _PROCESSCOMMAND_H_
 #define _PROCESSCOMMAND_H_
 
+/**
+ * Text Commands
+ *
+ * A text command is three digits with a space between
+ * them, "3 6 1", ended by a newline or the end of the
+ * write. Several of them can be written at once, one
+ * per line. Every command fits in a 64 bit word, so it
+ * is loaded, checked and decoded as a whole instead of
+ * byte by byte. Byte i of the command is byte i of the
+ * word, counting from the least significant one.
+ *
+ * @param   TEXT_CMD_LEN    The length of a command
+ *                          without its newline.
+ * @param   TEXT_DIGITS     The bytes holding the digits.
+ * @param   TEXT_SPACES     The bytes holding the spaces.
+ * @param   TEXT_END        The byte after the command.
+ *
+ **/
+#define     TEXT_CMD_LEN        5
+#define     TEXT_BYTES( b )     ( 0x0101010101010101ULL * (u8)( b ) )
+#define     TEXT_DIGITS         0x000000ff00ff00ffULL
+#define     TEXT_SPACES         0x00000000ff00ff00ULL
+#define     TEXT_END( w )       ( (u8)( ( w ) >> 40 ) )
+
+/**
+ * The most commands a text of len bytes can hold
+ **/
+#define     TEXT_CMDS( len )    ( ( (len) + 1 ) / ( TEXT_CMD_LEN + 1 ) )
+
+/**
+ * Load Text Word
+ *
+ * @brief   Loads the next 8 bytes of the text, the
+ *          missing ones read as 0 near the end. Never
+ *          reads past the buffer.
+ *
+ * @param   p       The text.
+ * @param   left    The number of bytes left from p.
+ *
+ **/
+static inline u64 load_text_word( const char *p, size_t left ){
+    u64 w = 0;
+
+    if( left >= sizeof( w ) )
+        return get_unaligned_le64( p );
+    memcpy( &w, p, left );
+    return le64_to_cpu( w );
+}
+
+/**
+ * Text Command Word
+ *
+ * @brief   Checks the shape of the command at the
+ *          start of a word, all five bytes at once.
+ *          A digit has 3 for its high nibble and keeps
+ *          it with 6 added, the other bytes with that
+ *          nibble are above '9'. The bytes do not carry
+ *          into each other, none of them is above 0x3f
+ *          once the first test passed.
+ *
+ * @param   w       The word, from load_text_word().
+ *
+ **/
+static inline bool text_command_word( u64 w ){
+    u64 digits = w & TEXT_DIGITS;
+    u64 zeros = TEXT_BYTES( '0' ) & TEXT_DIGITS;
+
+    return ( w & TEXT_SPACES ) == ( TEXT_BYTES( ' ' ) & TEXT_SPACES ) &&
+           ( digits & TEXT_BYTES( 0xf0 ) ) == zeros &&
+           ( ( digits + ( TEXT_BYTES( 6 ) & TEXT_DIGITS ) ) & TEXT_BYTES( 0xf0 ) ) == zeros;
+}
+
 /**
  * Validate buffer
  *
  * @brief   This function validates the buffer received
- *          from the user. Makes sure only white space
- *          and numeric values are given as command.
+ *          from the user. Makes sure it holds a single
+ *          text command, with or without its newline.
  *
  * @param   buff        The buffer received from the user
  * @param   buff_len    The length of the buffer
- * @param   buff_i      The value of buff[i] converted to
- *                      ACII value.
- * @param   space       To keep count of the white space 
- * @param   num         To keep count of the numeric digits
  *
  **/
 static inline bool validate_buffer( const char *buff, size_t buff_len ){
-    size_t i;
-    int buff_i = 0;
-    short space=0;
-    short num=0;
-
-    for( i=0; i<buff_len-1; i++ ){
-        buff_i = buff[i] - '0';
-        //debug
-        //kern_info( 0, "processing #%i : %c - %d", i, buff[i], buff_i );
-        //
-        if( buff_i == -16 || buff_i > -1 ){
-            if( buff_i == -16 ) 
-                space++;
-            if( buff_i > -1 && buff_i < 10 ) 
-                num++;
-        }else{
-            return false;
-        }
+    u64 w;
+
+    if( buff_len < TEXT_CMD_LEN || buff_len > TEXT_CMD_LEN + 1 )
+        return false;
+
+    w = load_text_word( buff, buff_len );
+    return text_command_word( w ) &&
+           ( buff_len == TEXT_CMD_LEN || TEXT_END( w ) == '\n' );
+}
+
+/**
+ * Resolve Led
+ *
+ * @brief   Converts a color from the text command
+ *          into the channel of the led. Returns -1
+ *          for an unknown color.
+ *
+ * @param   color   The color obtained from the command.
+ *
+ **/
+static inline int resolve_led( short color ){
+    switch( color ){
+        case RED:
+            return SLED_RED;
+        case GREEN:
+            return SLED_GREEN;
+        case BLUE:
+            return SLED_BLUE;
     }
-    if( space == 2 && num == 3 )
-        return true;
-    else
+    return -1;
+}
+
+/**
+ * Resolve Delay
+ *
+ * @brief   Converts a delay from the text command
+ *          into microseconds.
+ *
+ * @param   delay   The delay obtained from the command.
+ *
+ **/
+static inline u32 resolve_delay( short delay ){
+    switch( delay ){
+        case SHORT:
+            return jiffies_to_usecs( SHORT_DELAY );
+        case NORMAL:
+            return jiffies_to_usecs( NORMAL_DELAY );
+        case LONG:
+            return jiffies_to_usecs( LONG_DELAY );
+    }
+    return jiffies_to_usecs( DELAY_TIME );
+}
+
+/**
+ * Validate Command
+ *
+ * @brief   Makes sure a binary command addresses an
+ *          existing channel, blinks at least once, holds
+ *          both of its steps for SLED_MIN_STEP_US or more
+ *          and has a valid priority.
+ *
+ * @param   cmd     The command to check.
+ *
+ **/
+static inline bool validate_command( const struct sled_cmd *cmd ){
+    return cmd->channel < CHANNEL_COUNT && cmd->repeat > 0 &&
+           cmd->on_us >= SLED_MIN_STEP_US && cmd->off_us >= SLED_MIN_STEP_US &&
+           cmd->priority <= SLED_MAX_PRIORITY;
+}
+
+/**
+ * Decode Command
+ *
+ * @brief   Turns a checked text command into a
+ *          binary command.
+ *
+ * @param   w           The word of the command.
+ * @param   channel     The channel of the device the command was
+ *                      written to, or -1 to pick it by color.
+ * @param   cmd         To store the decoded command
+ *
+ **/
+static inline bool decode_command( u64 w, int channel, struct sled_cmd *cmd ){
+    short color = w & 0x0f;
+    short delay = ( w >> 16 ) & 0x0f;
+    int led;
+
+    led = channel < 0 ? resolve_led( color ) : channel;
+    if( led < 0 )
         return false;
+
+    cmd->channel    = led;
+    cmd->brightness = 255;
+    cmd->repeat     = ( w >> 32 ) & 0x0f;
+    cmd->on_us      = resolve_delay( delay );
+    cmd->off_us     = cmd->on_us;
+    cmd->fade_ms    = 0;
+    cmd->flags      = 0;
+    cmd->priority   = 0;
+
+    kern_dbg( "color %d delay %d QTY : %d", color, delay, cmd->repeat );
+    return validate_command( cmd );
 }
 
 /**
- * Process Command
+ * Parse Commands
  *
- * @brief   This function processes the command
- *          received by the buffer and executes
- *          the proper action.
+ * @brief   This function validates and decodes the
+ *          text commands received by the buffer, one
+ *          word per command. It does not allocate or
+ *          sleep so it can run in the write path before
+ *          the commands are queued. Returns the number of
+ *          commands, or -EINVAL if any of them is wrong.
  *
- * @param   buff        The buffer received from the user
+ * @param   buff        The buffer received from the user,
+ *                      already copied into kernel memory.
  * @param   buff_len    The length of the buffer
- * @param   color       To store the color selected by the user
- * @param   delay       To store the delay length selected by the user
- * @param   qty         To store the number of blinks selected
+ * @param   channel     The channel of the device the commands were
+ *                      written to, or -1 to pick it by color.
+ * @param   cmds        To store the decoded commands
+ * @param   max         The room in cmds, TEXT_CMDS( buff_len )
+ *                      fits them all.
  *
  **/
-static void process_command( const char *buff, size_t buff_len ){
-//    size_t i;
-    short color;
-    short delay;
-    short qty;
-
-    if( validate_buffer( buff, buff_len ) ){
-        kern_info( buff_len-2, "buffer : %s", buff);
-        /*  --DEBUG--
-         *  kern_info(0, "     index: char|ascii|int cast");
-            kern_info(0, "     --------------------------");
-        for( i=0; i<buff_len-1; i++ ){
-            kern_info(0, "analysis #%i:  %c | %d  | %d", i, buff[i], buff[i], buff[i] - '0');
-        }*/
-
-        color = buff[0] - '0';
-        delay = buff[2] - '0';
-        qty   = buff[4] - '0';
-
-        switch(color){
-            case RED:
-                kern_info( 0, "RED color selected");
-                break;
-            case GREEN:
-                kern_info( 0, "GREEN color selected");
-                break;
-            case BLUE:
-                kern_info( 0, "BLUE color selected");
-                break;
-        }
-        switch(delay){
-            case SHORT:
-                kern_info( 0, "SHORT time delay selected");
-                break;
-            case NORMAL:
-                kern_info( 0, "NORMAL time delay selected");
-                break;
-            case LONG:
-                kern_info( 0, "LONG time delay selected");
-                break;
-        }
-
-        kern_info( 0, "QTY : %d", qty );
-        start_timer_interrupt(color, delay, qty);
-        
+static int parse_commands( const char *buff, size_t buff_len, int channel,
+                           struct sled_cmd *cmds, size_t max ){
+    size_t at = 0;
+    size_t count = 0;
+    u64 w;
+
+    while( at < buff_len ){
+        if( buff_len - at < TEXT_CMD_LEN )
+            return -EINVAL;
+        if( count == max )
+            return -E2BIG;
+
+        w = load_text_word( buff + at, buff_len - at );
+        if( !text_command_word( w ) ||
+            !decode_command( w, channel, &cmds[ count ] ) )
+            return -EINVAL;
+        count++;
+
+        at += TEXT_CMD_LEN;
+        if( at == buff_len )
+            break;
+        if( TEXT_END( w ) != '\n' )
+            return -EINVAL;
+        at++;
     }
 
+    if( !count )
+        return -EINVAL;
+
+    kern_dbg( "%zu text commands in %zu bytes", count, buff_len );
+    return count;
+}
+
+/**
+ * Parse Command
+ *
+ * @brief   Decodes a buffer holding a single
+ *          text command.
+ *
+ * @param   buff        The buffer received from the user
+ * @param   buff_len    The length of the buffer
+ * @param   channel     The channel of the device, or -1.
+ * @param   cmd         To store the decoded command
+ *
+ **/
+static inline bool parse_command( const char *buff, size_t buff_len, int channel,
+                                  struct sled_cmd *cmd ){
+    return parse_commands( buff, buff_len, channel, cmd, 1 ) == 1;
+}
+
+/**
+ * Process Command
+ *
+ * @brief   This function executes a decoded
+ *          command on the matching channel.
+ *
+ * @param   cmd     The command to execute
+ * @param   owner   The id of the file which wrote it
+ *
+ **/
+static void process_command( const struct sled_cmd *cmd, u64 owner ){
+    trace_sled_command( cmd->channel, cmd->brightness, cmd->repeat,
+                        cmd->on_us, cmd->off_us, cmd->fade_ms );
+    start_timer_interrupt( cmd, owner );
 }
 
 #endif
@@ -0,0 +1,218 @@
+/**
+ * @file    command_queue.h
+ * @version 0.1
+ * @brief   This file implements the bounded queue
+ *          between the write path and the sequencers.
+ *          Writers push decoded commands into a ring
+ *          and return straight away, a work item drains
+ *          the ring and hands the commands to the
+ *          channels from process context.
+ *
+ **/
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/kfifo.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include "printops.h"
+#include "command_process.h"
+
+#ifndef _COMMAND_QUEUE_H_
+#define _COMMAND_QUEUE_H_
+
+/**
+ * The number of commands the ring can hold,
+ * must be a power of two. A whole batch has
+ * to fit in the ring.
+ **/
+#define     CMD_QUEUE_SIZE      SLED_MAX_BATCH
+
+/**
+ * The number of commands the worker takes
+ * out of the ring at once.
+ **/
+#define     CMD_DRAIN_CHUNK     16
+
+/**
+ * Queued Command
+ *
+ * @param   cmd     The decoded command.
+ * @param   owner   The id of the file which wrote it.
+ *
+ **/
+struct queued_cmd {
+    struct sled_cmd cmd;
+    u64             owner;
+};
+
+/**
+ * Globals
+ *
+ * @param   cmd_fifo        The ring of decoded commands.
+ *                          The single consumer reads it
+ *                          without a lock.
+ * @param   cmd_fifo_lock   Serializes the writers pushing
+ *                          into the ring.
+ * @param   cmd_wait        Wait queue for writers and pollers
+ *                          waiting for space in the ring.
+ * @param   cmd_work        The work item draining the ring.
+ *
+ **/
+static DEFINE_KFIFO( cmd_fifo, struct queued_cmd, CMD_QUEUE_SIZE );
+static DEFINE_SPINLOCK( cmd_fifo_lock );
+static DECLARE_WAIT_QUEUE_HEAD( cmd_wait );
+
+static void cmd_queue_worker( struct work_struct *work );
+static DECLARE_WORK( cmd_work, cmd_queue_worker );
+
+/**
+ * Command Queue Worker
+ *
+ * @brief   Drains the ring and starts every command
+ *          on its channel, then wakes up the writers
+ *          waiting for space.
+ *
+ * @param   work    The work item, unused.
+ *
+ **/
+static void cmd_queue_worker( struct work_struct *work ){
+    struct queued_cmd cmds[ CMD_DRAIN_CHUNK ];
+    unsigned int count;
+    unsigned int i;
+
+    while( ( count = kfifo_out( &cmd_fifo, cmds, CMD_DRAIN_CHUNK ) ) ){
+        for( i=0; i<count; i++ ){
+            process_command( &cmds[i].cmd, cmds[i].owner );
+        }
+        wake_up_interruptible( &cmd_wait );
+    }
+}
+
+/**
+ * Command Queue Full
+ *
+ * @brief   Tells whether there is room for
+ *          another command in the ring.
+ *
+ **/
+static inline bool cmd_queue_full( void ){
+    return kfifo_is_full( &cmd_fifo );
+}
+
+/**
+ * Command Queue Room
+ *
+ * @brief   Tells whether count more commands
+ *          fit in the ring.
+ *
+ * @param   count   The number of commands.
+ *
+ **/
+static inline bool cmd_queue_room( unsigned int count ){
+    return kfifo_avail( &cmd_fifo ) >= count;
+}
+
+/**
+ * Command Queue Drained
+ *
+ * @brief   Tells whether every queued command has
+ *          reached its channel, the ring is empty and
+ *          the worker is not handing out a chunk.
+ *
+ **/
+static inline bool cmd_queue_drained( void ){
+    return kfifo_is_empty( &cmd_fifo ) && !work_busy( &cmd_work );
+}
+
+/**
+ * Enqueue Commands
+ *
+ * @brief   Pushes a batch of commands into the ring and
+ *          kicks the worker. The batch goes in as a whole.
+ *          When there is no room it returns -EAGAIN if
+ *          nonblock is set, otherwise it waits for the
+ *          worker to make room.
+ *
+ * @param   cmds        The commands to queue.
+ * @param   count       The number of commands.
+ * @param   owner       The id of the file writing them.
+ * @param   nonblock    Whether the file was opened O_NONBLOCK.
+ *
+ **/
+static int enqueue_commands( const struct sled_cmd *cmds, unsigned int count,
+                             u64 owner, bool nonblock ){
+    struct queued_cmd entry = { .owner = owner };
+    unsigned int i;
+    int ret;
+
+    if( count > CMD_QUEUE_SIZE )
+        return -E2BIG;
+
+    for( ;; ){
+        spin_lock( &cmd_fifo_lock );
+        if( cmd_queue_room( count ) ){
+            for( i=0; i<count; i++ ){
+                entry.cmd = cmds[i];
+                kfifo_put( &cmd_fifo, entry );
+            }
+            stat_queue_depth( kfifo_len( &cmd_fifo ) );
+            spin_unlock( &cmd_fifo_lock );
+            break;
+        }
+        spin_unlock( &cmd_fifo_lock );
+
+        if( nonblock )
+            return -EAGAIN;
+
+        schedule_work( &cmd_work );
+        ret = wait_event_interruptible( cmd_wait, cmd_queue_room( count ) );
+        if( ret )
+            return ret;
+    }
+
+    stat_add( STAT_ACCEPTED, count );
+    schedule_work( &cmd_work );
+    return 0;
+}
+
+/**
+ * Cancel Commands
+ *
+ * @brief   Stops the work of a file, or all the work on
+ *          the channels for owner 0. The ring is drained
+ *          first so the commands the file wrote are on the
+ *          channels by then, nothing it wrote starts later.
+ *          Returns the number of sequences stopped.
+ *
+ * @param   owner       The id of the file, or 0 for everyone.
+ * @param   channel     The channel to stop, or -1 for all.
+ *
+ **/
+static unsigned int cancel_commands( u64 owner, int channel ){
+    unsigned int count = 0;
+    size_t i;
+
+    flush_work( &cmd_work );
+    for( i=0; i<CHANNEL_COUNT; i++ ){
+        if( channel < 0 || i == (size_t) channel )
+            count += cancel_channel( &channels[i], owner );
+    }
+    kern_dbg( "%u sequences cancelled", count );
+    return count;
+}
+
+/**
+ * Remove Command Queue
+ *
+ * @brief   Waits for the worker to finish so no
+ *          command reaches the channels afterwards.
+ *
+ **/
+static void remove_command_queue( void ){
+    kern_info( "Removing command queue");
+    cancel_work_sync( &cmd_work );
+    kfifo_reset( &cmd_fifo );
+}
+#endif
@@ -0,0 +1,175 @@
+/**
+ * @file    control.h
+ * @version 0.1
+ * @brief   This file implements the shared control
+ *          page of the device. User space maps the page
+ *          and stores the desired state of the leds in it,
+ *          a timer samples the page every tick while it is
+ *          mapped and applies the changes.
+ *
+ **/
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/timer.h>
+#include <linux/gfp.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include "printops.h"
+#include "led_gpio.h"
+#include "soft_pwm.h"
+#include "sled_abi.h"
+
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+/**
+ * Jiffies between two samples of the page
+ **/
+#define     CONTROL_PERIOD      1
+
+/**
+ * Globals
+ *
+ * @param   control         The shared page.
+ * @param   control_users   The number of mappings of the page,
+ *                          the page is sampled while it is mapped.
+ * @param   control_seq     The last sequence counter applied.
+ * @param   control_timer   The timer sampling the page.
+ * @param   control_lock    Serializes the first mapping starting
+ *                          the timer and the last one stopping it.
+ *
+ **/
+static struct sled_control *control;
+static atomic_t control_users = ATOMIC_INIT( 0 );
+static u32 control_seq;
+static struct timer_list control_timer;
+static DEFINE_MUTEX( control_lock );
+
+/**
+ * Control Overrides
+ *
+ * @brief   Tells whether the control page owns a led,
+ *          in which case the sequencers leave it alone.
+ *
+ * @param   index   The index of the led.
+ *
+ **/
+static inline bool control_overrides( size_t index ){
+    return atomic_read( &control_users ) &&
+           READ_ONCE( control->channels[ index ].enabled );
+}
+
+/**
+ * Control Sample
+ *
+ * @brief   Applies the page to the leds if user space
+ *          has bumped the sequence counter. The counter is
+ *          read again afterwards and a torn update is picked
+ *          up on the next tick.
+ *
+ **/
+static void control_sample( void ){
+    struct sled_control_channel state;
+    u32 seq;
+    size_t i;
+
+    seq = READ_ONCE( control->seq );
+    if( seq == control_seq )
+        return;
+    smp_rmb();
+
+    for( i=0; i<led_count; i++ ){
+        state = READ_ONCE( control->channels[i] );
+        if( state.enabled )
+            pwm_set_level( i, state.level, 0, false );
+    }
+
+    smp_rmb();
+    if( READ_ONCE( control->seq ) == seq )
+        control_seq = seq;
+}
+
+/**
+ * Control Routine
+ *
+ * @brief   The timer routine sampling the page
+ *          for as long as it is mapped.
+ *
+ * @param   value   Unused.
+ *
+ **/
+static void control_routine( unsigned long value ){
+    control_sample();
+    if( atomic_read( &control_users ) )
+        mod_timer( &control_timer, jiffies + CONTROL_PERIOD );
+}
+
+/**
+ * Start Control
+ *
+ * @brief   Called for every new mapping of the page,
+ *          the first one starts the sampling timer.
+ *
+ **/
+static void start_control( void ){
+    mutex_lock( &control_lock );
+    if( atomic_inc_return( &control_users ) == 1 ){
+        control_seq = READ_ONCE( control->seq ) - 1;
+        mod_timer( &control_timer, jiffies );
+    }
+    mutex_unlock( &control_lock );
+}
+
+/**
+ * Stop Control
+ *
+ * @brief   Called when a mapping of the page goes away,
+ *          the last one stops the sampling timer. Under the
+ *          lock, so a new mapping can not start the timer
+ *          between the count dropping to 0 and the timer
+ *          being killed.
+ *
+ **/
+static void stop_control( void ){
+    mutex_lock( &control_lock );
+    if( atomic_dec_and_test( &control_users ) )
+        del_timer_sync( &control_timer );
+    mutex_unlock( &control_lock );
+}
+
+/**
+ * Setup Control
+ *
+ * @brief   Allocates the shared page.
+ *
+ **/
+static int setup_control( void ){
+    kern_info( "Setting up control page" );
+
+    control = (struct sled_control *) get_zeroed_page( GFP_KERNEL );
+    if( !control ){
+        kern_alert( "Failed to allocate the control page" );
+        return -ENOMEM;
+    }
+
+    init_timer( &control_timer );
+    control_timer.function = control_routine;
+    control_timer.data = 0;
+    return 0;
+}
+
+/**
+ * Remove Control
+ *
+ * @brief   Frees the shared page. The device must have
+ *          been removed, so nobody can map it anymore.
+ *
+ **/
+static void remove_control( void ){
+    kern_info( "Removing control page" );
+    del_timer_sync( &control_timer );
+    free_page( (unsigned long) control );
+    control = NULL;
+}
+#endif
@@ -6,17 +6,33 @@
  * @brief   This file implements the timer
  *          interrupt function to blink an
  *          led the requested amount of times
- *          concurrently. It uses a semaphore
- *          to prevent crashes.
+ *          concurrently. Every led has its own
+ *          sequencer with a timer and a queue per
+ *          priority so different colors blink in
+ *          parallel and urgent sequences interrupt
+ *          the others.
+ *          The steps are timed either by jiffy
+ *          timers or by high resolution timers,
+ *          see the timer_backend parameter.
  *
  **/
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
 #include <linux/sched.h>
-#include <linux/semaphore.h>
+#include <linux/spinlock.h>
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/genalloc.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "printops.h"
 #include "led_gpio.h"
+#include "sled_abi.h"
+#include "control.h"
+#include "soft_pwm.h"
+#include "sled_trace.h"
 
 #ifndef _INTERRUPT_H_
 #define _INTERRUPT_H_
@@ -34,270 +50,1299 @@
 #define     NORMAL          7
 #define     LONG            8
 
+#define     CHANNEL_MAX     SLED_MAX_LEDS
+#define     CHANNEL_COUNT   led_count
+
 /**
- * Globals
+ * Timer backend
  *
- * @param   interrupt   The timer_list structure to 
- *                      interrupt regularly.
- * @param   running     The semaphore to prevent access
- *                      to the timer start function.
- * @param   state_list  The structure to hold the led
- *                      states over time.
- * @param   state_len   To store the size of the state
- *                      list.
+ * @param   timer_backend   "jiffy" times the steps with timer_list,
+ *                          rounded up to whole jiffies. "hrtimer"
+ *                          uses high resolution timers with every
+ *                          step scheduled at an absolute time from
+ *                          the start of the sequence, so lateness
+ *                          does not add up over the sequence.
  *
  **/
+static char *timer_backend = "jiffy";
+module_param( timer_backend, charp, 0444 );
+MODULE_PARM_DESC( timer_backend, "Step timer, jiffy (default) or hrtimer" );
+
+static bool use_hrtimer;
+
+/**
+ * Step pool
+ *
+ * @param   pool_steps      The number of steps preallocated for every
+ *                          channel when the module is loaded. The
+ *                          sequences of the commands and their steps
+ *                          are carved out of it, so building a
+ *                          sequence never allocates and the memory of
+ *                          the sequences is bounded. A command which does
+ *                          not fit in the free part of the pool is
+ *                          dropped.
+ *
+ **/
+static unsigned int pool_steps = 8192;
+module_param( pool_steps, uint, 0444 );
+MODULE_PARM_DESC( pool_steps, "Steps preallocated per channel, sequence headers included" );
+
+/**
+ * The pool hands out blocks of 1 << POOL_ORDER bytes
+ **/
+#define     POOL_ORDER      6
 
-static struct timer_list interrupt;
-static struct semaphore running;
+/**
+ * The deepest loops of a sequence can be nested
+ **/
+#define     LOOP_DEPTH      8
 
-struct led_state {
-    int     id;
-    short   color;
-    short   delay;
-    bool    state;
+/**
+ * The number of priorities, every channel has a
+ * queue per priority
+ **/
+#define     PRIO_LEVELS     ( SLED_MAX_PRIORITY + 1 )
 
-    struct list_head head;
+/**
+ * Led Step
+ *
+ * @brief   A step sets a led and holds it, or with loop
+ *          set it sends the cursor back to target until
+ *          the steps in between have played count times.
+ *          Repeats cost a single step this way, whatever
+ *          the count. Loops only jump backwards and always
+ *          have a step which sets the led in their body.
+ *
+ * @param   led         Index of the led in the leds[] table.
+ * @param   linear      Whether the level skips gamma correction.
+ * @param   loop        Whether this is a loop step.
+ * @param   level       The brightness the led should have,
+ *                      0 is off.
+ * @param   fade_ms     The time to fade to the level.
+ * @param   target      The index a loop step jumps back to.
+ * @param   duration_us The time to hold this step for.
+ * @param   count       The number of times the body of a
+ *                      loop step plays.
+ *
+ **/
+struct led_step {
+    u8      led : 6;
+    u8      linear : 1;
+    u8      loop : 1;
+    u8      level;
+    union {
+        u16 fade_ms;
+        u16 target;
+    };
+    union {
+        u32 duration_us;
+        u32 count;
+    };
 };
-struct led_state state_list;
-static int state_len;
 
 /**
- * Create new Task
+ * Led Loop
  *
- * @brief   To dynamically allocate space for 
- *          a new led_state object and return
- *          the address to the caller.
+ * @param   at      The index of the loop step.
+ * @param   left    The number of times the body has
+ *                  still to play.
  *
- * @param   i           Id of the newly created object
- * @param   c           Color of the newly created object
- * @param   d           Delay time of newly created object
- * @param   s           State of the newly created object
- * @param   new_state   The pointer to access the newly created object
+ **/
+struct led_loop {
+    size_t  at;
+    u32     left;
+};
+
+/**
+ * Led Resume
+ *
+ * @brief   Where an interrupted sequence carries on.
+ *
+ * @param   cursor  The step which was cut short, it
+ *                  plays again in full.
+ * @param   loops   The loops the cursor was in.
+ * @param   depth   The number of entries of loops.
  *
  **/
-static struct led_state * create_new_task(int i, short c, short d, bool s){
-    
-    struct led_state *new_state;
+struct led_resume {
+    size_t          cursor;
+    struct led_loop loops[ LOOP_DEPTH ];
+    unsigned int    depth;
+};
 
-    new_state = kmalloc( sizeof( *new_state ), GFP_KERNEL );
-    new_state->id       = i;
-    new_state->color    = c;
+/**
+ * Led Sequence
+ *
+ * @param   steps       The preallocated array holding
+ *                      the led states over time.
+ * @param   len         The number of steps in the array.
+ * @param   pool        The pool the sequence was carved out
+ *                      of, NULL if it was not.
+ * @param   size        The number of bytes taken from the pool.
+ * @param   owned       Whether the channel frees the sequence
+ *                      once it is done. Sequences of preloaded
+ *                      patterns are not owned and are reused.
+ * @param   active      Whether the sequence is playing or queued.
+ * @param   paused      Whether the sequence is held on its
+ *                      current step.
+ * @param   owner       The id of the open file which wrote the
+ *                      sequence, 0 when no file owns it.
+ * @param   priority    The queue of the sequence, 0 to
+ *                      SLED_MAX_PRIORITY.
+ * @param   preempted   Whether the sequence was interrupted
+ *                      and waits to resume.
+ * @param   head        To queue the sequence on a channel, or
+ *                      on the done list once it is over.
+ *
+ **/
+struct led_sequence {
+    struct led_step     *steps;
+    size_t              len;
+    struct gen_pool     *pool;
+    size_t              size;
+    bool                owned;
+    bool                active;
+    bool                paused;
+    u64                 owner;
+    u8                  priority;
+    bool                preempted;
 
-    switch( d ){
-        
-        case SHORT:
-            new_state->delay    = SHORT_DELAY;
-            break;
-        case NORMAL:
-            new_state->delay    = NORMAL_DELAY;
-            break;
-        case LONG:
-            new_state->delay    = LONG_DELAY;
-            break;
+    struct list_head    head;
+};
 
-    }
-    new_state->state    = s;
-    
-    INIT_LIST_HEAD( &new_state->head );
-    state_len++;
+/**
+ * Led Channel
+ *
+ * @param   timer       The timer_list structure to
+ *                      interrupt regularly.
+ * @param   hrtimer     The high resolution timer used
+ *                      instead of timer with the hrtimer
+ *                      backend.
+ * @param   lock        Protects the queues and the current
+ *                      sequence against the timer.
+ * @param   queues      Sequences waiting for the current
+ *                      one to finish, one list per priority.
+ *                      An interrupted sequence waits at the
+ *                      head of its list.
+ * @param   prio_map    Bit p is set while queues[p] is not
+ *                      empty, so the next sequence is found
+ *                      without looking at the lists.
+ * @param   queue_len   The number of sequences in queues.
+ * @param   current_seq The sequence being played, NULL
+ *                      when the channel is idle.
+ * @param   cursor      The index of the next step of the
+ *                      current sequence. Every tick touches
+ *                      exactly one step which sets the led,
+ *                      after the loop steps in front of it.
+ * @param   playing     The index of the step which set the
+ *                      led last, or where the current sequence
+ *                      starts or resumes before its first tick.
+ * @param   loops       The loops the cursor is in, innermost last.
+ * @param   depth       The number of entries of loops.
+ * @param   resume      The state of the interrupted sequences,
+ *                      one per priority. Only a sequence of a
+ *                      higher priority interrupts, so there is
+ *                      at most one of them per priority.
+ * @param   retiring    Whether the current sequence was stopped
+ *                      and waits for the tick which retires it.
+ * @param   armed       Whether a tick is outstanding, the
+ *                      timer is pending or running.
+ * @param   stopping    Set once the module is going away, the
+ *                      timer is not armed any more.
+ * @param   done        Owned sequences which are over, freed
+ *                      by reclaim_work in process context.
+ * @param   led_users   The number of users of the led, the
+ *                      sequencer while it plays and the mappings
+ *                      of the control page. The last one to go
+ *                      switches it off.
+ * @param   index       The index of the led in leds[].
+ * @param   next_expiry The time the next tick was requested for.
+ * @param   ticks       The number of ticks which fired.
+ * @param   late_sum_ns The sum of the lateness of the ticks.
+ * @param   late_max_ns The worst lateness of a tick.
+ * @param   pool        The step pool of the channel.
+ * @param   pool_mem    The memory backing the pool.
+ *
+ **/
+struct led_channel {
+    struct timer_list   timer;
+    struct hrtimer      hrtimer;
+    spinlock_t          lock;
+    struct list_head    queues[ PRIO_LEVELS ];
+    unsigned long       prio_map;
+    unsigned int        queue_len;
+    struct led_sequence *current_seq;
+    size_t              cursor;
+    size_t              playing;
+    struct led_loop     loops[ LOOP_DEPTH ];
+    unsigned int        depth;
+    struct led_resume   resume[ PRIO_LEVELS ];
+    bool                retiring;
+    bool                armed;
+    bool                stopping;
+    struct list_head    done;
+    unsigned int        led_users;
+    size_t              index;
+
+    ktime_t             next_expiry;
+    u64                 ticks;
+    u64                 late_sum_ns;
+    u64                 late_max_ns;
 
-    return new_state;
+    struct gen_pool     *pool;
+    void                *pool_mem;
+};
 
+/**
+ * Globals
+ *
+ * @param   channels        One sequencer per led.
+ * @param   reclaim_work    Frees the sequences on the done
+ *                          lists, so the timers never do.
+ *
+ **/
+static struct led_channel channels[ CHANNEL_MAX ];
+
+static void reclaim_worker( struct work_struct *work );
+static DECLARE_WORK( reclaim_work, reclaim_worker );
+
+/**
+ * Get Step
+ *
+ * @brief   obtain the step at the given cursor
+ *          position, or NULL once the cursor has
+ *          run past the end of the sequence.
+ *
+ * @param   seq     The sequence to look into.
+ * @param   value   index of the step.
+ *
+ **/
+static inline struct led_step * get_step( struct led_sequence *seq,
+                                          unsigned long value ){
+    if( value < seq->len )
+        return &seq->steps[ value ];
+    return NULL;
 }
 
 /**
  * Get Delay
  *
- * @brief   obtain the delay amount from the
- *          object recieved via the value index.
+ * @brief   obtain the amount of microseconds to
+ *          hold the step recieved via the value index.
  *
- * @param   value   index of the state_list object which
- *                  the delay time should be obtained from.
+ * @param   seq     The sequence to look into.
+ * @param   value   index of the step which the delay
+ *                  time should be obtained from.
  *
  **/
 
-static short get_delay( unsigned long value ){
-    struct led_state *state;
-    list_for_each_entry( state, &(state_list.head), head ){
-        if( value==state->id ){
-            return state->delay;
-        }
+static inline u32 get_delay( struct led_sequence *seq, unsigned long value ){
+    struct led_step *step = get_step( seq, value );
+
+    if( step )
+        return step->duration_us;
+    return jiffies_to_usecs( DELAY_TIME );
+}
+
+/**
+ * Fill Loop
+ *
+ * @brief   Writes a loop step.
+ *
+ * @param   step    The step to write.
+ * @param   led     The led of the sequence.
+ * @param   target  The index of the first step of the body.
+ * @param   count   The number of times the body plays.
+ *
+ **/
+static inline void fill_loop( struct led_step *step, size_t led,
+                              size_t target, u32 count ){
+    step->led    = led;
+    step->linear = 0;
+    step->loop   = 1;
+    step->level  = 0;
+    step->target = target;
+    step->count  = count;
+}
+
+/**
+ * Command Steps
+ *
+ * @brief   The number of steps a command takes,
+ *          one blink and a loop step repeating it.
+ *
+ * @param   cmd     The command.
+ *
+ **/
+static inline size_t command_steps( const struct sled_cmd *cmd ){
+    return cmd->repeat > 1 ? 3 : 2;
+}
+
+/**
+ * Fill Steps
+ *
+ * @brief   Writes the on and the off step of a
+ *          command, followed by a loop step for
+ *          the repeats. Returns the number of
+ *          steps written.
+ *
+ * @param   step    The first step to write.
+ * @param   cmd     The command.
+ * @param   at      The index of step in its sequence.
+ *
+ **/
+static inline size_t fill_steps( struct led_step *step,
+                                 const struct sled_cmd *cmd, size_t at ){
+    step[0].led         = cmd->channel;
+    step[0].linear      = !!( cmd->flags & SLED_CMD_LINEAR );
+    step[0].loop        = 0;
+    step[0].level       = cmd->brightness;
+    step[0].fade_ms     = cmd->fade_ms;
+    step[0].duration_us = cmd->on_us;
+
+    step[1]             = step[0];
+    step[1].level       = 0;
+    step[1].duration_us = cmd->off_us;
+
+    if( cmd->repeat < 2 )
+        return 2;
+    fill_loop( &step[2], cmd->channel, at, cmd->repeat );
+    return 3;
+}
+
+/**
+ * Destroy Task List
+ *
+ * @brief   Release the memory allocated to a
+ *          sequence once it is not required.
+ *
+ * @param   seq     The sequence to release.
+ *
+ **/
+
+static void destroy_task_list( struct led_sequence *seq ){
+    if( !seq )
+        return;
+    gen_pool_free( seq->pool, (unsigned long) seq, seq->size );
+}
+
+/**
+ * Reclaim Sequences
+ *
+ * @brief   Frees the sequences on the done list of every
+ *          channel. Returns the number of sequences freed.
+ *          Process context only.
+ *
+ **/
+static unsigned int reclaim_sequences( void ){
+    struct led_sequence *seq;
+    struct led_sequence *seq_tmp;
+    unsigned long flags;
+    unsigned int count = 0;
+    LIST_HEAD( done );
+    size_t i;
+
+    for( i=0; i<CHANNEL_COUNT; i++ ){
+        spin_lock_irqsave( &channels[i].lock, flags );
+        list_splice_tail_init( &channels[i].done, &done );
+        spin_unlock_irqrestore( &channels[i].lock, flags );
+    }
+
+    list_for_each_entry_safe( seq, seq_tmp, &done, head ){
+        list_del( &seq->head );
+        destroy_task_list( seq );
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Reclaim Worker
+ *
+ * @brief   The work item the channels kick when
+ *          a sequence lands on their done list.
+ *
+ * @param   work    The work item, unused.
+ *
+ **/
+static void reclaim_worker( struct work_struct *work ){
+    reclaim_sequences();
+}
+
+/**
+ * Alloc Sequence
+ *
+ * @brief   Carves a sequence and its step array out
+ *          of the pool of a channel in one go. The
+ *          steps are left for the caller to fill. When
+ *          the pool is full the sequences which are over
+ *          and not freed yet are reclaimed first.
+ *
+ * @param   channel     The channel the sequence is for.
+ * @param   len         The number of steps.
+ *
+ **/
+static struct led_sequence * alloc_sequence( size_t channel, size_t len ){
+    struct gen_pool *pool = channels[ channel ].pool;
+    struct led_sequence *seq;
+    size_t size = sizeof( *seq ) + len * sizeof( *seq->steps );
+
+    seq = (struct led_sequence *) gen_pool_alloc( pool, size );
+    if( !seq && reclaim_sequences() )
+        seq = (struct led_sequence *) gen_pool_alloc( pool, size );
+    if( !seq ){
+        stat_inc( STAT_ALLOC_FAILURES );
+        kern_alert( "Step pool of channel %zu is full, %zu of %zu bytes free",
+                    channel, gen_pool_avail( pool ), gen_pool_size( pool ) );
+        return NULL;
     }
-    return DELAY_TIME;
+    seq->steps = (struct led_step *)( seq + 1 );
+    seq->len = len;
+    seq->pool = pool;
+    seq->size = size;
+    seq->owned = true;
+    seq->active = false;
+    seq->paused = false;
+    seq->owner = 0;
+    seq->priority = 0;
+    seq->preempted = false;
+    INIT_LIST_HEAD( &seq->head );
+
+    return seq;
 }
 
 /**
  * Create a task list
  *
- * @brief       Create a linkedlist of led_state type objects.
+ * @brief       Builds the sequence of a command, a blink
+ *              and a loop step for the repeats, so the
+ *              memory it takes does not grow with them.
  *
- * @param   color       Color variable of all the objects in the list.
- * @param   delay       Delay time for all the objects
- * @param   qty         Number of blinks for the specific list.
- * @param   new_state   The pointer to hold a reference to newly
- *                      created object.
+ * @param   cmd         The command to build the sequence for.
+ *                      The channel and repeat count must have
+ *                      been checked by the caller.
  *
  **/
-static void create_task_list( short color, short delay, short qty ){
-    
-    struct led_state *new_state;
-    size_t i;
+static struct led_sequence * create_task_list( const struct sled_cmd *cmd ){
+    struct led_sequence *seq;
 
-    kern_info( 0, "Initializing task list" );
+    seq = alloc_sequence( cmd->channel, command_steps( cmd ) );
+    if( seq ){
+        fill_steps( seq->steps, cmd, 0 );
+        seq->priority = cmd->priority;
+    }
+    return seq;
+}
+
+/**
+ * Hold Channel Led
+ *
+ * @brief   Takes a reference on the led of a channel.
+ *          The gpio is held for the life of the module so
+ *          this never sleeps. Must be called with the
+ *          channel lock held.
+ *
+ * @param   ch      The channel whose led is needed.
+ *
+ **/
+static inline void hold_channel_led( struct led_channel *ch ){
+    ch->led_users++;
+}
+
+/**
+ * Drop Channel Led
+ *
+ * @brief   Drops a reference on the led of a channel,
+ *          the last one switches it off. Must be called
+ *          with the channel lock held.
+ *
+ * @param   ch      The channel whose led is no longer needed.
+ *
+ **/
+static void drop_channel_led( struct led_channel *ch ){
+    if( --ch->led_users == 0 ){
+        pwm_release( ch->index );
+        toggle_led( ch->index, false );
+    }
+}
 
-    INIT_LIST_HEAD( &state_list.head );
-    state_len=0;
+/**
+ * Skip Loops
+ *
+ * @brief   Moves the cursor of a channel over the loop
+ *          steps in front of it, jumping back for the
+ *          loops which have not played all their rounds.
+ *          Stops on a step which sets the led or at the
+ *          end. Must be called with the channel lock held.
+ *
+ * @param   ch      The channel.
+ * @param   seq     The sequence being played.
+ *
+ **/
+static void skip_loops( struct led_channel *ch, struct led_sequence *seq ){
+    struct led_step *step;
+    struct led_loop *loop;
 
-    //Populate the list
-    for( i=0; i<(qty*2); i+=2 ){
-        new_state = create_new_task(i, color, delay, true);
-        list_add_tail( &(new_state->head), &(state_list.head) );
-        
-        new_state = create_new_task(i+1, color, delay, false);
-        list_add_tail( &(new_state->head), &(state_list.head) );
+    while( ( step = get_step( seq, ch->cursor ) ) && step->loop ){
+        loop = ch->depth ? &ch->loops[ ch->depth - 1 ] : NULL;
+        if( !loop || loop->at != ch->cursor ){
+            //Entering the loop, the body has played once
+            if( ch->depth == LOOP_DEPTH ){
+                ch->cursor = seq->len;
+                return;
+            }
+            loop = &ch->loops[ ch->depth++ ];
+            loop->at = ch->cursor;
+            loop->left = step->count ? step->count - 1 : 0;
+        }
+        if( loop->left ){
+            loop->left--;
+            ch->cursor = step->target;
+        }else{
+            ch->depth--;
+            ch->cursor++;
+        }
     }
+}
 
+/**
+ * Enqueue Sequence
+ *
+ * @brief   Adds a sequence to the queue of its priority,
+ *          at the tail, or at the head for an interrupted
+ *          one so it is the next of its priority to play.
+ *          Must be called with the channel lock held.
+ *
+ * @param   ch      The channel.
+ * @param   seq     The sequence.
+ * @param   head    Whether to add it at the head.
+ *
+ **/
+static inline void enqueue_sequence( struct led_channel *ch,
+                                     struct led_sequence *seq, bool head ){
+    if( head )
+        list_add( &seq->head, &ch->queues[ seq->priority ] );
+    else
+        list_add_tail( &seq->head, &ch->queues[ seq->priority ] );
+    ch->prio_map |= BIT( seq->priority );
+    ch->queue_len++;
+}
 
+/**
+ * Dequeue Sequence
+ *
+ * @brief   Takes a sequence off its queue. Must be
+ *          called with the channel lock held.
+ *
+ * @param   ch      The channel.
+ * @param   seq     The queued sequence.
+ *
+ **/
+static inline void dequeue_sequence( struct led_channel *ch,
+                                     struct led_sequence *seq ){
+    list_del_init( &seq->head );
+    if( list_empty( &ch->queues[ seq->priority ] ) )
+        ch->prio_map &= ~BIT( seq->priority );
+    ch->queue_len--;
 }
 
 /**
- * Destroy Task List
+ * Next Sequence
  *
- * @brief   Release the memory dynamically allocated
- *          to the state list once it is not required.
+ * @brief   The queued sequence to play next, the first
+ *          of the highest priority, or NULL. The highest
+ *          priority is the last bit set in prio_map, so
+ *          this takes the same time however many are
+ *          queued. Must be called with the channel lock
+ *          held.
  *
- * @param   state_iter      A pointer variable to iterate the list
- * @param   state_iter_tmp  A pointer variable for safe iteration
+ * @param   ch      The channel.
  *
  **/
+static inline struct led_sequence * next_sequence( struct led_channel *ch ){
+    if( !ch->prio_map )
+        return NULL;
+    return list_first_entry( &ch->queues[ __fls( ch->prio_map ) ],
+                             struct led_sequence, head );
+}
 
-static void destroy_task_list( void ){
-    struct led_state *state_iter;
-    struct led_state *state_iter_tmp;
+/**
+ * Start Sequence
+ *
+ * @brief   Makes a sequence the current one of a
+ *          channel, from its first step or from where
+ *          it was interrupted. Must be called with the
+ *          channel lock held.
+ *
+ * @param   ch      The channel.
+ * @param   seq     The sequence, not queued.
+ *
+ **/
+static inline void start_sequence( struct led_channel *ch,
+                                   struct led_sequence *seq ){
+    struct led_resume *resume = &ch->resume[ seq->priority ];
 
-    list_for_each_entry_safe( state_iter, state_iter_tmp, &(state_list.head), head ){
-        list_del( &(state_iter->head) );
-        kfree( state_iter );
+    ch->current_seq = seq;
+    ch->retiring = false;
+    if( seq->preempted ){
+        seq->preempted = false;
+        ch->cursor = resume->cursor;
+        ch->playing = resume->cursor;
+        ch->depth = resume->depth;
+        memcpy( ch->loops, resume->loops, resume->depth * sizeof( *resume->loops ) );
+    }else{
+        ch->cursor = 0;
+        ch->playing = 0;
+        ch->depth = 0;
     }
 }
 
+/**
+ * Preempt Sequence
+ *
+ * @brief   Interrupts the current sequence of a channel
+ *          and puts it back at the head of its queue. The
+ *          step it was playing is cut short and plays again
+ *          in full when it resumes. Must be called with the
+ *          channel lock held.
+ *
+ * @param   ch      The channel.
+ *
+ **/
+static inline void preempt_sequence( struct led_channel *ch ){
+    struct led_sequence *seq = ch->current_seq;
+    struct led_resume *resume = &ch->resume[ seq->priority ];
+
+    //Not the cursor, a sequence which did not tick yet is not past it
+    resume->cursor = ch->playing;
+    resume->depth = ch->depth;
+    memcpy( resume->loops, ch->loops, ch->depth * sizeof( *ch->loops ) );
+    seq->preempted = true;
+    enqueue_sequence( ch, seq, true );
+    ch->current_seq = NULL;
+}
+
 /**
  * Trigger Led
  *
- * @brief   This function triggers the selected
- *          led based on the number of blinks.
+ * @brief   This function sets the led of the
+ *          step under the cursor, unless the led
+ *          is owned by the control page.
  *
- * @param   state   A pointer to obtain the values
- *                  from the chosen state.
+ * @param   seq     The sequence being played.
  * @param   value   The current index of the chosen
- *                  object from the linked list.
- *
- **/
-static void trigger_led( unsigned long value ){
-    struct led_state *state;
-
-    list_for_each_entry( state, &(state_list.head), head ){
-        if( value==state->id ){
-            //kern_info( 0, "color : %hu", state->color );
-            //kern_info( 0, "delay : %hu", state->delay );
-            //kern_info( 0, "state : %hu", state->state );
-            switch( state->color ){
-                case RED:
-                    toggle_led( 0, state->state );
-                    break;
-                case GREEN:
-                    toggle_led( 1, state->state );
-                    break;
-                case BLUE:
-                    toggle_led( 2, state->state );
-                    break;
+ *                  step from the sequence.
+ *
+ **/
+static void trigger_led( struct led_sequence *seq, unsigned long value ){
+    struct led_step *step = get_step( seq, value );
 
-            }
+    if( step && !control_overrides( step->led ) )
+        pwm_set_level( step->led, step->level, step->fade_ms, step->linear );
+}
+
+/**
+ * Arm Channel
+ *
+ * @brief   Schedules the next tick of a channel. With the
+ *          hrtimer backend the delay is counted from the time
+ *          the previous tick was requested for, with the jiffy
+ *          backend from now. A channel which is stopping is
+ *          left alone. Must be called with the channel lock
+ *          held.
+ *
+ * @param   ch          The channel to arm.
+ * @param   delay_us    The microseconds to wait.
+ *
+ **/
+static inline void arm_channel( struct led_channel *ch, u32 delay_us ){
+    unsigned long delay;
+
+    if( ch->stopping )
+        return;
+    ch->armed = true;
+    if( use_hrtimer ){
+        ch->next_expiry = ktime_add_us( ch->next_expiry, delay_us );
+        hrtimer_start( &ch->hrtimer, ch->next_expiry, HRTIMER_MODE_ABS );
+    }else{
+        delay = usecs_to_jiffies( delay_us );
+        ch->next_expiry = ktime_add_us( ktime_get(), jiffies_to_usecs( delay ) );
+        mod_timer( &ch->timer, jiffies + delay );
+    }
+}
+
+/**
+ * Arm Channel Now
+ *
+ * @brief   Schedules a tick of a channel right away and
+ *          starts a new timeline for the following ones.
+ *          Must be called with the channel lock held.
+ *
+ * @param   ch      The channel to arm.
+ *
+ **/
+static inline void arm_channel_now( struct led_channel *ch ){
+    ch->next_expiry = ktime_get();
+    arm_channel( ch, 0 );
+}
+
+/**
+ * Kick Channel
+ *
+ * @brief   Brings a pending tick of a channel forward to
+ *          now. A tick which is already running is left
+ *          alone. Must be called with the channel lock held.
+ *
+ * @param   ch      The channel to kick.
+ *
+ **/
+static inline void kick_channel( struct led_channel *ch ){
+    if( use_hrtimer ){
+        if( hrtimer_try_to_cancel( &ch->hrtimer ) == 1 )
+            arm_channel_now( ch );
+    }else if( del_timer( &ch->timer ) ){
+        arm_channel_now( ch );
+    }
+}
+
+/**
+ * Account Tick
+ *
+ * @brief   Records how late a tick fired compared to
+ *          the time it was requested for.
+ *
+ * @param   ch      The channel which ticked.
+ * @param   now     The time the tick ran.
+ *
+ **/
+static inline void account_tick( struct led_channel *ch, ktime_t now ){
+    s64 late = ktime_to_ns( ktime_sub( now, ch->next_expiry ) );
+
+    if( late < 0 )
+        late = 0;
+    stat_tick( late );
+    ch->ticks++;
+    ch->late_sum_ns += late;
+    if( late > ch->late_max_ns )
+        ch->late_max_ns = late;
+}
+
+/**
+ * Channel Tick
+ *
+ * @brief   This is the interrupt routine which
+ *          happen based on the duration of each
+ *          step. A step is applied and held for
+ *          its duration. Once the last step of the
+ *          current sequence has been held, the next
+ *          queued sequence of the highest priority is
+ *          started, or resumed if it was interrupted,
+ *          and the finished one goes to the done list.
+ *          A paused sequence is left where it is until
+ *          it is resumed.
+ *
+ * @param   ch      The channel whose timer fired.
+ *
+ **/
+static void channel_tick( struct led_channel *ch ){
+
+    struct led_sequence *seq;
+    struct led_sequence *next;
+    bool retired = false;
+    unsigned long flags;
+    u64 ticks = 0, late_sum = 0, late_max = 0;
+    ktime_t now = ktime_get();
+
+    spin_lock_irqsave( &ch->lock, flags );
+
+    ch->armed = false;
+    account_tick( ch, now );
+    trace_sled_tick( ch->index, ch->cursor, ktime_to_ns( ch->next_expiry ),
+                     ktime_to_ns( now ), ch->queue_len );
+    seq = ch->current_seq;
+    if( seq && !seq->paused )
+        skip_loops( ch, seq );
+
+    if( !seq ){
+        //Nothing left to play
+    }else if( seq->paused ){
+        //Held until resume_sequence() arms the channel again
+    }else if( ch->cursor < seq->len ){
+        trigger_led( seq, ch->cursor );
+        arm_channel( ch, get_delay( seq, ch->cursor ) );
+        ch->playing = ch->cursor++;
+    }else{
+        seq->active = false;
+        if( seq->owned ){
+            list_add_tail( &seq->head, &ch->done );
+            retired = true;
+        }
+
+        next = next_sequence( ch );
+        if( !next ){
+            drop_channel_led( ch );
+            ch->current_seq = NULL;
+            ch->retiring = false;
+
+            ticks = ch->ticks;
+            late_sum = ch->late_sum_ns;
+            late_max = ch->late_max_ns;
+            ch->ticks = ch->late_sum_ns = ch->late_max_ns = 0;
+        }else{
+            dequeue_sequence( ch, next );
+            start_sequence( ch, next );
+            arm_channel( ch, 0 );
         }
     }
+
+    spin_unlock_irqrestore( &ch->lock, flags );
+
+    if( retired )
+        schedule_work( &reclaim_work );
+    if( ticks )
+        kern_dbg( "Timer stopped, %llu ticks late by %llu ns on average, %llu ns at most",
+                  ticks, div64_u64( late_sum, ticks ), late_max );
 }
 
 /**
  * Interrupt Routine
  *
- * @brief   This is the interrupt routine which
- *          happen based on the delay time
- *          requested by the user.
+ * @brief   The timer_list routine of the jiffy backend.
  *
- * @param   value   The count of the current iteration.
- *                  also to keep track of the current
- *                  state from the state list.
+ * @param   value   The address of the channel
+ *                  the timer belongs to.
  *
  **/
 static void interrupt_routine( unsigned long value ){
-    
-    //kern_info( 0, "routine %ld", value );
-    trigger_led( value ); 
-    interrupt.data = ++value;
-    interrupt.expires = jiffies + get_delay( value );
-    if( value < state_len ){
-        add_timer( &interrupt );
-    }else{
-        destroy_task_list();
-        release_leds();
-        up( &running );
-        kern_info( 0, "Timer stopped");
+    channel_tick( (struct led_channel *) value );
+}
+
+/**
+ * Hrtimer Routine
+ *
+ * @brief   The hrtimer routine of the hrtimer backend.
+ *          The channel rearms the timer itself.
+ *
+ * @param   timer   The hrtimer of the channel.
+ *
+ **/
+static enum hrtimer_restart hrtimer_routine( struct hrtimer *timer ){
+    channel_tick( container_of( timer, struct led_channel, hrtimer ) );
+    return HRTIMER_NORESTART;
+}
+
+/**
+ * Queue Sequence
+ *
+ * @brief   Starts a sequence on a channel, or queues it
+ *          behind the current one when the channel is busy.
+ *          A sequence of a higher priority than the current
+ *          one interrupts it and starts straight away, the
+ *          current one resumes once the queues above it are
+ *          empty. Never sleeps on the channel.
+ *
+ * @param   ch      The channel to play the sequence on.
+ * @param   seq     The sequence to play.
+ *
+ **/
+static void queue_sequence( struct led_channel *ch, struct led_sequence *seq ){
+    struct led_sequence *cur;
+    unsigned long flags;
+
+    spin_lock_irqsave( &ch->lock, flags );
+    seq->active = true;
+    seq->preempted = false;
+    cur = ch->current_seq;
+    if( cur && ( ch->retiring || seq->priority <= cur->priority ) ){
+        enqueue_sequence( ch, seq, false );
+        trace_sled_sequence( ch->index, seq->len, ch->queue_len, true );
+        spin_unlock_irqrestore( &ch->lock, flags );
+        kern_dbg( "Sequence queued");
+        return;
+    }
+
+    if( cur ){
+        //cur may be freed once the lock is dropped
+        u8 prio = cur->priority;
+
+        preempt_sequence( ch );
+        start_sequence( ch, seq );
+        //Cut the step playing short
+        if( !ch->armed )
+            arm_channel_now( ch );
+        else
+            kick_channel( ch );
+        trace_sled_sequence( ch->index, seq->len, ch->queue_len, false );
+        spin_unlock_irqrestore( &ch->lock, flags );
+        kern_dbg( "Sequence of priority %u preempted", prio );
+        return;
+    }
+
+    start_sequence( ch, seq );
+    hold_channel_led( ch );
+    arm_channel_now( ch );
+    trace_sled_sequence( ch->index, seq->len, ch->queue_len, false );
+    spin_unlock_irqrestore( &ch->lock, flags );
+
+    kern_dbg( "Timer started");
+}
+
+/**
+ * Pause Sequence
+ *
+ * @brief   Holds a sequence on its current step. A queued
+ *          sequence is held as soon as it starts.
+ *
+ * @param   ch      The channel the sequence is queued on.
+ * @param   seq     The sequence to pause.
+ *
+ **/
+static void pause_sequence( struct led_channel *ch, struct led_sequence *seq ){
+    unsigned long flags;
+
+    spin_lock_irqsave( &ch->lock, flags );
+    if( seq->active )
+        seq->paused = true;
+    spin_unlock_irqrestore( &ch->lock, flags );
+}
+
+/**
+ * Resume Sequence
+ *
+ * @brief   Lets a paused sequence carry on from
+ *          the step it was held on.
+ *
+ * @param   ch      The channel the sequence is queued on.
+ * @param   seq     The sequence to resume.
+ *
+ **/
+static void resume_sequence( struct led_channel *ch, struct led_sequence *seq ){
+    unsigned long flags;
+
+    spin_lock_irqsave( &ch->lock, flags );
+    seq->paused = false;
+    if( ch->current_seq == seq && !ch->armed )
+        arm_channel_now( ch );
+    spin_unlock_irqrestore( &ch->lock, flags );
+}
+
+/**
+ * Stop Sequence
+ *
+ * @brief   Stops a sequence. A queued sequence is taken
+ *          off the queue, straight to the done list if the
+ *          channel owns it. The current one is moved to its
+ *          end so the next tick, brought forward to now,
+ *          retires it and carries on with the next. Must be
+ *          called with the channel lock held.
+ *
+ * @param   ch      The channel the sequence is queued on.
+ * @param   seq     The sequence to stop.
+ *
+ **/
+static void stop_sequence( struct led_channel *ch, struct led_sequence *seq ){
+    if( ch->current_seq == seq ){
+        ch->cursor = seq->len;
+        ch->retiring = true;
+        seq->paused = false;
+        //Cut the current step short rather than waiting it out
+        if( !ch->armed )
+            arm_channel_now( ch );
+        else
+            kick_channel( ch );
+    }else if( seq->active ){
+        dequeue_sequence( ch, seq );
+        seq->active = false;
+        seq->paused = false;
+        seq->preempted = false;
+        if( seq->owned )
+            list_add_tail( &seq->head, &ch->done );
+    }
+}
+
+/**
+ * Cancel Sequence
+ *
+ * @brief   Stops a sequence which is not owned by
+ *          the channel, see stop_sequence().
+ *
+ * @param   ch      The channel the sequence is queued on.
+ * @param   seq     The sequence to cancel.
+ *
+ **/
+static void cancel_sequence( struct led_channel *ch, struct led_sequence *seq ){
+    unsigned long flags;
+
+    spin_lock_irqsave( &ch->lock, flags );
+    stop_sequence( ch, seq );
+    spin_unlock_irqrestore( &ch->lock, flags );
+}
+
+/**
+ * Cancel Channel
+ *
+ * @brief   Stops the sequences of an owner on a channel,
+ *          playing or queued, or all of them for owner 0.
+ *          The step playing is cut short, within a jiffy
+ *          with the jiffy backend and straight away with
+ *          the hrtimer one. Returns the number of sequences
+ *          stopped.
+ *
+ * @param   ch      The channel.
+ * @param   owner   The id of the file, or 0 for everyone.
+ *
+ **/
+static unsigned int cancel_channel( struct led_channel *ch, u64 owner ){
+    struct led_sequence *seq;
+    struct led_sequence *seq_tmp;
+    unsigned int count = 0;
+    unsigned long flags;
+    size_t p;
+
+    spin_lock_irqsave( &ch->lock, flags );
+    for( p=0; p<PRIO_LEVELS; p++ ){
+        list_for_each_entry_safe( seq, seq_tmp, &ch->queues[p], head ){
+            if( owner && seq->owner != owner )
+                continue;
+            stop_sequence( ch, seq );
+            count++;
+        }
+    }
+    seq = ch->current_seq;
+    if( seq && ( !owner || seq->owner == owner ) && !ch->retiring ){
+        stop_sequence( ch, seq );
+        count++;
     }
+    spin_unlock_irqrestore( &ch->lock, flags );
+
+    if( count )
+        schedule_work( &reclaim_work );
+    return count;
+}
+
+/**
+ * Sequence Active
+ *
+ * @brief   Tells whether a sequence is playing or queued.
+ *
+ * @param   ch      The channel the sequence is queued on.
+ * @param   seq     The sequence to check.
+ *
+ **/
+static bool sequence_active( struct led_channel *ch, struct led_sequence *seq ){
+    unsigned long flags;
+    bool active;
 
+    spin_lock_irqsave( &ch->lock, flags );
+    active = seq->active;
+    spin_unlock_irqrestore( &ch->lock, flags );
+
+    return active;
+}
+
+/**
+ * Channel Idle
+ *
+ * @brief   Tells whether a channel has nothing
+ *          playing and nothing queued.
+ *
+ * @param   ch      The channel to check.
+ *
+ **/
+static bool channel_idle( struct led_channel *ch ){
+    unsigned long flags;
+    bool idle;
+
+    spin_lock_irqsave( &ch->lock, flags );
+    idle = !ch->current_seq;
+    spin_unlock_irqrestore( &ch->lock, flags );
+
+    return idle;
 }
 
 /**
  * State Timer Interrupt
  *
- * @brief   The function which starts all the magic
+ * @brief   The function which starts all the magic.
+ *          Never sleeps on the channel: if it is busy
+ *          the sequence is queued behind the current one.
  *
- * @param   color   The color obtained from the command.
- * @param   delay   The delay time obtained from the command.
- * @param   qty     The blink amount obtained from the command.
+ * @param   cmd     The command to play.
+ * @param   owner   The id of the file which wrote it, or 0.
  *
  **/
 
-static bool start_timer_interrupt( short color, short delay, short qty ){
-    kern_info( 0, "Timer started");
-    if( down_interruptible(&running) == 0 ){
-        interrupt.data = 0;
-        
-        create_task_list( color, delay, qty );
-        initiate_leds();
+static bool start_timer_interrupt( const struct sled_cmd *cmd, u64 owner ){
+    struct led_sequence *seq;
 
-        interrupt.expires = jiffies + DELAY_TIME;
-        add_timer( &interrupt );
-        return true;
-    }else{
+    seq = create_task_list( cmd );
+    if( !seq )
         return false;
+
+    seq->owner = owner;
+    queue_sequence( &channels[ cmd->channel ], seq );
+    return true;
+}
+/**
+ *  Setup Step Pool
+ *
+ *  @brief  Preallocates the step pool of a channel.
+ *
+ *  @param  ch      The channel.
+ *
+ **/
+static int setup_step_pool( struct led_channel *ch ){
+    size_t size = pool_steps * sizeof( struct led_step );
+
+    ch->pool = gen_pool_create( POOL_ORDER, -1 );
+    if( !ch->pool )
+        return -ENOMEM;
+
+    ch->pool_mem = vzalloc( size );
+    if( !ch->pool_mem || gen_pool_add( ch->pool, (unsigned long) ch->pool_mem,
+                                       size, -1 ) ){
+        vfree( ch->pool_mem );
+        gen_pool_destroy( ch->pool );
+        ch->pool = NULL;
+        ch->pool_mem = NULL;
+        return -ENOMEM;
     }
+    stat_pool( ch->index, ch->pool );
+    return 0;
+}
 
+/**
+ *  Remove Step Pool
+ *
+ *  @brief  Frees the step pool of a channel, every
+ *          sequence carved out of it must be gone.
+ *
+ *  @param  ch      The channel.
+ *
+ **/
+static void remove_step_pool( struct led_channel *ch ){
+    if( !ch->pool )
+        return;
+    stat_pool( ch->index, NULL );
+    gen_pool_destroy( ch->pool );
+    vfree( ch->pool_mem );
+    ch->pool = NULL;
+    ch->pool_mem = NULL;
 }
+
 /**
  *  Setup Timer Interrupts
  *
- *  @brief  Initiates the semaphore and the interrupt function.
+ *  @brief  Initiates a timer, a queue and a step
+ *          pool per channel.
  *
  **/
-static void setup_timer_interrupt(void){
+static int setup_timer_interrupt(void){
+    size_t i, p;
+    int ret;
 
-    kern_info( 0, "Setting up timer interrupt" );
-    sema_init( &running, 1 ); 
-    init_timer( &interrupt );
-    interrupt.function= interrupt_routine;
+    setup_pwm();
+    use_hrtimer = !strcmp( timer_backend, "hrtimer" );
+    kern_info( "Setting up timer interrupt, %s backend",
+               use_hrtimer ? "hrtimer" : "jiffy" );
+    for( i=0; i<CHANNEL_COUNT; i++ ){
+        spin_lock_init( &channels[i].lock );
+        for( p=0; p<PRIO_LEVELS; p++ )
+            INIT_LIST_HEAD( &channels[i].queues[p] );
+        channels[i].prio_map = 0;
+        channels[i].queue_len = 0;
+        channels[i].current_seq = NULL;
+        channels[i].cursor = 0;
+        channels[i].playing = 0;
+        channels[i].depth = 0;
+        channels[i].retiring = false;
+        channels[i].armed = false;
+        channels[i].stopping = false;
+        INIT_LIST_HEAD( &channels[i].done );
+        channels[i].led_users = 0;
+        channels[i].index = i;
+        channels[i].ticks = 0;
+        channels[i].late_sum_ns = 0;
+        channels[i].late_max_ns = 0;
+
+        init_timer( &channels[i].timer );
+        channels[i].timer.function = interrupt_routine;
+        channels[i].timer.data = (unsigned long) &channels[i];
+
+        hrtimer_init( &channels[i].hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS );
+        channels[i].hrtimer.function = hrtimer_routine;
+
+        ret = setup_step_pool( &channels[i] );
+        if( ret ){
+            kern_alert( "Failed to allocate the step pools" );
+            while( i-- )
+                remove_step_pool( &channels[i] );
+            return ret;
+        }
+    }
+
+    kern_info( "Step pools of %u steps per channel, %zu KiB in total",
+               pool_steps, CHANNEL_COUNT * pool_steps * sizeof( struct led_step ) / 1024 );
+    return 0;
 }
 
 /**
  *  Remove Timer
  *
  *  @brief  Function to end all the magic happening.
+ *          The channels stop arming their timers first,
+ *          so each of them has at most one tick left in
+ *          flight and the timers are gone after it. The
+ *          sequences are then freed from here, none of
+ *          them from a timer.
  *
  **/
 static void remove_timer(void){
-    
-    kern_info( 0, "Removing timer interrupt");
+    struct led_sequence *seq;
+    struct led_sequence *seq_tmp;
+    struct led_channel *ch;
+    unsigned long flags;
+    size_t i, p;
+
+    kern_info( "Removing timer interrupt");
+
+    for( i=0; i<CHANNEL_COUNT; i++ ){
+        spin_lock_irqsave( &channels[i].lock, flags );
+        channels[i].stopping = true;
+        spin_unlock_irqrestore( &channels[i].lock, flags );
+    }
+
+    for( i=0; i<CHANNEL_COUNT; i++ ){
+        ch = &channels[i];
+        del_timer_sync( &ch->timer );
+        hrtimer_cancel( &ch->hrtimer );
+        ch->armed = false;
+
+        for( p=0; p<PRIO_LEVELS; p++ ){
+            list_for_each_entry_safe( seq, seq_tmp, &ch->queues[p], head ){
+                list_del_init( &seq->head );
+                seq->active = false;
+                seq->preempted = false;
+                if( seq->owned )
+                    list_add_tail( &seq->head, &ch->done );
+            }
+        }
+        ch->prio_map = 0;
+        ch->queue_len = 0;
+        seq = ch->current_seq;
+        if( seq ){
+            drop_channel_led( ch );
+            seq->active = false;
+            if( seq->owned )
+                list_add_tail( &seq->head, &ch->done );
+            ch->current_seq = NULL;
+        }
+    }
 
-    del_timer_sync( &interrupt );
+    cancel_work_sync( &reclaim_work );
+    reclaim_sequences();
+    for( i=0; i<CHANNEL_COUNT; i++ )
+        remove_step_pool( &channels[i] );
+    remove_pwm();
 }
 #endif
@@ -8,70 +8,203 @@
  **/
 
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/gpio/driver.h>
+#include <linux/version.h>
 #include "printops.h"
+#include "sled_abi.h"
+#include "sled_trace.h"
+#include "stats.h"
 
 #ifndef _LED_GPIO_H_
 #define _LED_GPIO_H_
 
+/**
+ * The most leds the driver can drive, one
+ * bit each in the masks of set_leds()
+ **/
+
+#define     SLED_MAX_LEDS   BITS_PER_LONG
+
+/**
+ * The gpio's of the leds, given at load time:
+ *
+ *  insmod sled.ko gpios=4,17,27,22,23
+ *
+ * Every led gets its own channel and /dev/sledN.
+ * With chip= the gpios are line offsets on the
+ * gpio chip of that label instead of global
+ * numbers, for boards other than the Pi and for
+ * the gpio-mockup and gpio-sim test chips:
+ *
+ *  insmod sled.ko chip=gpio-mockup-A gpios=0,1,2
+ **/
+
+static int gpios[ SLED_MAX_LEDS ] = { 4, 17, 27 };
+static int gpio_count = 3;
+module_param_array( gpios, int, &gpio_count, 0444 );
+MODULE_PARM_DESC( gpios, "Gpio numbers of the leds, 4,17,27 by default" );
+
+static char *chip;
+module_param( chip, charp, 0444 );
+MODULE_PARM_DESC( chip, "Label of the gpio chip the gpios are line offsets on" );
+
+static const char * const led_names[] = { "REDLED", "GREENLED", "BLUELED" };
+
 /**
  * Structure to hold the array of
  * leds with initial state
  **/
 
-static struct gpio leds[] = {
-    {   4,  GPIOF_OUT_INIT_HIGH, "REDLED"    },
-    {   17, GPIOF_OUT_INIT_HIGH, "GREENLED"  },
-    {   27, GPIOF_OUT_INIT_HIGH, "BLUELED"   }
-};
+static struct gpio leds[ SLED_MAX_LEDS ];
+static char led_labels[ SLED_MAX_LEDS ][ 12 ];
+static size_t led_count;
 
 /**
- * To know whether the gpio's
- * have been assigned
+ * The descriptors of the requested
+ * gpio's, for the batched updates
  **/
 
-static bool initialized;
+static struct gpio_desc *led_descs[ SLED_MAX_LEDS ];
+
+/**
+ * Chip Match
+ *
+ * @brief   Matches a gpio chip by its label,
+ *          for gpiochip_find().
+ *
+ **/
+
+static int chip_match( struct gpio_chip *gc, void *label ){
+    return gc->label && !strcmp( gc->label, label );
+}
+
+/**
+ * Chip Range
+ *
+ * @brief   Finds the first global number and the number
+ *          of lines of the chip given by the chip parameter.
+ *          Without it the gpios are global numbers already.
+ *
+ * @param   base    To store the number of line 0.
+ * @param   lines   To store the number of lines.
+ *
+ **/
+
+static int chip_range( int *base, int *lines ){
+    struct gpio_chip *gc;
+
+    if( !chip || !*chip ){
+        *base = 0;
+        *lines = INT_MAX;
+        return 0;
+    }
+
+    gc = gpiochip_find( chip, chip_match );
+    if( !gc ){
+        kern_alert( "No gpio chip labelled %s", chip );
+        return -ENODEV;
+    }
+    *base = gc->base;
+    *lines = gc->ngpio;
+    return 0;
+}
+
+/**
+ * Setup leds
+ *
+ * @brief   Fills leds[] from the gpios parameter.
+ *          Nothing is requested yet.
+ *
+ **/
+
+static int setup_leds( void ){
+    size_t i, j;
+    int base, lines;
+    int ret;
+
+    BUILD_BUG_ON( SLED_MAX_LEDS > SLED_CONTROL_CHANNELS );
+
+    if( gpio_count <= 0 ){
+        kern_alert( "No gpios given" );
+        return -EINVAL;
+    }
+
+    ret = chip_range( &base, &lines );
+    if( ret )
+        return ret;
+
+    for( i=0; i<gpio_count; i++ ){
+        if( gpios[i] < 0 || gpios[i] >= lines ||
+            !gpio_is_valid( base + gpios[i] ) ){
+            kern_alert( "Gpio %d is not valid", gpios[i] );
+            return -EINVAL;
+        }
+        for( j=0; j<i; j++ ){
+            if( gpios[j] == gpios[i] ){
+                kern_alert( "Gpio %d is given twice", gpios[i] );
+                return -EINVAL;
+            }
+        }
+
+        if( i < ARRAY_SIZE( led_names ) )
+            strlcpy( led_labels[i], led_names[i], sizeof( led_labels[i] ) );
+        else
+            snprintf( led_labels[i], sizeof( led_labels[i] ), "SLED%zu", i );
+
+        leds[i].gpio  = base + gpios[i];
+        leds[i].flags = GPIOF_OUT_INIT_HIGH;
+        leds[i].label = led_labels[i];
+    }
+    led_count = gpio_count;
+
+    kern_info( "%zu leds", led_count );
+    return 0;
+}
 
 /**
  * Initialization function
  * 
- * @brief   Requests for the required
- *          array of gpios.
+ * @brief   Requests the gpio's of all the leds and
+ *          caches their descriptors. They are held
+ *          until the module goes away, so the timers
+ *          never request or free a pin and no other
+ *          driver can take one in between commands.
  * @param   ret     To store the state of
  *                  the request function.
  **/
 
-static inline void initiate_leds( void ){
+static int initiate_leds( void ){
     int ret =0;
+    size_t i;
     
-    ret = gpio_request_array( leds, ARRAY_SIZE( leds ) );
+    ret = gpio_request_array( leds, led_count );
     if( ret < 0 ){
-        kern_alert( 0, "Failed to initialize leds" );
-        initialized = false;
-        return;
+        kern_alert( "Failed to initialize leds" );
+        return ret;
     }
 
-    kern_info( 0, "Leds have been initialised Succesfully" );
-    initialized = true;
+    for( i=0; i<led_count; i++ )
+        led_descs[i] = gpio_to_desc( leds[i].gpio );
 
+    kern_info( "Leds have been initialised Succesfully" );
+    return 0;
 }
 
 /**
  * Destructor
  * 
- * @brief   Release the gpio pins which
- *          was requested previously.
+ * @brief   Switches the leds off and releases
+ *          their gpio's.
  **/
 
-static inline void release_leds( void ){
+static void release_leds( void ){
     size_t i;
 
-    for( i=0; i<ARRAY_SIZE( leds ); i++ ){
-        gpio_set_value( leds[i].gpio, 0 );
-    }
-
-    gpio_free_array( leds, ARRAY_SIZE( leds ) );
-    kern_info( 0, "Leds have been released" );
-    initialized = false;
+    for( i=0; i<led_count; i++ )
+        gpio_set_value( leds[i].gpio, 1 );
+    gpio_free_array( leds, led_count );
+    kern_info( "Leds have been released" );
 }
 
 /**
@@ -86,7 +219,8 @@ static inline void release_leds( void ){
 
 static inline void toggle_led( size_t index, bool value ){
 
-    //kern_info( 5, "index %d state %s", index, value?"true":"false" );
+    trace_sled_led( index, value );
+    stat_toggle( index );
     if( value ){
         gpio_set_value( leds[ index ].gpio, 0 );
     }else{
@@ -94,4 +228,44 @@ static inline void toggle_led( size_t index, bool value ){
     }
 }
 
+/**
+ * Set leds
+ *
+ * @brief   Sets several leds at once, with a single
+ *          array call to the gpio driver so it can update
+ *          all the pins in one go. Kernels without the
+ *          array call fall back to one pin at a time.
+ *
+ * @param   mask    Bit i selects leds[i].
+ * @param   on      Bit i is the state leds[i] should have.
+ *
+ **/
+
+static inline void set_leds( unsigned long mask, unsigned long on ){
+    struct gpio_desc *descs[ SLED_MAX_LEDS ];
+    size_t i, n = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+    int values[ SLED_MAX_LEDS ];
+#endif
+
+    trace_sled_leds( mask, on );
+    for( i=0; i<led_count; i++ ){
+        if( !( mask & BIT( i ) ) )
+            continue;
+        stat_toggle( i );
+        //The leds are active low, see toggle_led()
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+        values[n] = !( on & BIT( i ) );
+#else
+        gpio_set_value( leds[i].gpio, !( on & BIT( i ) ) );
+#endif
+        descs[n++] = led_descs[i];
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+    if( n )
+        gpiod_set_array_value( n, descs, values );
+#endif
+}
+
 #endif
@@ -0,0 +1,280 @@
+/**
+ * @file    pattern.h
+ * @version 0.1
+ * @brief   This file implements the preloaded
+ *          patterns of the ioctl interface. A
+ *          pattern is compiled into steps once
+ *          when it is uploaded, triggering it
+ *          only queues the prebuilt sequences.
+ *
+ **/
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include "printops.h"
+#include "command_process.h"
+
+#ifndef _PATTERN_H_
+#define _PATTERN_H_
+
+/**
+ * Led Pattern
+ *
+ * @param   loaded      Whether a pattern has been uploaded.
+ * @param   steps       The steps of all channels, grouped
+ *                      by channel.
+ * @param   seqs        One prebuilt sequence per channel,
+ *                      pointing into steps. A channel the
+ *                      pattern does not use has no steps.
+ *
+ **/
+struct led_pattern {
+    bool                loaded;
+    struct led_step     *steps;
+    struct led_sequence seqs[ CHANNEL_MAX ];
+};
+
+/**
+ * Globals
+ *
+ * @param   patterns        The pattern table, indexed by id.
+ * @param   pattern_lock    Serializes uploads against the
+ *                          other pattern operations.
+ *
+ **/
+static struct led_pattern patterns[ SLED_MAX_PATTERNS ];
+static DEFINE_MUTEX( pattern_lock );
+
+/**
+ * Pattern Active
+ *
+ * @brief   Tells whether any channel of a pattern
+ *          is playing or queued.
+ *
+ * @param   pat     The pattern to check.
+ *
+ **/
+static bool pattern_active( struct led_pattern *pat ){
+    size_t i;
+
+    for( i=0; i<CHANNEL_COUNT; i++ ){
+        if( sequence_active( &channels[i], &pat->seqs[i] ) )
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Compile Pattern
+ *
+ * @brief   Builds the steps of every channel of a
+ *          pattern from its commands. The sequence of a
+ *          channel takes the highest priority of them.
+ *
+ * @param   pat     The pattern to fill in.
+ * @param   cmds    The commands, already validated.
+ * @param   count   The number of commands.
+ *
+ **/
+static int compile_pattern( struct led_pattern *pat,
+                            const struct sled_cmd *cmds, u32 count ){
+    size_t len[ CHANNEL_MAX ] = { 0 };
+    struct led_step *step;
+    size_t total = 0;
+    size_t i, c;
+
+    for( i=0; i<count; i++ ){
+        len[ cmds[i].channel ] += command_steps( &cmds[i] );
+        total += command_steps( &cmds[i] );
+    }
+
+    pat->steps = kmalloc_array( total, sizeof( *pat->steps ), GFP_KERNEL );
+    if( !pat->steps ){
+        stat_inc( STAT_ALLOC_FAILURES );
+        return -ENOMEM;
+    }
+
+    step = pat->steps;
+    for( c=0; c<CHANNEL_COUNT; c++ ){
+        pat->seqs[c].steps  = step;
+        pat->seqs[c].len    = len[c];
+        pat->seqs[c].pool   = NULL;
+        pat->seqs[c].size   = 0;
+        pat->seqs[c].owned  = false;
+        pat->seqs[c].active = false;
+        pat->seqs[c].paused = false;
+        pat->seqs[c].owner  = 0;
+        pat->seqs[c].priority  = 0;
+        pat->seqs[c].preempted = false;
+        INIT_LIST_HEAD( &pat->seqs[c].head );
+
+        for( i=0; i<count; i++ ){
+            if( cmds[i].channel != c )
+                continue;
+            step += fill_steps( step, &cmds[i], step - pat->seqs[c].steps );
+            pat->seqs[c].priority = max( pat->seqs[c].priority, cmds[i].priority );
+        }
+    }
+
+    pat->loaded = true;
+    return 0;
+}
+
+/**
+ * Upload Pattern
+ *
+ * @brief   Copies a pattern from user space, checks it
+ *          and registers it under its id. A pattern which
+ *          is playing can not be replaced. On the device of
+ *          a single led the channel of every command is
+ *          replaced by the one of the device.
+ *
+ * @param   arg     User pointer to a sled_pattern.
+ * @param   channel The channel of the device, or -1.
+ *
+ **/
+static long upload_pattern( unsigned long arg, int channel ){
+    struct sled_pattern req;
+    struct sled_cmd *cmds;
+    struct led_pattern *pat;
+    u32 i;
+    long ret;
+
+    if( copy_from_user( &req, (void __user *) arg, sizeof( req ) ) )
+        return -EFAULT;
+    if( req.id >= SLED_MAX_PATTERNS || req.count == 0 ||
+        req.count > SLED_MAX_BATCH )
+        return -EINVAL;
+
+    cmds = memdup_user( (void __user *)(uintptr_t) req.cmds,
+                        req.count * sizeof( *cmds ) );
+    if( IS_ERR( cmds ) )
+        return PTR_ERR( cmds );
+
+    for( i=0; i<req.count; i++ ){
+        if( channel >= 0 )
+            cmds[i].channel = channel;
+        if( !validate_command( &cmds[i] ) ){
+            kfree( cmds );
+            return -EINVAL;
+        }
+    }
+
+    mutex_lock( &pattern_lock );
+    pat = &patterns[ req.id ];
+    if( pat->loaded ){
+        if( pattern_active( pat ) ){
+            ret = -EBUSY;
+            goto out;
+        }
+        kfree( pat->steps );
+        pat->loaded = false;
+    }
+    ret = compile_pattern( pat, cmds, req.count );
+    kern_dbg( "Pattern %u uploaded", req.id );
+out:
+    mutex_unlock( &pattern_lock );
+    kfree( cmds );
+    return ret;
+}
+
+/**
+ * Trigger Pattern
+ *
+ * @brief   Queues the prebuilt sequences of a pattern
+ *          on their channels. Nothing is parsed or
+ *          allocated. A pattern can only be queued once
+ *          at a time.
+ *
+ * @param   pat     The pattern to play.
+ *
+ **/
+static long trigger_pattern( struct led_pattern *pat ){
+    size_t i;
+
+    if( pattern_active( pat ) )
+        return -EBUSY;
+
+    for( i=0; i<CHANNEL_COUNT; i++ ){
+        if( pat->seqs[i].len ){
+            pat->seqs[i].paused = false;
+            queue_sequence( &channels[i], &pat->seqs[i] );
+        }
+    }
+    return 0;
+}
+
+/**
+ * Pattern Ioctl
+ *
+ * @brief   Dispatches the pattern ioctls of the device.
+ *
+ * @param   cmd     The ioctl command.
+ * @param   arg     The pattern id, or a user pointer
+ *                  for SLED_IOC_UPLOAD.
+ * @param   channel The channel of the device, or -1.
+ *
+ **/
+static long pattern_ioctl( unsigned int cmd, unsigned long arg, int channel ){
+    struct led_pattern *pat;
+    size_t i;
+    long ret = 0;
+
+    if( cmd == SLED_IOC_UPLOAD )
+        return upload_pattern( arg, channel );
+
+    if( arg >= SLED_MAX_PATTERNS )
+        return -EINVAL;
+
+    mutex_lock( &pattern_lock );
+    pat = &patterns[ arg ];
+    if( !pat->loaded ){
+        mutex_unlock( &pattern_lock );
+        return -ENOENT;
+    }
+
+    switch( cmd ){
+        case SLED_IOC_TRIGGER:
+            ret = trigger_pattern( pat );
+            break;
+        case SLED_IOC_PAUSE:
+            for( i=0; i<CHANNEL_COUNT; i++ )
+                pause_sequence( &channels[i], &pat->seqs[i] );
+            break;
+        case SLED_IOC_RESUME:
+            for( i=0; i<CHANNEL_COUNT; i++ )
+                resume_sequence( &channels[i], &pat->seqs[i] );
+            break;
+        case SLED_IOC_CANCEL:
+            for( i=0; i<CHANNEL_COUNT; i++ )
+                cancel_sequence( &channels[i], &pat->seqs[i] );
+            break;
+        default:
+            ret = -ENOTTY;
+    }
+
+    mutex_unlock( &pattern_lock );
+    return ret;
+}
+
+/**
+ * Remove Patterns
+ *
+ * @brief   Frees the steps of every pattern. The
+ *          timers must have been removed already.
+ *
+ **/
+static void remove_patterns( void ){
+    size_t i;
+
+    for( i=0; i<SLED_MAX_PATTERNS; i++ ){
+        if( patterns[i].loaded ){
+            kfree( patterns[i].steps );
+            patterns[i].loaded = false;
+        }
+    }
+}
+#endif
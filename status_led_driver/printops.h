@@ -1,7 +1,7 @@
 /**
  * @file    printops.h
  * @author  Eshan Shafeeq
- * @version 0.1
+ * @version 0.2
  * @date    25 March 2016
  * @brief   This file contains some easy functions
  *          to print out messages to the kernel log
@@ -9,27 +9,41 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/printk.h>
+#include <linux/ratelimit.h>
 #ifndef _PRINTOPS_H_
 #define _PRINTOPS_H_
 
+#define SLED_LOG_ALERT  0
+#define SLED_LOG_INFO   1
+#define SLED_LOG_DEBUG  2
+
+/* Highest level that still reaches the log, writable through
+ * /sys/module/sled/parameters/verbosity */
+static int verbosity = SLED_LOG_INFO;
+module_param( verbosity, int, 0644 );
+MODULE_PARM_DESC( verbosity, "0 alerts only, 1 info (default), 2 debug" );
+
 /**
- * kern_info
+ * sled_log
  *
- * @brief   Prints a message to the kernel buffer
- *          with the message priority of KERN_INFO.
- *          Usually for debugging purposes.
+ * @brief   Hands a message straight to printk when its level
+ *          is within the current verbosity. Every call site
+ *          carries its own ratelimit state, so one noisy
+ *          path can not drown out the others. Nothing is
+ *          formatted when the level is filtered out.
  *
  **/
 
-static void kern_info(  int len, const char *format, ...){
-    char    msg[256];
-    va_list args;
+#define sled_log( level, kern_level, format, ... )                      \
+do {                                                                    \
+    static DEFINE_RATELIMIT_STATE( _sled_rs,                            \
+            DEFAULT_RATELIMIT_INTERVAL, DEFAULT_RATELIMIT_BURST );      \
+    if( unlikely( READ_ONCE( verbosity ) >= (level) ) &&                \
+            __ratelimit( &_sled_rs ) )                                  \
+        printk( kern_level "[SLED]: " format "\n", ##__VA_ARGS__ );     \
+} while( 0 )
 
-    va_start( args, format );
-        vsnprintf(msg, strlen( format ) + len + 1, format, args );
-    va_end( args );
-    printk(KERN_INFO "[SLED]: %s\n", msg);
-}
 /**
  * kern_alert
  *
@@ -39,13 +53,37 @@ static void kern_info(  int len, const char *format, ...){
  *
  **/
 
-static void kern_alert(  int len, const char *format, ...){
-    char    msg[256];
-    va_list args;
+#define kern_alert( format, ... ) \
+    sled_log( SLED_LOG_ALERT, KERN_ALERT, format, ##__VA_ARGS__ )
+
+/**
+ * kern_info
+ *
+ * @brief   Prints a message to the kernel buffer
+ *          with the message priority of KERN_INFO.
+ *          For setup, teardown and statistics.
+ *
+ **/
+
+#define kern_info( format, ... ) \
+    sled_log( SLED_LOG_INFO, KERN_INFO, format, ##__VA_ARGS__ )
+
+/**
+ * kern_dbg
+ *
+ * @brief   Per command chatter. Compiled out unless the
+ *          module is built with -DSLED_DEBUG, in which case
+ *          it still answers to the verbosity parameter.
+ *          no_printk keeps the format checked either way.
+ *
+ **/
+
+#ifdef SLED_DEBUG
+#define kern_dbg( format, ... ) \
+    sled_log( SLED_LOG_DEBUG, KERN_DEBUG, format, ##__VA_ARGS__ )
+#else
+#define kern_dbg( format, ... ) \
+    no_printk( KERN_DEBUG "[SLED]: " format "\n", ##__VA_ARGS__ )
+#endif
 
-    va_start( args, format );
-        vsnprintf(msg, strlen( format ) + len + 1, format, args );
-    va_end( args );
-    printk(KERN_ALERT "[SLED]: %s\n", msg);
-}
 #endif
@@ -0,0 +1,377 @@
+/**
+ * @file    program.h
+ * @version 0.1
+ * @brief   This file compiles the text patterns written
+ *          to the device into step programs, one per led
+ *          the pattern uses, and plays them:
+ *
+ *          echo "R200 G50 off100 x10" > /dev/sled
+ *
+ *          R, G, B<ms>     Lights the leds of the letters,
+ *                          any mix of them ("RG200"), for
+ *                          ms milliseconds, at least 1. The
+ *                          other leds of the pattern are off
+ *                          meanwhile.
+ *          on<ms>          Lights the led of /dev/sledN. On
+ *                          those devices every letter means
+ *                          that led too.
+ *          off<ms>         All the leds of the pattern off.
+ *          x<n>            Plays everything before it in its
+ *                          group n times, n up to 65535 as
+ *                          the repeat of a binary command.
+ *          ( ... )         A group, to repeat part of a pattern:
+ *                          "(R100 off100 x3) B500 x2"
+ *          p<n>            Only first, the priority of the
+ *                          pattern, 0 to SLED_MAX_PRIORITY:
+ *                          "p7 R50 off50 x20"
+ *
+ *          A repeat is a single loop step, so the memory of
+ *          a pattern only depends on the length of its text.
+ *
+ **/
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include "printops.h"
+#include "interrupt.h"
+
+#ifndef _PROGRAM_H_
+#define _PROGRAM_H_
+
+/**
+ * The longest text pattern, a step
+ * takes at least two characters
+ **/
+#define     PROGRAM_MAX_TEXT    1024
+#define     PROGRAM_MAX_STEPS   ( PROGRAM_MAX_TEXT / 2 )
+
+/**
+ * The most rounds of a loop
+ **/
+#define     PROGRAM_MAX_REPEAT  U16_MAX
+
+/**
+ * Program Op
+ *
+ * @brief   A step of a compiled pattern, before it
+ *          is turned into the steps of every led.
+ *
+ * @param   mask    The leds which are on, bit i is leds[i].
+ * @param   value   The duration in microseconds, or the
+ *                  count of a loop.
+ * @param   target  The index a loop jumps back to.
+ * @param   loop    Whether this is a loop.
+ *
+ **/
+struct program_op {
+    unsigned long   mask;
+    u32             value;
+    u16             target;
+    bool            loop;
+};
+
+/**
+ * Program
+ *
+ * @param   ops     The steps.
+ * @param   len     The number of steps.
+ * @param   used    The leds the pattern lights at some point,
+ *                  every one of them gets the whole program.
+ * @param   priority The priority of its sequences.
+ *
+ **/
+struct program {
+    struct program_op   *ops;
+    size_t              len;
+    unsigned long       used;
+    u8                  priority;
+};
+
+/**
+ * Program Text
+ *
+ * @brief   Tells a text pattern from a classic
+ *          command, which starts with a digit.
+ *
+ * @param   text    The text written to the device.
+ *
+ **/
+static inline bool program_text( const char *text ){
+    return text[0] < '0' || text[0] > '9';
+}
+
+static inline bool program_separator( char c ){
+    return c == '\0' || c == ' ' || c == '\t' || c == '\n' ||
+           c == '(' || c == ')';
+}
+
+/**
+ * Parse Number
+ *
+ * @brief   Reads a decimal number which must end on a
+ *          separator. Returns the end of the number, or
+ *          NULL if there is none or it is above max.
+ *
+ * @param   p       The text.
+ * @param   max     The largest number accepted.
+ * @param   value   To store the number.
+ *
+ **/
+static const char * parse_number( const char *p, u32 max, u32 *value ){
+    u64 v = 0;
+
+    if( *p < '0' || *p > '9' )
+        return NULL;
+    while( *p >= '0' && *p <= '9' ){
+        v = v * 10 + ( *p++ - '0' );
+        if( v > max )
+            return NULL;
+    }
+    if( !program_separator( *p ) )
+        return NULL;
+
+    *value = v;
+    return p;
+}
+
+/**
+ * Parse Leds
+ *
+ * @brief   Reads the led part of a step, "off", "on"
+ *          or color letters. Returns the end of it, or
+ *          NULL if it names no led of the device.
+ *
+ * @param   p       The text.
+ * @param   channel The channel of the device, or -1.
+ * @param   mask    To store the leds to light.
+ *
+ **/
+static const char * parse_leds( const char *p, int channel,
+                                unsigned long *mask ){
+    int led;
+
+    *mask = 0;
+    if( !strncmp( p, "off", 3 ) )
+        return p + 3;
+    if( !strncmp( p, "on", 2 ) ){
+        if( channel < 0 )
+            return NULL;
+        *mask = BIT( channel );
+        return p + 2;
+    }
+
+    for( ; ; p++ ){
+        switch( *p ){
+            case 'R': case 'r':
+                led = SLED_RED;
+                break;
+            case 'G': case 'g':
+                led = SLED_GREEN;
+                break;
+            case 'B': case 'b':
+                led = SLED_BLUE;
+                break;
+            default:
+                return *mask ? p : NULL;
+        }
+        if( channel >= 0 )
+            led = channel;
+        if( led >= CHANNEL_COUNT )
+            return NULL;
+        *mask |= BIT( led );
+    }
+}
+
+/**
+ * Compile Program
+ *
+ * @brief   Compiles a text pattern into prog, whose ops
+ *          must have room for PROGRAM_MAX_STEPS. Every
+ *          group and every loop body holds at least one
+ *          step which sets the leds, which the channels
+ *          rely on.
+ *
+ * @param   text    The pattern, nul terminated.
+ * @param   channel The channel of the device, or -1.
+ * @param   prog    To store the program.
+ *
+ **/
+static int compile_program( const char *text, int channel,
+                            struct program *prog ){
+    size_t start[ LOOP_DEPTH + 1 ];
+    unsigned int depth[ LOOP_DEPTH + 1 ];
+    unsigned int level = 0;
+    const char *p = text;
+    struct program_op *op;
+    unsigned long mask;
+    u32 value;
+
+    start[0] = 0;
+    depth[0] = 0;
+    prog->len = 0;
+    prog->used = 0;
+    prog->priority = 0;
+
+    while( *p == ' ' || *p == '\t' || *p == '\n' )
+        p++;
+    if( *p == 'p' || *p == 'P' ){
+        p = parse_number( p + 1, SLED_MAX_PRIORITY, &value );
+        if( !p )
+            return -EINVAL;
+        prog->priority = value;
+    }
+
+    for( ;; ){
+        while( *p == ' ' || *p == '\t' || *p == '\n' )
+            p++;
+        if( !*p )
+            break;
+
+        if( *p == '(' ){
+            if( level == LOOP_DEPTH )
+                return -EINVAL;
+            level++;
+            start[ level ] = prog->len;
+            depth[ level ] = 0;
+            p++;
+            continue;
+        }
+
+        if( *p == ')' ){
+            if( !level || prog->len == start[ level ] )
+                return -EINVAL;
+            depth[ level - 1 ] = max( depth[ level - 1 ], depth[ level ] );
+            level--;
+            p++;
+            continue;
+        }
+
+        if( prog->len == PROGRAM_MAX_STEPS )
+            return -E2BIG;
+        op = &prog->ops[ prog->len ];
+
+        if( *p == 'x' ){
+            p = parse_number( p + 1, PROGRAM_MAX_REPEAT, &value );
+            if( !p || !value || prog->len == start[ level ] )
+                return -EINVAL;
+            if( value == 1 )
+                continue;
+
+            //The loop holds every loop before it in the group
+            if( ++depth[ level ] > LOOP_DEPTH )
+                return -EINVAL;
+            op->loop   = true;
+            op->mask   = 0;
+            op->target = start[ level ];
+            op->value  = value;
+            prog->len++;
+            continue;
+        }
+
+        p = parse_leds( p, channel, &mask );
+        if( !p )
+            return -EINVAL;
+        p = parse_number( p, U32_MAX / USEC_PER_MSEC, &value );
+        if( !p || value * USEC_PER_MSEC < SLED_MIN_STEP_US )
+            return -EINVAL;
+
+        op->loop  = false;
+        op->mask  = mask;
+        op->value = value * USEC_PER_MSEC;
+        prog->used |= mask;
+        prog->len++;
+    }
+
+    if( level || !prog->used )
+        return -EINVAL;
+    return 0;
+}
+
+/**
+ * Fill Program
+ *
+ * @brief   Writes the steps of one led of a program.
+ *
+ * @param   seq     The sequence of the led, as long as
+ *                  the program.
+ * @param   prog    The program.
+ * @param   led     The index of the led.
+ *
+ **/
+static void fill_program( struct led_sequence *seq,
+                          const struct program *prog, size_t led ){
+    const struct program_op *op;
+    struct led_step *step;
+    size_t i;
+
+    for( i=0; i<prog->len; i++ ){
+        op = &prog->ops[i];
+        step = &seq->steps[i];
+        if( op->loop ){
+            fill_loop( step, led, op->target, op->value );
+            continue;
+        }
+        step->led         = led;
+        step->linear      = 0;
+        step->loop        = 0;
+        step->level       = op->mask & BIT( led ) ? PWM_LEVEL_MAX : 0;
+        step->fade_ms     = 0;
+        step->duration_us = op->value;
+    }
+}
+
+/**
+ * Play Program
+ *
+ * @brief   Compiles a text pattern and queues its
+ *          sequences on the leds it uses. Nothing is
+ *          queued unless every led got its sequence.
+ *
+ * @param   text    The pattern, nul terminated.
+ * @param   channel The channel of the device, or -1.
+ * @param   owner   The id of the file which wrote it.
+ *
+ **/
+static int play_program( const char *text, int channel, u64 owner ){
+    struct led_sequence *seqs[ CHANNEL_MAX ] = { NULL };
+    struct program prog;
+    size_t i;
+    int ret;
+
+    prog.ops = kmalloc_array( PROGRAM_MAX_STEPS, sizeof( *prog.ops ), GFP_KERNEL );
+    if( !prog.ops )
+        return -ENOMEM;
+
+    ret = compile_program( text, channel, &prog );
+    if( ret )
+        goto out;
+
+    for( i=0; i<CHANNEL_COUNT; i++ ){
+        if( !( prog.used & BIT( i ) ) )
+            continue;
+        seqs[i] = alloc_sequence( i, prog.len );
+        if( !seqs[i] ){
+            ret = -ENOMEM;
+            goto out;
+        }
+        fill_program( seqs[i], &prog, i );
+        seqs[i]->owner = owner;
+        seqs[i]->priority = prog.priority;
+    }
+
+    for( i=0; i<CHANNEL_COUNT; i++ ){
+        if( seqs[i] ){
+            queue_sequence( &channels[i], seqs[i] );
+            seqs[i] = NULL;
+        }
+    }
+    kern_dbg( "Pattern of %zu steps queued", prog.len );
+
+out:
+    for( i=0; i<CHANNEL_COUNT; i++ )
+        destroy_task_list( seqs[i] );
+    kfree( prog.ops );
+    return ret;
+}
+
+#endif
@@ -0,0 +1,204 @@
+/**
+ * @file    sled_abi.h
+ * @version 0.1
+ * @brief   This file describes the binary command
+ *          format of /dev/sled. It is shared by the
+ *          module and user space programs.
+ *
+ *          A binary write is a sled_batch header
+ *          followed by count sled_cmd structures,
+ *          all in a single buffer. A batch is queued
+ *          as a whole or not at all.
+ *
+ *          Patterns which are played often can be
+ *          uploaded once with SLED_IOC_UPLOAD and then
+ *          triggered, paused, resumed and cancelled by
+ *          their id without any parsing or allocation.
+ *
+ *          The fastest path is the control page. Mapping
+ *          /dev/sled with mmap and MAP_SHARED gives a
+ *          sled_control page which the driver samples
+ *          every tick, so an update is a plain store
+ *          with no syscall.
+ *
+ **/
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#ifndef _SLED_ABI_H_
+#define _SLED_ABI_H_
+
+/**
+ * "SLED" in little endian, the first four
+ * bytes of every binary write.
+ **/
+#define     SLED_BATCH_MAGIC    0x44454c53
+
+/**
+ * The largest number of commands a single
+ * write can carry.
+ **/
+#define     SLED_MAX_BATCH      4096
+
+/**
+ * Channels, the index of the led in leds[]
+ **/
+#define     SLED_RED            0
+#define     SLED_GREEN          1
+#define     SLED_BLUE           2
+
+/**
+ * Command flags
+ *
+ * @param   SLED_CMD_LINEAR     Use the brightness as the duty cycle
+ *                              as it is, without gamma correction.
+ **/
+#define     SLED_CMD_LINEAR     0x01
+
+/**
+ * The shortest on or off time of a command, text
+ * patterns count in whole milliseconds so 1 ms
+ * there. Every step takes a timer interrupt, this
+ * bounds how fast a channel can make them.
+ **/
+#define     SLED_MIN_STEP_US    100
+
+/**
+ * The highest priority of a command, 0 is the lowest
+ * and the default.
+ **/
+#define     SLED_MAX_PRIORITY   7
+
+/**
+ * Sled Command
+ *
+ * @param   channel     The led to blink.
+ * @param   brightness  0 is off, 255 is fully on, levels in
+ *                      between are shown with software pwm.
+ * @param   repeat      Number of blinks, at least 1.
+ * @param   on_us       Time the led stays on in microseconds,
+ *                      at least SLED_MIN_STEP_US.
+ * @param   off_us      Time the led stays off in microseconds,
+ *                      at least SLED_MIN_STEP_US.
+ * @param   fade_ms     Time to fade in at the start of the on
+ *                      time and out at the start of the off time,
+ *                      0 switches straight away.
+ * @param   flags       SLED_CMD_ flags.
+ * @param   priority    0 to SLED_MAX_PRIORITY. A command of a
+ *                      higher priority than the one playing on
+ *                      its led interrupts it, the interrupted one
+ *                      carries on from the step it was cut in once
+ *                      the leds of higher priority are done. Equal
+ *                      priorities play in the order they came.
+ *
+ **/
+struct sled_cmd {
+    __u8    channel;
+    __u8    brightness;
+    __u16   repeat;
+    __u32   on_us;
+    __u32   off_us;
+    __u16   fade_ms;
+    __u8    flags;
+    __u8    priority;
+};
+
+/**
+ * Sled Batch
+ *
+ * @param   magic       Must be SLED_BATCH_MAGIC.
+ * @param   count       The number of commands following.
+ * @param   cmds        The commands.
+ *
+ **/
+struct sled_batch {
+    __u32           magic;
+    __u32           count;
+    struct sled_cmd cmds[];
+};
+
+/**
+ * The number of pattern ids, patterns are
+ * numbered from 0 to SLED_MAX_PATTERNS - 1.
+ **/
+#define     SLED_MAX_PATTERNS   32
+
+/**
+ * Sled Pattern
+ *
+ * @param   id          The id to register the pattern under.
+ * @param   count       The number of commands in the pattern.
+ * @param   cmds        User pointer to count sled_cmd structures.
+ *                      Commands for the same channel are played
+ *                      one after the other, different channels
+ *                      play in parallel.
+ *
+ **/
+struct sled_pattern {
+    __u32   id;
+    __u32   count;
+    __u64   cmds;
+};
+
+/**
+ * Ioctl commands, TRIGGER, PAUSE, RESUME and
+ * CANCEL take the pattern id as argument.
+ *
+ * SLED_IOC_STOP stops the commands and text patterns
+ * written through the same open file, playing or queued,
+ * or with SLED_STOP_ALL every sequence on the leds of
+ * the device, preloaded patterns included. It returns
+ * the number of sequences stopped.
+ *
+ * SLED_IOC_AUTOCANCEL with 1 makes closing the file
+ * stop its work, 0 lets it play on, the default.
+ **/
+#define     SLED_IOC_MAGIC      's'
+#define     SLED_IOC_UPLOAD     _IOW( SLED_IOC_MAGIC, 1, struct sled_pattern )
+#define     SLED_IOC_TRIGGER    _IO( SLED_IOC_MAGIC, 2 )
+#define     SLED_IOC_PAUSE      _IO( SLED_IOC_MAGIC, 3 )
+#define     SLED_IOC_RESUME     _IO( SLED_IOC_MAGIC, 4 )
+#define     SLED_IOC_CANCEL     _IO( SLED_IOC_MAGIC, 5 )
+#define     SLED_IOC_STOP       _IO( SLED_IOC_MAGIC, 6 )
+#define     SLED_IOC_AUTOCANCEL _IO( SLED_IOC_MAGIC, 7 )
+
+#define     SLED_STOP_ALL       0x01
+
+/**
+ * The number of channel slots in the
+ * control page.
+ **/
+#define     SLED_CONTROL_CHANNELS   64
+
+/**
+ * Sled Control Channel
+ *
+ * @param   enabled     When set the control page owns the led,
+ *                      sequences on the channel keep running but
+ *                      do not drive the led.
+ * @param   level       The brightness to show, 0 is off.
+ *
+ **/
+struct sled_control_channel {
+    __u8    enabled;
+    __u8    level;
+    __u16   reserved;
+};
+
+/**
+ * Sled Control
+ *
+ * @param   seq         Bumped by user space after the channels
+ *                      have been updated, the driver only looks
+ *                      at the channels when it changes.
+ * @param   channels    The desired state of every channel.
+ *
+ **/
+struct sled_control {
+    __u32                       seq;
+    __u32                       reserved;
+    struct sled_control_channel channels[ SLED_CONTROL_CHANNELS ];
+};
+
+#endif
@@ -0,0 +1,188 @@
+/**
+ * @file    sled_trace.h
+ * @version 0.1
+ * @brief   Tracepoints of the command and timer paths.
+ *          They cost a predicted branch while disabled,
+ *          enable them through ftrace or perf:
+ *
+ *          echo 1 > /sys/kernel/debug/tracing/events/sled/enable
+ *          perf record -e 'sled:*' -a
+ *
+ *          start.c defines CREATE_TRACE_POINTS before its
+ *          last include of this file.
+ **/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sled
+
+#if !defined(_SLED_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _SLED_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/**
+ * sled_command
+ *
+ * @brief   A command is handed to the sequencer.
+ *
+ **/
+TRACE_EVENT( sled_command,
+
+    TP_PROTO( u8 channel, u8 brightness, u16 repeat,
+              u32 on_us, u32 off_us, u16 fade_ms ),
+
+    TP_ARGS( channel, brightness, repeat, on_us, off_us, fade_ms ),
+
+    TP_STRUCT__entry(
+        __field( u8,    channel     )
+        __field( u8,    brightness  )
+        __field( u16,   repeat      )
+        __field( u32,   on_us       )
+        __field( u32,   off_us      )
+        __field( u16,   fade_ms     )
+    ),
+
+    TP_fast_assign(
+        __entry->channel    = channel;
+        __entry->brightness = brightness;
+        __entry->repeat     = repeat;
+        __entry->on_us      = on_us;
+        __entry->off_us     = off_us;
+        __entry->fade_ms    = fade_ms;
+    ),
+
+    TP_printk( "channel=%u brightness=%u repeat=%u on_us=%u off_us=%u fade_ms=%u",
+               __entry->channel, __entry->brightness, __entry->repeat,
+               __entry->on_us, __entry->off_us, __entry->fade_ms )
+);
+
+/**
+ * sled_sequence
+ *
+ * @brief   A sequence is started on a channel, or queued
+ *          behind the current one. depth is the number of
+ *          sequences waiting on the channel afterwards.
+ *
+ **/
+TRACE_EVENT( sled_sequence,
+
+    TP_PROTO( unsigned int channel, size_t steps,
+              unsigned int depth, bool queued ),
+
+    TP_ARGS( channel, steps, depth, queued ),
+
+    TP_STRUCT__entry(
+        __field( unsigned int,  channel )
+        __field( size_t,        steps   )
+        __field( unsigned int,  depth   )
+        __field( bool,          queued  )
+    ),
+
+    TP_fast_assign(
+        __entry->channel    = channel;
+        __entry->steps      = steps;
+        __entry->depth      = depth;
+        __entry->queued     = queued;
+    ),
+
+    TP_printk( "channel=%u steps=%zu depth=%u %s",
+               __entry->channel, __entry->steps, __entry->depth,
+               __entry->queued ? "queued" : "started" )
+);
+
+/**
+ * sled_tick
+ *
+ * @brief   The timer of a channel fired. step is the index
+ *          of the step about to be applied, expected the
+ *          time the tick was requested for and actual the
+ *          time it ran, both in ns of CLOCK_MONOTONIC.
+ *
+ **/
+TRACE_EVENT( sled_tick,
+
+    TP_PROTO( unsigned int channel, size_t step,
+              s64 expected, s64 actual, unsigned int depth ),
+
+    TP_ARGS( channel, step, expected, actual, depth ),
+
+    TP_STRUCT__entry(
+        __field( unsigned int,  channel     )
+        __field( size_t,        step        )
+        __field( s64,           expected    )
+        __field( s64,           actual      )
+        __field( unsigned int,  depth       )
+    ),
+
+    TP_fast_assign(
+        __entry->channel    = channel;
+        __entry->step       = step;
+        __entry->expected   = expected;
+        __entry->actual     = actual;
+        __entry->depth      = depth;
+    ),
+
+    TP_printk( "channel=%u step=%zu expected=%lld actual=%lld late=%lld depth=%u",
+               __entry->channel, __entry->step,
+               __entry->expected, __entry->actual,
+               __entry->actual - __entry->expected, __entry->depth )
+);
+
+/**
+ * sled_led
+ *
+ * @brief   The gpio of a single led is written.
+ *
+ **/
+TRACE_EVENT( sled_led,
+
+    TP_PROTO( size_t index, bool value ),
+
+    TP_ARGS( index, value ),
+
+    TP_STRUCT__entry(
+        __field( size_t,    index   )
+        __field( bool,      value   )
+    ),
+
+    TP_fast_assign(
+        __entry->index  = index;
+        __entry->value  = value;
+    ),
+
+    TP_printk( "led=%zu %s", __entry->index, __entry->value ? "on" : "off" )
+);
+
+/**
+ * sled_leds
+ *
+ * @brief   Several leds are written in one array call,
+ *          bit i of mask and on stands for leds[i].
+ *
+ **/
+TRACE_EVENT( sled_leds,
+
+    TP_PROTO( unsigned long mask, unsigned long on ),
+
+    TP_ARGS( mask, on ),
+
+    TP_STRUCT__entry(
+        __field( unsigned long, mask    )
+        __field( unsigned long, on      )
+    ),
+
+    TP_fast_assign(
+        __entry->mask   = mask;
+        __entry->on     = on;
+    ),
+
+    TP_printk( "mask=%#lx on=%#lx", __entry->mask, __entry->on )
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sled_trace
+#include <trace/define_trace.h>
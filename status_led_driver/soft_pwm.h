@@ -0,0 +1,335 @@
+/**
+ * @file    soft_pwm.h
+ * @version 0.1
+ * @brief   This file implements a software pwm
+ *          engine on the gpio leds, to show levels
+ *          between off and fully on and to fade from
+ *          one level to another. All the channels share
+ *          a single high resolution timer which fires
+ *          at the start of every period and at the
+ *          moments a channel has to be switched off, so
+ *          adding channels does not add timers. The leds
+ *          switching at the same moment are updated with
+ *          a single batched gpio call.
+ *
+ **/
+
+#include <linux/kernel.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include "printops.h"
+#include "led_gpio.h"
+
+#ifndef _SOFT_PWM_H_
+#define _SOFT_PWM_H_
+
+/**
+ * The pwm period, 200Hz
+ **/
+#define     PWM_PERIOD_US       5000
+
+/**
+ * The brightest level
+ **/
+#define     PWM_LEVEL_MAX       255
+
+/**
+ * Gamma correction
+ *
+ * @brief   Maps a level to the duty cycle which looks
+ *          like that level to the eye, gamma 2.2. Any
+ *          level above 0 stays visible.
+ *
+ **/
+static const u8 pwm_gamma[ 256 ] = {
+      0,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+      3,   3,   3,   3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+      6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  11,  11,  11,  12,
+     12,  13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+     20,  20,  21,  22,  22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+     30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,  39,  39,  40,  41,
+     42,  43,  43,  44,  45,  46,  47,  48,  49,  49,  50,  51,  52,  53,  54,  55,
+     56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+     73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,  87,  88,  89,  90,
+     91,  93,  94,  95,  97,  98,  99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+    113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+    137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+    163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+    192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+    223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255,
+};
+
+/**
+ * Pwm Channel
+ *
+ * @param   engaged     Whether the pwm engine drives the led.
+ * @param   linear      Whether the level is used as the duty
+ *                      cycle as it is, without gamma correction.
+ * @param   level       The current level of the led.
+ * @param   fade_from   The level a fade started from.
+ * @param   fade_to     The level a fade ends on.
+ * @param   fade_us     The length of the fade, 0 when not fading.
+ * @param   fade_at_us  How far into the fade the led is.
+ * @param   on_us       The time the led is on in the current period.
+ *
+ **/
+struct pwm_channel {
+    bool    engaged;
+    bool    linear;
+    u8      level;
+    u8      fade_from;
+    u8      fade_to;
+    u32     fade_us;
+    u32     fade_at_us;
+    u32     on_us;
+};
+
+/**
+ * Globals
+ *
+ * @param   pwm             The state of every channel.
+ * @param   pwm_lock        Protects the pwm state against the timer.
+ * @param   pwm_timer       The single timer of the engine.
+ * @param   pwm_engaged     The number of engaged channels, the
+ *                          timer runs while it is not 0.
+ * @param   pwm_running     Whether the timer is queued or running,
+ *                          only the timer routine clears it.
+ * @param   pwm_period      The time the current period started.
+ * @param   pwm_at_us       How far into the current period the
+ *                          timer is.
+ *
+ **/
+static struct pwm_channel pwm[ SLED_MAX_LEDS ];
+static DEFINE_SPINLOCK( pwm_lock );
+static struct hrtimer pwm_timer;
+static unsigned int pwm_engaged;
+static bool pwm_running;
+static ktime_t pwm_period;
+static u32 pwm_at_us;
+
+/**
+ * Pwm Duty
+ *
+ * @brief   The time a led is on in every period
+ *          for a given level.
+ *
+ * @param   ch      The pwm channel.
+ *
+ **/
+static inline u32 pwm_duty( struct pwm_channel *ch ){
+    u32 duty = ch->linear ? ch->level : pwm_gamma[ ch->level ];
+
+    return duty * PWM_PERIOD_US / PWM_LEVEL_MAX;
+}
+
+/**
+ * Pwm Disengage
+ *
+ * @brief   Hands a led back to direct control once
+ *          it is fully on or off and not fading.
+ *          Must be called with the pwm lock held.
+ *
+ * @param   index   The index of the led.
+ *
+ **/
+static inline void pwm_disengage( size_t index ){
+    if( pwm[ index ].engaged ){
+        pwm[ index ].engaged = false;
+        pwm_engaged--;
+    }
+    toggle_led( index, pwm[ index ].level );
+}
+
+/**
+ * Pwm Advance
+ *
+ * @brief   Moves the fade of a channel on by a period
+ *          and works out its on time for the period.
+ *          Must be called with the pwm lock held.
+ *
+ * @param   index   The index of the led.
+ *
+ **/
+static void pwm_advance( size_t index ){
+    struct pwm_channel *ch = &pwm[ index ];
+    int span;
+
+    if( ch->fade_us ){
+        ch->fade_at_us += PWM_PERIOD_US;
+        if( ch->fade_at_us >= ch->fade_us ){
+            ch->level = ch->fade_to;
+            ch->fade_us = 0;
+        }else{
+            span = (int) ch->fade_to - ch->fade_from;
+            ch->level = ch->fade_from +
+                        div_s64( (s64) span * ch->fade_at_us, ch->fade_us );
+        }
+    }
+
+    if( !ch->fade_us && ( ch->level == 0 || ch->level == PWM_LEVEL_MAX ) ){
+        pwm_disengage( index );
+        return;
+    }
+    ch->on_us = pwm_duty( ch );
+}
+
+/**
+ * Pwm Routine
+ *
+ * @brief   The timer routine of the engine. At the start
+ *          of a period every engaged led with an on time is
+ *          switched on, afterwards the timer fires at each
+ *          distinct on time and switches those leds off.
+ *
+ * @param   timer   The pwm timer.
+ *
+ **/
+static enum hrtimer_restart pwm_routine( struct hrtimer *timer ){
+    u32 next = PWM_PERIOD_US;
+    unsigned long mask = 0;
+    unsigned long on = 0;
+    size_t i;
+
+    spin_lock( &pwm_lock );
+
+    for( i=0; i<led_count; i++ ){
+        if( !pwm[i].engaged )
+            continue;
+
+        if( pwm_at_us == 0 ){
+            pwm_advance( i );
+            if( !pwm[i].engaged )
+                continue;
+            mask |= BIT( i );
+            if( pwm[i].on_us > 0 )
+                on |= BIT( i );
+        }else if( pwm[i].on_us <= pwm_at_us ){
+            mask |= BIT( i );
+        }
+
+        if( pwm[i].on_us > pwm_at_us && pwm[i].on_us < next )
+            next = pwm[i].on_us;
+    }
+
+    //All the edges of this moment in one gpio update
+    set_leds( mask, on );
+
+    if( !pwm_engaged ){
+        pwm_running = false;
+        spin_unlock( &pwm_lock );
+        return HRTIMER_NORESTART;
+    }
+
+    if( next == PWM_PERIOD_US ){
+        pwm_period = ktime_add_us( pwm_period, PWM_PERIOD_US );
+        pwm_at_us = 0;
+    }else{
+        pwm_at_us = next;
+    }
+    hrtimer_set_expires( timer, ktime_add_us( pwm_period, pwm_at_us ) );
+
+    spin_unlock( &pwm_lock );
+    return HRTIMER_RESTART;
+}
+
+/**
+ * Pwm Set Level
+ *
+ * @brief   Sets the level of a led, fading to it if asked.
+ *          Fully on and fully off without a fade drive the
+ *          led directly, anything else engages the engine.
+ *
+ * @param   index       The index of the led.
+ * @param   level       The level to show, 0 is off.
+ * @param   fade_ms     The time to fade from the current level.
+ * @param   linear      Whether to skip the gamma correction.
+ *
+ **/
+static void pwm_set_level( size_t index, u8 level, u16 fade_ms, bool linear ){
+    struct pwm_channel *ch = &pwm[ index ];
+    unsigned long flags;
+
+    spin_lock_irqsave( &pwm_lock, flags );
+
+    ch->linear = linear;
+    if( fade_ms && ch->level != level ){
+        ch->fade_from = ch->level;
+        ch->fade_to = level;
+        ch->fade_us = fade_ms * USEC_PER_MSEC;
+        ch->fade_at_us = 0;
+    }else{
+        ch->level = level;
+        ch->fade_us = 0;
+        if( level == 0 || level == PWM_LEVEL_MAX ){
+            pwm_disengage( index );
+            spin_unlock_irqrestore( &pwm_lock, flags );
+            return;
+        }
+    }
+
+    //The new on time is picked up at the start of the next period
+    if( !ch->engaged ){
+        ch->engaged = true;
+        ch->on_us = 0;
+        pwm_engaged++;
+    }
+    if( !pwm_running ){
+        pwm_running = true;
+        pwm_period = ktime_get();
+        pwm_at_us = 0;
+        hrtimer_start( &pwm_timer, pwm_period, HRTIMER_MODE_ABS );
+    }
+
+    spin_unlock_irqrestore( &pwm_lock, flags );
+}
+
+/**
+ * Pwm Release
+ *
+ * @brief   Stops driving a led, used before its
+ *          gpio is released.
+ *
+ * @param   index   The index of the led.
+ *
+ **/
+static void pwm_release( size_t index ){
+    unsigned long flags;
+
+    spin_lock_irqsave( &pwm_lock, flags );
+    pwm[ index ].level = 0;
+    pwm[ index ].fade_us = 0;
+    if( pwm[ index ].engaged ){
+        pwm[ index ].engaged = false;
+        pwm_engaged--;
+    }
+    spin_unlock_irqrestore( &pwm_lock, flags );
+}
+
+/**
+ * Setup Pwm
+ *
+ * @brief   Initiates the timer of the engine.
+ *
+ **/
+static void setup_pwm( void ){
+    hrtimer_init( &pwm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS );
+    pwm_timer.function = pwm_routine;
+}
+
+/**
+ * Remove Pwm
+ *
+ * @brief   Stops the timer of the engine.
+ *
+ **/
+static void remove_pwm( void ){
+    size_t i;
+
+    for( i=0; i<led_count; i++ ){
+        pwm_release( i );
+    }
+    hrtimer_cancel( &pwm_timer );
+}
+#endif
@@ -15,6 +15,10 @@
 #include "chardev.h"
 #include "interrupt.h"
 
+//Instantiate the tracepoints, after every other include
+#define CREATE_TRACE_POINTS
+#include "sled_trace.h"
+
 /**
  * Module definitions
  * ------------------
@@ -32,12 +36,40 @@ MODULE_SUPPORTED_DEVICE(DEVICE_NAME);
 static int __init cmd_dev_init(void){
     int ret;
 
-    ret = setup_chardev();
+    ret = setup_leds();
+    if( ret != 0 ){
+        return ret;
+    }
+
+    ret = initiate_leds();
+    if( ret != 0 ){
+        return ret;
+    }
+
+    setup_stats( led_count );
+    ret = setup_control();
+    if( ret != 0 ){
+        remove_stats();
+        release_leds();
+        return ret;
+    }
+
+    ret = setup_timer_interrupt();
     if( ret != 0 ){
+        remove_control();
+        remove_stats();
+        release_leds();
         return ret;
     }
 
-    setup_timer_interrupt();
+    ret = setup_chardev();
+    if( ret != 0 ){
+        remove_timer();
+        remove_control();
+        remove_stats();
+        release_leds();
+        return ret;
+    }
 
     return 0;
 }
@@ -48,7 +80,12 @@ static int __init cmd_dev_init(void){
  **/
 static void __exit cmd_dev_exit(void){
     remove_chardev();      
+    remove_command_queue();
     remove_timer();
+    remove_patterns();
+    remove_control();
+    remove_stats();
+    release_leds();
 }
 
 module_init( cmd_dev_init );
@@ -0,0 +1,262 @@
+/**
+ * @file    stats.h
+ * @version 0.1
+ * @brief   Counters of what the driver is doing, kept
+ *          per cpu so the hot paths only ever touch a
+ *          local cache line. They are summed up when
+ *          /sys/kernel/debug/sled/stats is read,
+ *          along with the free space of the step pools.
+ *
+ **/
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/genalloc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include "printops.h"
+#include "sled_abi.h"
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+/**
+ * Counters
+ *
+ * @param   STAT_ACCEPTED       Commands queued for the channels.
+ * @param   STAT_REJECTED       Commands refused as malformed.
+ * @param   STAT_TICKS          Timer ticks of the channels.
+ * @param   STAT_LATE_TICKS     Ticks later than late_threshold_us.
+ * @param   STAT_ALLOC_FAILURES Sequences or patterns which
+ *                              did not get their memory.
+ *
+ **/
+enum sled_stat {
+    STAT_ACCEPTED,
+    STAT_REJECTED,
+    STAT_TICKS,
+    STAT_LATE_TICKS,
+    STAT_ALLOC_FAILURES,
+    STAT_COUNT
+};
+
+static const char * const stat_names[ STAT_COUNT ] = {
+    [ STAT_ACCEPTED ]       = "commands_accepted",
+    [ STAT_REJECTED ]       = "commands_rejected",
+    [ STAT_TICKS ]          = "ticks",
+    [ STAT_LATE_TICKS ]     = "late_ticks",
+    [ STAT_ALLOC_FAILURES ] = "alloc_failures",
+};
+
+/**
+ * Sled Stats
+ *
+ * @param   count       The counters above.
+ * @param   toggles     Gpio writes per led.
+ * @param   late_max_ns The worst lateness of a tick.
+ * @param   queue_hwm   The deepest the command ring has been.
+ *
+ **/
+struct sled_stats {
+    u64     count[ STAT_COUNT ];
+    u64     toggles[ SLED_CONTROL_CHANNELS ];
+    u64     late_max_ns;
+    u32     queue_hwm;
+};
+
+static DEFINE_PER_CPU( struct sled_stats, sled_stats );
+
+static unsigned int late_threshold_us = 1000;
+module_param( late_threshold_us, uint, 0644 );
+MODULE_PARM_DESC( late_threshold_us, "Lateness from which a tick counts as late" );
+
+static struct dentry *stats_dir;
+static size_t stats_leds;
+
+/**
+ * Step pools reported by the stats file, indexed by
+ * led. stats_pool_lock keeps a pool from going away
+ * while the file is read.
+ **/
+static struct gen_pool *stats_pools[ SLED_CONTROL_CHANNELS ];
+static DEFINE_MUTEX( stats_pool_lock );
+
+/**
+ * Stat Inc
+ *
+ * @brief   Bumps a counter on the local cpu, safe
+ *          from any context.
+ *
+ * @param   stat    The counter.
+ *
+ **/
+static inline void stat_inc( enum sled_stat stat ){
+    this_cpu_inc( sled_stats.count[ stat ] );
+}
+
+/**
+ * Stat Add
+ *
+ * @brief   Adds to a counter on the local cpu.
+ *
+ * @param   stat    The counter.
+ * @param   n       The amount to add.
+ *
+ **/
+static inline void stat_add( enum sled_stat stat, unsigned int n ){
+    this_cpu_add( sled_stats.count[ stat ], n );
+}
+
+/**
+ * Stat Toggle
+ *
+ * @brief   Counts a gpio write of a led.
+ *
+ * @param   index   The index of the led.
+ *
+ **/
+static inline void stat_toggle( size_t index ){
+    if( index < SLED_CONTROL_CHANNELS )
+        this_cpu_inc( sled_stats.toggles[ index ] );
+}
+
+/**
+ * Stat Tick
+ *
+ * @brief   Counts a tick and records its lateness.
+ *          Only called from the timer of a channel.
+ *
+ * @param   late_ns     How late the tick fired.
+ *
+ **/
+static inline void stat_tick( u64 late_ns ){
+    this_cpu_inc( sled_stats.count[ STAT_TICKS ] );
+    if( late_ns > (u64) late_threshold_us * NSEC_PER_USEC )
+        this_cpu_inc( sled_stats.count[ STAT_LATE_TICKS ] );
+    if( late_ns > this_cpu_read( sled_stats.late_max_ns ) )
+        this_cpu_write( sled_stats.late_max_ns, late_ns );
+}
+
+/**
+ * Stat Queue Depth
+ *
+ * @brief   Records the depth of the command ring.
+ *          Called with the producer lock held.
+ *
+ * @param   depth   The number of commands in the ring.
+ *
+ **/
+static inline void stat_queue_depth( u32 depth ){
+    if( depth > this_cpu_read( sled_stats.queue_hwm ) )
+        this_cpu_write( sled_stats.queue_hwm, depth );
+}
+
+/**
+ * Stat Pool
+ *
+ * @brief   Registers the step pool of a led with the
+ *          stats file, or drops it with NULL. May sleep.
+ *
+ * @param   index   The index of the led.
+ * @param   pool    The pool, or NULL.
+ *
+ **/
+static void stat_pool( size_t index, struct gen_pool *pool ){
+    if( index >= SLED_CONTROL_CHANNELS )
+        return;
+    mutex_lock( &stats_pool_lock );
+    stats_pools[ index ] = pool;
+    mutex_unlock( &stats_pool_lock );
+}
+
+/**
+ * Stats Show
+ *
+ * @brief   Sums the counters of every cpu into
+ *          the stats file.
+ *
+ **/
+static int stats_show( struct seq_file *m, void *unused ){
+    u64 count[ STAT_COUNT ] = { 0 };
+    u64 toggles[ SLED_CONTROL_CHANNELS ] = { 0 };
+    u64 late_max = 0;
+    u32 hwm = 0;
+    struct sled_stats *s;
+    int cpu;
+    size_t i;
+
+    for_each_possible_cpu( cpu ){
+        s = per_cpu_ptr( &sled_stats, cpu );
+        for( i=0; i<STAT_COUNT; i++ )
+            count[i] += s->count[i];
+        for( i=0; i<stats_leds; i++ )
+            toggles[i] += s->toggles[i];
+        late_max = max( late_max, s->late_max_ns );
+        hwm = max( hwm, s->queue_hwm );
+    }
+
+    for( i=0; i<STAT_COUNT; i++ )
+        seq_printf( m, "%-20s %llu\n", stat_names[i], count[i] );
+    seq_printf( m, "%-20s %llu\n", "late_max_ns", late_max );
+    seq_printf( m, "%-20s %u\n", "queue_high_water", hwm );
+    for( i=0; i<stats_leds; i++ )
+        seq_printf( m, "toggles_%-12zu %llu\n", i, toggles[i] );
+
+    mutex_lock( &stats_pool_lock );
+    for( i=0; i<stats_leds; i++ ){
+        if( !stats_pools[i] )
+            continue;
+        seq_printf( m, "pool_avail_%-9zu %zu\n", i, gen_pool_avail( stats_pools[i] ) );
+        seq_printf( m, "pool_size_%-10zu %zu\n", i, gen_pool_size( stats_pools[i] ) );
+    }
+    mutex_unlock( &stats_pool_lock );
+    return 0;
+}
+
+static int stats_open( struct inode *inode, struct file *file ){
+    return single_open( file, stats_show, NULL );
+}
+
+static const struct file_operations stats_fops = {
+    .owner      = THIS_MODULE,
+    .open       = stats_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+/**
+ * Setup Stats
+ *
+ * @brief   Creates /sys/kernel/debug/sled/stats. The
+ *          driver works the same without debugfs, so a
+ *          failure here is not fatal.
+ *
+ * @param   leds    The number of leds to report.
+ *
+ **/
+static void setup_stats( size_t leds ){
+    stats_leds = min_t( size_t, leds, SLED_CONTROL_CHANNELS );
+    stats_dir = debugfs_create_dir( "sled", NULL );
+    if( IS_ERR_OR_NULL( stats_dir ) ){
+        kern_info( "debugfs unavailable, no statistics" );
+        stats_dir = NULL;
+        return;
+    }
+    debugfs_create_file( "stats", 0444, stats_dir, NULL, &stats_fops );
+}
+
+/**
+ * Remove Stats
+ *
+ * @brief   Removes the debugfs directory.
+ *
+ **/
+static void remove_stats( void ){
+    debugfs_remove_recursive( stats_dir );
+    stats_dir = NULL;
+}
+
+#endif
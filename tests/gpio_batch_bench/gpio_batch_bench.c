@@ -0,0 +1,161 @@
+/**
+ * @file        gpio_batch_bench.c
+ * @version     0.1
+ * @brief       A kernel module to compare setting a
+ *              group of gpio's one pin at a time with
+ *              setting them all with a single array call,
+ *              the way the led modules update their leds
+ *              every tick. Meant to be run against the
+ *              gpio-sim (or gpio-mockup) driver:
+ *
+ *              mkdir /sys/kernel/config/gpio-sim/bench
+ *              mkdir /sys/kernel/config/gpio-sim/bench/bank0
+ *              echo 8 > /sys/kernel/config/gpio-sim/bench/bank0/num_lines
+ *              echo 1 > /sys/kernel/config/gpio-sim/bench/live
+ *
+ *              then look up the base of the new chip in
+ *              /sys/kernel/debug/gpio and load the module
+ *              with base=<base> count=8. The results are
+ *              printed to the kernel log.
+ **/
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+
+#define MAX_LINES   32
+
+static int base = -1;
+module_param(base, int, 0444);
+MODULE_PARM_DESC(base, "First gpio number of the chip to test on");
+
+static unsigned int count = 4;
+module_param(count, uint, 0444);
+MODULE_PARM_DESC(count, "Number of gpio's to set per tick");
+
+static unsigned int ticks = 100000;
+module_param(ticks, uint, 0444);
+MODULE_PARM_DESC(ticks, "Number of ticks to time");
+
+static struct gpio_desc *descs[ MAX_LINES ];
+
+/**
+ * Functions to print messages to the kernel buffer
+ *
+ */
+static void kern_info(const char *format, ...){
+    char msg[256];
+    va_list args;
+    va_start(args, format);
+        vsnprintf(msg, 100, format, args);
+    va_end(args);
+    printk(KERN_INFO "[GPIOBENCH]: %s\n", msg);
+}
+static void kern_alert(const char *format, ...){
+    char msg[256];
+    va_list args;
+    va_start(args, format);
+        vsnprintf(msg, 100, format, args);
+    va_end(args);
+    printk(KERN_ALERT "[GPIOBENCH]: %s\n", msg);
+}
+
+/**
+ * Set the gpio's one pin at a time
+ *
+ */
+static void set_per_pin(unsigned long mask){
+    size_t i;
+
+    for(i=0; i<count; i++)
+        gpiod_set_value(descs[i], (mask >> i) & 1);
+}
+
+/**
+ * Set the gpio's with one array call
+ *
+ */
+static void set_batched(unsigned long mask){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+    gpiod_set_array_value(count, descs, NULL, &mask);
+#else
+    int values[ MAX_LINES ];
+    size_t i;
+
+    for(i=0; i<count; i++)
+        values[i] = (mask >> i) & 1;
+    gpiod_set_array_value(count, descs, values);
+#endif
+}
+
+/**
+ * Time a way of setting the gpio's and
+ * return the average cost of a tick in ns.
+ * Every tick lights a different pin, like
+ * led_controller does.
+ *
+ */
+static u64 bench(void (*set)(unsigned long)){
+    unsigned int i;
+    u64 start, elapsed;
+
+    start = ktime_get_ns();
+    for(i=0; i<ticks; i++){
+        set(1UL << (i % count));
+    }
+    elapsed = ktime_get_ns() - start;
+
+    return div_u64(elapsed, ticks);
+}
+
+/**
+ * Module initialization
+ *
+ */
+static int __init gpio_batch_bench_init(void){
+    int ret;
+    size_t i;
+
+    if( base < 0 || count == 0 || count > MAX_LINES || ticks == 0 ){
+        kern_alert("Set base, and count between 1 and %d", MAX_LINES);
+        return -EINVAL;
+    }
+
+    for( i=0; i<count; i++ ){
+        ret = gpio_request_one(base + i, GPIOF_OUT_INIT_LOW, "gpio_batch_bench");
+        if( ret ){
+            kern_alert("Unable to request gpio %d", base + i);
+            while( i-- )
+                gpio_free(base + i);
+            return ret;
+        }
+        descs[i] = gpio_to_desc(base + i);
+    }
+
+    kern_info("%u gpio's, %u ticks (ns per tick)", count, ticks);
+    kern_info("per pin : %llu", bench(set_per_pin));
+    kern_info("batched : %llu", bench(set_batched));
+
+    for( i=0; i<count; i++ ){
+        gpio_free(base + i);
+    }
+    return 0;
+}
+
+/**
+ * Module termination
+ *
+ */
+static void __exit gpio_batch_bench_exit(void){
+    return;
+}
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Module to compare per pin and batched gpio updates");
+
+module_init( gpio_batch_bench_init );
+module_exit( gpio_batch_bench_exit );
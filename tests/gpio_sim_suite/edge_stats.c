@@ -0,0 +1,197 @@
+/**
+ * @file        edge_stats.c
+ * @version     0.1
+ * @brief       Reads an ftrace log of the gpio:gpio_value
+ *              event and reports, for every line, the writes,
+ *              the edges, the edge rate and the time between
+ *              edges. With -p the error of every interval is
+ *              measured against the nearest whole number of
+ *              periods, which is how far a blink was off the
+ *              time it was asked for.
+ *
+ *  usage : edge_stats [-b base] [-p period_us] < trace
+ *
+ *              -b  the number of line 0 of the chip, to
+ *                  print lines instead of global numbers
+ *              -p  the nominal step of the workload
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#define MAX_GPIOS       1024
+#define MAX_INTERVALS   ( 1 << 20 )
+
+struct line {
+    int         seen;
+    int         value;
+    uint64_t    writes;
+    uint64_t    edges;
+    int64_t     first_ns;
+    int64_t     last_ns;
+    int64_t     *intervals;
+    size_t      count;
+};
+
+static struct line lines[ MAX_GPIOS ];
+
+/**
+ * Parse the timestamp and the gpio_value fields of a line:
+ *
+ *   sh-412  [000] d..1  35.012345: gpio_value: 504 set 1
+ */
+static int parse_event( const char *text, int64_t *ns, unsigned *gpio, int *value ){
+    const char *event = strstr( text, " gpio_value: " );
+    const char *ts;
+    char dir[ 8 ];
+    double sec;
+
+    if( !event || event == text || event[-1] != ':' )
+        return 0;
+    for( ts=event-1; ts>text && ts[-1] != ' '; ts-- )
+        ;
+    if( sscanf( ts, "%lf:", &sec ) != 1 )
+        return 0;
+    if( sscanf( event, " gpio_value: %u %7s %d", gpio, dir, value ) != 3 ||
+        strcmp( dir, "set" ) )
+        return 0;
+
+    *ns = llround( sec * 1e9 );
+    return 1;
+}
+
+static int cmp_i64( const void *a, const void *b ){
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return ( x > y ) - ( x < y );
+}
+
+static int64_t percentile( const int64_t *sorted, size_t n, double p ){
+    size_t i = (size_t)( p * ( n - 1 ) + 0.5 );
+    return sorted[ i < n ? i : n - 1 ];
+}
+
+/**
+ * The distance of an interval from the nearest
+ * whole, non zero number of periods.
+ */
+static int64_t period_error( int64_t interval, int64_t period ){
+    int64_t k = ( interval + period / 2 ) / period;
+
+    if( k < 1 )
+        k = 1;
+    return llabs( interval - k * period );
+}
+
+static void report( struct line *l, unsigned gpio, int base, int64_t period ){
+    int64_t *iv = l->intervals;
+    double span = ( l->last_ns - l->first_ns ) / 1e9;
+    double sum = 0;
+    int64_t *err;
+    double err_sum = 0;
+    size_t i;
+
+    printf( "line %4d  gpio %4u  writes %8llu  edges %8llu",
+            (int) gpio - base, gpio, (unsigned long long) l->writes,
+            (unsigned long long) l->edges );
+    if( span > 0 )
+        printf( "  %10.1f edges/s", ( l->edges - 1 ) / span );
+    printf( "\n" );
+    if( !l->count )
+        return;
+
+    for( i=0; i<l->count; i++ )
+        sum += iv[i];
+    qsort( iv, l->count, sizeof( *iv ), cmp_i64 );
+    printf( "    interval us  min %10.1f  p50 %10.1f  mean %10.1f  p99 %10.1f  max %10.1f\n",
+            iv[0] / 1e3, percentile( iv, l->count, 0.5 ) / 1e3,
+            sum / l->count / 1e3, percentile( iv, l->count, 0.99 ) / 1e3,
+            iv[ l->count - 1 ] / 1e3 );
+
+    if( period <= 0 )
+        return;
+    err = malloc( l->count * sizeof( *err ) );
+    if( !err )
+        return;
+    for( i=0; i<l->count; i++ ){
+        err[i] = period_error( iv[i], period );
+        err_sum += err[i];
+    }
+    qsort( err, l->count, sizeof( *err ), cmp_i64 );
+    printf( "    error us     p50 %10.1f  mean %10.1f  p99 %10.1f  max %10.1f  (period %.1f us)\n",
+            percentile( err, l->count, 0.5 ) / 1e3, err_sum / l->count / 1e3,
+            percentile( err, l->count, 0.99 ) / 1e3, err[ l->count - 1 ] / 1e3,
+            period / 1e3 );
+    free( err );
+}
+
+int main( int argc, char **argv ){
+    char text[ 512 ];
+    int64_t period = 0;
+    int64_t ns, first = -1, last = 0;
+    uint64_t edges = 0;
+    unsigned gpio;
+    int value, base = 0;
+    int opt;
+    struct line *l;
+
+    while( ( opt = getopt( argc, argv, "b:p:" ) ) != -1 ){
+        switch( opt ){
+            case 'b':
+                base = atoi( optarg );
+                break;
+            case 'p':
+                period = llround( atof( optarg ) * 1e3 );
+                break;
+            default:
+                fprintf( stderr, "usage : %s [-b base] [-p period_us] < trace\n", argv[0] );
+                return 2;
+        }
+    }
+
+    while( fgets( text, sizeof( text ), stdin ) ){
+        if( !parse_event( text, &ns, &gpio, &value ) || gpio >= MAX_GPIOS )
+            continue;
+        l = &lines[ gpio ];
+        l->writes++;
+        value = !!value;
+
+        //The first write of a line only sets its level
+        if( !l->seen ){
+            l->seen = 1;
+            l->value = value;
+            continue;
+        }
+        if( l->value == value )
+            continue;
+        l->value = value;
+
+        if( !l->edges++ ){
+            l->first_ns = ns;
+        }else if( l->count < MAX_INTERVALS ){
+            if( !l->intervals )
+                l->intervals = malloc( MAX_INTERVALS * sizeof( *l->intervals ) );
+            if( l->intervals )
+                l->intervals[ l->count++ ] = ns - l->last_ns;
+        }
+        l->last_ns = ns;
+
+        if( first < 0 )
+            first = ns;
+        last = ns;
+        edges++;
+    }
+
+    for( gpio=0; gpio<MAX_GPIOS; gpio++ ){
+        if( lines[ gpio ].seen )
+            report( &lines[ gpio ], gpio, base, period );
+    }
+    printf( "total edges %llu", (unsigned long long) edges );
+    if( last > first && first >= 0 )
+        printf( " in %.3f s, %.1f edges/s", ( last - first ) / 1e9,
+                ( edges - 1 ) / ( ( last - first ) / 1e9 ) );
+    printf( "\n" );
+    return 0;
+}
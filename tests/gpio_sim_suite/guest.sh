@@ -0,0 +1,135 @@
+#!/bin/bash
+#
+# Runs inside the test kernel, see run.sh. Creates a
+# simulated gpio chip, loads every led module on it and
+# records each line write with the gpio:gpio_value trace
+# event, then prints the timing of the edges.
+#
+# The lines are owned by the modules, so they can not also
+# be requested through /dev/gpiochipN to wait for edge events
+# on them. The trace event sits in gpiolib itself and sees
+# every write with its timestamp, batched writes included.
+#
+#  usage : guest.sh <results dir>
+#
+#  GPIO_BACKEND=mockup  gpio-mockup, 4.9 and later (default)
+#  GPIO_BACKEND=sim     gpio-sim, 5.17 and later
+#
+set -e
+
+OUT=${1:-/tmp/gpio_sim_suite}
+BACKEND=${GPIO_BACKEND:-mockup}
+HERE=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(cd "$HERE/../.." && pwd)
+TRACE=/sys/kernel/debug/tracing
+STATS=$HERE/edge_stats
+
+mkdir -p "$OUT"
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+[ -e $TRACE/trace ] || mount -t tracefs none $TRACE
+
+setup_chip(){
+    case $BACKEND in
+        mockup)
+            modprobe gpio-mockup gpio_mockup_ranges=-1,8
+            CHIP=gpio-mockup-A
+            ;;
+        sim)
+            modprobe gpio-sim
+            mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+            local dev=/sys/kernel/config/gpio-sim/sled
+            mkdir -p $dev/bank0
+            echo 8 > $dev/bank0/num_lines
+            echo sled-sim > $dev/bank0/label
+            echo 1 > $dev/live
+            CHIP=sled-sim
+            ;;
+        *)
+            echo "unknown GPIO_BACKEND $BACKEND" >&2
+            exit 1
+            ;;
+    esac
+    BASE=$(sed -n "s/.*GPIOs \([0-9]*\)-.*$CHIP.*/\1/p" /sys/kernel/debug/gpio | head -1)
+    HZ=$(zcat /proc/config.gz 2>/dev/null | sed -n 's/^CONFIG_HZ=//p')
+    echo "chip $CHIP, line 0 is gpio $BASE, HZ ${HZ:-unknown}"
+}
+
+# A number of jiffies in microseconds, empty when HZ is unknown
+jiffies_us(){
+    [ -n "$HZ" ] && echo $(( $1 * 1000000 / HZ ))
+}
+
+trace_start(){
+    echo 0 > $TRACE/tracing_on
+    echo 16384 > $TRACE/buffer_size_kb
+    echo > $TRACE/trace
+    echo 1 > $TRACE/events/gpio/gpio_value/enable
+    echo 1 > $TRACE/tracing_on
+}
+
+# trace_stop <name> [period us]
+trace_stop(){
+    echo 0 > $TRACE/tracing_on
+    echo 0 > $TRACE/events/gpio/gpio_value/enable
+    cat $TRACE/trace > "$OUT/$1.trace"
+    echo "== $1"
+    "$STATS" -b "$BASE" ${2:+-p $2} < "$OUT/$1.trace" | tee "$OUT/$1.txt"
+}
+
+# A sled_batch of one command per channel, see sled_abi.h
+# sled_batch <repeat> <on_us> <off_us> <channel>...
+le16(){ printf '\\x%02x\\x%02x' $(( $1 & 255 )) $(( $1 >> 8 & 255 )); }
+le32(){ le16 $(( $1 & 65535 )); le16 $(( $1 >> 16 & 65535 )); }
+sled_batch(){
+    local repeat=$1 on=$2 off=$3 ch
+    shift 3
+    le32 0x44454c53
+    le32 $#
+    for ch; do
+        printf '\\x%02x\\xff' $ch
+        le16 $repeat
+        le32 $on
+        le32 $off
+        le16 0
+        printf '\\x00\\x00'
+    done
+}
+
+setup_chip
+
+# led_gpio switches its leds on at load and off at unload
+trace_start
+insmod "$ROOT/led_gpio/led_gpio.ko" chip=$CHIP gpios=0,1,2,3
+sleep 1
+rmmod led_gpio
+trace_stop led_gpio
+
+# led_controller walks one lit led along the lines every 50 jiffies
+trace_start
+insmod "$ROOT/led_controller/led_controller.ko" chip=$CHIP gpios=0,1,2,3
+sleep 10
+rmmod led_controller
+trace_stop led_controller $(jiffies_us 50)
+
+# status_led_driver, text commands of 9 short blinks (10 jiffies)
+# on the three channels with either timer backend
+for backend in jiffy hrtimer; do
+    trace_start
+    insmod "$ROOT/status_led_driver/sled.ko" chip=$CHIP gpios=0,1,2 timer_backend=$backend
+    for color in 3 4 5; do
+        echo "$color 6 9" > /dev/sled
+    done
+    sleep 3
+    rmmod sled
+    trace_stop sled_$backend $(jiffies_us 10)
+done
+
+# status_led_driver throughput, 200us steps on every channel
+trace_start
+insmod "$ROOT/status_led_driver/sled.ko" chip=$CHIP gpios=0,1,2 timer_backend=hrtimer
+printf "$(sled_batch 2000 200 200 0 1 2)" > /dev/sled
+sleep 2
+rmmod sled
+trace_stop sled_throughput 200
+
+echo "traces and reports in $OUT"
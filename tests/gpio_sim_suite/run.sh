@@ -0,0 +1,42 @@
+#!/bin/bash
+#
+# Integration and timing suite of the led modules, without
+# a Pi. Builds led_gpio, led_controller and status_led_driver
+# against a kernel tree, boots that kernel with virtme and
+# runs guest.sh in it, which drives the modules on a gpio-mockup
+# or gpio-sim chip and reports the timing of every edge.
+#
+# The kernel needs, next to the options of the modules:
+#
+#   CONFIG_GPIO_MOCKUP=m (or CONFIG_GPIO_SIM=m and CONFIG_CONFIGFS_FS)
+#   CONFIG_DEBUG_FS=y CONFIG_FTRACE=y CONFIG_EVENT_TRACING=y
+#   CONFIG_IKCONFIG_PROC=y, for the nominal timings
+#
+# The modules use the timer api of the 4.x kernels, so for
+# now gpio-mockup on a 4.9 to 4.14 kernel is the combination
+# which builds; gpio-sim needs 5.17.
+#
+#  usage : KDIR=<kernel tree> ./run.sh [results dir]
+#
+#  GPIO_BACKEND=sim selects gpio-sim, VIRTME overrides
+#  the virtme-run command.
+#
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(cd "$HERE/../.." && pwd)
+OUT=$(mkdir -p "${1:-/tmp/gpio_sim_suite}" && cd "${1:-/tmp/gpio_sim_suite}" && pwd)
+VIRTME=${VIRTME:-virtme-run}
+
+if [ -z "$KDIR" ]; then
+    echo "usage : KDIR=<kernel tree> $0 [results dir]" >&2
+    exit 2
+fi
+
+for module in led_gpio led_controller status_led_driver; do
+    ( cd "$ROOT/$module" && make KDIR="$KDIR" )
+done
+make -C "$HERE"
+
+$VIRTME --kdir "$KDIR" --mods=auto --rwdir "$OUT" \
+    --script-sh "GPIO_BACKEND=${GPIO_BACKEND:-mockup} $HERE/guest.sh $OUT"
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# @file     kbuff_dd_bench.sh
+# @brief    Streams data through /dev/kbuffer with dd at
+#           several block sizes and prints the rate seen
+#           by the reader. Load kernel_buffer.ko first,
+#           optionally with buffer_size=<bytes>.
+#
+# usage : kbuff_dd_bench.sh [MiB per run] [block sizes...]
+
+DEVICE=/dev/kbuffer
+MIB=${1:-256}
+[ $# -gt 0 ] && shift
+SIZES=${*:-"512 4096 65536 1048576"}
+
+if [ ! -c "$DEVICE" ]; then
+    echo "$DEVICE does not exist, is kernel_buffer loaded?" >&2
+    exit 1
+fi
+
+printf "\t%s MiB per block size\n" "$MIB"
+for bs in $SIZES; do
+    count=$(( MIB * 1048576 / bs ))
+
+    # Every open file has a FIFO of its own, both dd's
+    # share a single open of the device
+    exec 3<> "$DEVICE"
+    dd of=/dev/null bs="$bs" count="$count" iflag=fullblock <&3 \
+        2> /tmp/kbuff_dd_read.$$ &
+    reader=$!
+    dd if=/dev/zero bs="$bs" count="$count" >&3 2> /dev/null
+    wait $reader
+    exec 3<&-
+
+    printf "\tbs=%-8s %s\n" "$bs" "$(tail -n 1 /tmp/kbuff_dd_read.$$)"
+done
+rm -f /tmp/kbuff_dd_read.$$
@@ -0,0 +1,292 @@
+/**
+ * @file        kbuff_stress.c
+ * @version     0.1
+ * @brief       Hammers kernel_buffer with many clients at
+ *              once and checks nothing leaks between them.
+ *
+ *              private   : pairs of threads share an open of
+ *                          /dev/kbuffer, one writes numbered
+ *                          records and the other checks it
+ *                          gets exactly those, in order.
+ *              broadcast : writers send numbered records to
+ *                          /dev/kbuffer_broadcast and every
+ *                          reader checks each record it gets
+ *                          is whole and newer than the last one
+ *                          from the same writer. Records a
+ *                          reader had no room for are dropped
+ *                          and only counted.
+ *
+ *  usage : kbuff_stress [pairs] [records] [broadcast readers] [broadcast writers]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define PRIVATE_FILE    "/dev/kbuffer"
+#define BROADCAST_FILE  "/dev/kbuffer_broadcast"
+#define MAX_WRITERS     256
+
+/**
+ * A record, 64 bytes so it never straddles a
+ * wrap of the FIFO in an odd way.
+ **/
+struct record {
+    uint32_t    id;
+    uint32_t    seq;
+    uint32_t    sum;
+    uint8_t     payload[52];
+};
+
+struct client {
+    pthread_t   thread;
+    int         fd;
+    int         id;
+    long        received;
+    long        errors;
+};
+
+static long records;
+static volatile int writers_done;
+
+static void fill( struct record *rec, uint32_t id, uint32_t seq ){
+    size_t i;
+
+    rec->id = id;
+    rec->seq = seq;
+    rec->sum = 0;
+    for( i=0; i<sizeof( rec->payload ); i++ ){
+        rec->payload[i] = id * 31 + seq + i;
+        rec->sum += rec->payload[i];
+    }
+}
+
+static int intact( const struct record *rec ){
+    uint32_t sum = 0;
+    size_t i;
+
+    for( i=0; i<sizeof( rec->payload ); i++ )
+        sum += rec->payload[i];
+    return sum == rec->sum;
+}
+
+/**
+ * Write and read whole records, the device may
+ * take or give less than asked for.
+ **/
+static int write_all( int fd, const void *buff, size_t len ){
+    const char *p = buff;
+    ssize_t ret;
+
+    while( len ){
+        ret = write( fd, p, len );
+        if( ret < 0 )
+            return -1;
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int read_all( int fd, void *buff, size_t len ){
+    char *p = buff;
+    ssize_t ret;
+
+    while( len ){
+        ret = read( fd, p, len );
+        if( ret <= 0 )
+            return -1;
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/**
+ * Private mode
+ **/
+static void *private_writer( void *arg ){
+    struct client *c = arg;
+    struct record rec;
+    long i;
+
+    for( i=0; i<records; i++ ){
+        fill( &rec, c->id, i );
+        if( write_all( c->fd, &rec, sizeof( rec ) ) ){
+            perror( "write" );
+            c->errors++;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *private_reader( void *arg ){
+    struct client *c = arg;
+    struct record rec;
+    long i;
+
+    for( i=0; i<records; i++ ){
+        if( read_all( c->fd, &rec, sizeof( rec ) ) ){
+            perror( "read" );
+            c->errors++;
+            break;
+        }
+        if( rec.id != c->id || rec.seq != i || !intact( &rec ) )
+            c->errors++;
+        c->received++;
+    }
+    return NULL;
+}
+
+static long run_private( int pairs ){
+    struct client *w = calloc( pairs, sizeof( *w ) );
+    struct client *r = calloc( pairs, sizeof( *r ) );
+    long errors = 0;
+    int i;
+
+    for( i=0; i<pairs; i++ ){
+        w[i].fd = r[i].fd = open( PRIVATE_FILE, O_RDWR );
+        if( w[i].fd < 0 ){
+            perror( "Failed to open " PRIVATE_FILE );
+            exit( EXIT_FAILURE );
+        }
+        w[i].id = r[i].id = i;
+        pthread_create( &r[i].thread, NULL, private_reader, &r[i] );
+        pthread_create( &w[i].thread, NULL, private_writer, &w[i] );
+    }
+    for( i=0; i<pairs; i++ ){
+        pthread_join( w[i].thread, NULL );
+        pthread_join( r[i].thread, NULL );
+        close( w[i].fd );
+        errors += w[i].errors + r[i].errors;
+    }
+
+    printf( "\tprivate   : %d pairs, %ld records each, %ld errors\n",
+            pairs, records, errors );
+    free( w );
+    free( r );
+    return errors;
+}
+
+/**
+ * Broadcast mode
+ **/
+static void *broadcast_writer( void *arg ){
+    struct client *c = arg;
+    struct record rec;
+    long i;
+
+    for( i=0; i<records; i++ ){
+        fill( &rec, c->id, i );
+        if( write( c->fd, &rec, sizeof( rec ) ) != sizeof( rec ) ){
+            perror( "broadcast write" );
+            c->errors++;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *broadcast_reader( void *arg ){
+    struct client *c = arg;
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+    int64_t last[ MAX_WRITERS ];
+    struct record rec;
+    int i;
+
+    for( i=0; i<MAX_WRITERS; i++ )
+        last[i] = -1;
+
+    for( ;; ){
+        if( poll( &pfd, 1, 100 ) == 0 ){
+            if( writers_done )
+                break;
+            continue;
+        }
+        if( read_all( c->fd, &rec, sizeof( rec ) ) ){
+            perror( "broadcast read" );
+            c->errors++;
+            break;
+        }
+        if( rec.id >= MAX_WRITERS || !intact( &rec ) ||
+            (int64_t) rec.seq <= last[ rec.id ] ){
+            c->errors++;
+            continue;
+        }
+        last[ rec.id ] = rec.seq;
+        c->received++;
+    }
+    return NULL;
+}
+
+static long run_broadcast( int readers, int writers ){
+    struct client *w = calloc( writers, sizeof( *w ) );
+    struct client *r = calloc( readers, sizeof( *r ) );
+    long errors = 0, received = 0;
+    int i;
+
+    for( i=0; i<readers; i++ ){
+        r[i].fd = open( BROADCAST_FILE, O_RDONLY );
+        if( r[i].fd < 0 ){
+            perror( "Failed to open " BROADCAST_FILE );
+            exit( EXIT_FAILURE );
+        }
+        pthread_create( &r[i].thread, NULL, broadcast_reader, &r[i] );
+    }
+    for( i=0; i<writers; i++ ){
+        w[i].fd = open( BROADCAST_FILE, O_WRONLY );
+        if( w[i].fd < 0 ){
+            perror( "Failed to open " BROADCAST_FILE );
+            exit( EXIT_FAILURE );
+        }
+        w[i].id = i;
+        pthread_create( &w[i].thread, NULL, broadcast_writer, &w[i] );
+    }
+
+    for( i=0; i<writers; i++ ){
+        pthread_join( w[i].thread, NULL );
+        close( w[i].fd );
+        errors += w[i].errors;
+    }
+    writers_done = 1;
+    for( i=0; i<readers; i++ ){
+        pthread_join( r[i].thread, NULL );
+        close( r[i].fd );
+        errors += r[i].errors;
+        received += r[i].received;
+    }
+
+    printf( "\tbroadcast : %d readers, %d writers, %ld of %ld records delivered, %ld errors\n",
+            readers, writers, received, (long) readers * writers * records, errors );
+    free( w );
+    free( r );
+    return errors;
+}
+
+int main( int argc, char *argv[] ){
+    int pairs = argc > 1 ? atoi( argv[1] ) : 32;
+    int readers, writers;
+    long errors;
+
+    records = argc > 2 ? atol( argv[2] ) : 100000;
+    readers = argc > 3 ? atoi( argv[3] ) : 32;
+    writers = argc > 4 ? atoi( argv[4] ) : 8;
+    if( pairs <= 0 || records <= 0 || readers <= 0 ||
+        writers <= 0 || writers > MAX_WRITERS ){
+        fprintf( stderr, "usage : %s [pairs] [records] [readers] [writers<=%d]\n",
+                 argv[0], MAX_WRITERS );
+        return EXIT_FAILURE;
+    }
+
+    errors = run_private( pairs );
+    errors += run_broadcast( readers, writers );
+
+    printf( "\t%s\n", errors ? "FAILED" : "PASSED" );
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
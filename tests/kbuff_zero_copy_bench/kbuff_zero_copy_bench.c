@@ -0,0 +1,235 @@
+/**
+ * @file        kbuff_zero_copy_bench.c
+ * @version     0.1
+ * @brief       Moves the same amount of data through
+ *              /dev/kbuffer three ways and prints the
+ *              throughput of each:
+ *
+ *              copy   : write() in one thread, read() in another
+ *              splice : vmsplice into a pipe and splice it into
+ *                       the device, splice out of the device
+ *                       into a pipe drained to /dev/null
+ *              mmap   : the writer fills the mapped ring and
+ *                       publishes head, read() drains it
+ *
+ *  usage : kbuff_zero_copy_bench [MiB] [chunk bytes]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/types.h>
+#include "kbuff_abi.h"
+
+#define DEVICE_FILE     "/dev/kbuffer"
+
+static size_t total;
+static size_t chunk;
+static char *source;
+
+static double now_s( void ){
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die( const char *what ){
+    perror( what );
+    exit( EXIT_FAILURE );
+}
+
+/**
+ * Readers
+ **/
+static void *read_copy( void *arg ){
+    int fd = *(int *) arg;
+    char *buff = malloc( chunk );
+    size_t done = 0;
+    ssize_t ret;
+
+    while( done < total ){
+        ret = read( fd, buff, chunk );
+        if( ret < 0 )
+            die( "read" );
+        done += ret;
+    }
+    free( buff );
+    return NULL;
+}
+
+static void *read_splice( void *arg ){
+    int fd = *(int *) arg;
+    int pipefd[2], null;
+    size_t done = 0;
+    ssize_t ret, out;
+
+    null = open( "/dev/null", O_WRONLY );
+    if( null < 0 || pipe( pipefd ) )
+        die( "read_splice setup" );
+
+    while( done < total ){
+        ret = splice( fd, NULL, pipefd[1], NULL, chunk, SPLICE_F_MOVE );
+        if( ret < 0 )
+            die( "splice from device" );
+        for( out = ret; out > 0; ){
+            ret = splice( pipefd[0], NULL, null, NULL, out, SPLICE_F_MOVE );
+            if( ret < 0 )
+                die( "splice to /dev/null" );
+            out -= ret;
+            done += ret;
+        }
+    }
+    close( pipefd[0] );
+    close( pipefd[1] );
+    close( null );
+    return NULL;
+}
+
+/**
+ * Writers
+ **/
+static void write_copy( int fd ){
+    size_t done = 0;
+    ssize_t ret;
+
+    while( done < total ){
+        ret = write( fd, source, chunk );
+        if( ret < 0 )
+            die( "write" );
+        done += ret;
+    }
+}
+
+static void write_splice( int fd ){
+    struct iovec iov;
+    int pipefd[2];
+    size_t done = 0;
+    ssize_t ret, in;
+
+    if( pipe( pipefd ) )
+        die( "pipe" );
+
+    while( done < total ){
+        iov.iov_base = source;
+        iov.iov_len = chunk;
+        in = vmsplice( pipefd[1], &iov, 1, 0 );
+        if( in < 0 )
+            die( "vmsplice" );
+        while( in > 0 ){
+            ret = splice( pipefd[0], NULL, fd, NULL, in, SPLICE_F_MOVE );
+            if( ret < 0 )
+                die( "splice to device" );
+            in -= ret;
+            done += ret;
+        }
+    }
+    close( pipefd[0] );
+    close( pipefd[1] );
+}
+
+static void write_mmap( int fd ){
+    long page = sysconf( _SC_PAGESIZE );
+    struct kbuff_ring *ring;
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    size_t done = 0, len, off, first, size;
+    __u32 head, tail;
+    char *data;
+
+    ring = mmap( NULL, page, PROT_READ, MAP_SHARED, fd, 0 );
+    if( ring == MAP_FAILED )
+        die( "mmap header" );
+    size = ring->size;
+    munmap( ring, page );
+
+    ring = mmap( NULL, page + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if( ring == MAP_FAILED )
+        die( "mmap ring" );
+    data = (char *) ring + page;
+
+    while( done < total ){
+        head = ring->head;
+        tail = __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE );
+        len = size - ( head - tail );
+        if( len > chunk )
+            len = chunk;
+        if( len > total - done )
+            len = total - done;
+        if( len == 0 ){
+            if( poll( &pfd, 1, -1 ) < 0 )
+                die( "poll" );
+            continue;
+        }
+
+        off = head & ( size - 1 );
+        first = len < size - off ? len : size - off;
+        memcpy( data + off, source, first );
+        memcpy( data, source + first, len - first );
+        __atomic_store_n( &ring->head, head + len, __ATOMIC_RELEASE );
+        if( ioctl( fd, KBUFF_IOC_NOTIFY ) )
+            die( "ioctl" );
+        done += len;
+    }
+    munmap( ring, page + size );
+}
+
+/**
+ * Run one mode and print the throughput seen from
+ * start to the last byte. Every open file has a FIFO
+ * of its own, so both threads share one descriptor.
+ **/
+static void run( const char *name, void *(*reader)( void * ),
+                 void (*writer)( int ) ){
+    pthread_t thread;
+    int fd;
+    double start, elapsed;
+
+    fd = open( DEVICE_FILE, O_RDWR );
+    if( fd < 0 )
+        die( "Failed to open " DEVICE_FILE );
+
+    start = now_s();
+    if( pthread_create( &thread, NULL, reader, &fd ) )
+        die( "pthread_create" );
+    writer( fd );
+    pthread_join( thread, NULL );
+    elapsed = now_s() - start;
+
+    printf( "\t%-8s %8.1f MB/s\n", name, total / elapsed / 1e6 );
+    close( fd );
+}
+
+int main( int argc, char *argv[] ){
+    size_t page;
+
+    total = ( argc > 1 ? strtoul( argv[1], NULL, 0 ) : 256 ) << 20;
+    chunk = argc > 2 ? strtoul( argv[2], NULL, 0 ) : 65536;
+
+    if( total == 0 || chunk == 0 || total % chunk ){
+        fprintf( stderr, "The total has to be a multiple of the chunk\n" );
+        return EXIT_FAILURE;
+    }
+
+    page = sysconf( _SC_PAGESIZE );
+    source = aligned_alloc( page, ( chunk + page - 1 ) / page * page );
+    if( !source )
+        die( "aligned_alloc" );
+    memset( source, 'k', chunk );
+
+    printf( "\t%zu MiB in chunks of %zu bytes\n", total >> 20, chunk );
+    run( "copy", read_copy, write_copy );
+    run( "splice", read_splice, write_splice );
+    run( "mmap", read_copy, write_mmap );
+
+    free( source );
+    return 0;
+}
@@ -0,0 +1,310 @@
+/**
+ * @file        sled_bench.c
+ * @version     0.1
+ * @brief       A kernel module to measure the per tick
+ *              cost of the sled blink scheduler. The old
+ *              list walk is compared against the step
+ *              array from status_led_driver/interrupt.h
+ *              for sequences of 10, 1k and 100k steps.
+ *              The results are printed to the kernel log
+ *              when the module is loaded.
+ *
+ *              With timing=1 the startup of a command is
+ *              timed with the pins held by the module and
+ *              with the old request per command, and a real
+ *              sequence is played on the red led with both
+ *              timer backends, the channel prints how late
+ *              its ticks fired. That is a per command
+ *              message, so the bench is built with SLED_DEBUG
+ *              and raises the verbosity while it plays. Load
+ *              the machine while it runs to see the effect.
+ **/
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include "../../status_led_driver/interrupt.h"
+
+#define CREATE_TRACE_POINTS
+#include "sled_trace.h"
+
+/**
+ * The number of ticks sampled from the list walk.
+ * Walking every tick of a 100k step list is quadratic
+ * so only this many ticks, spread evenly over the
+ * sequence, are timed.
+ **/
+#define LIST_SAMPLES    1000
+
+/**
+ * Structure matching the old task list node
+ **/
+struct legacy_state {
+    int     id;
+    short   color;
+    short   delay;
+    bool    state;
+
+    struct list_head head;
+};
+
+static struct legacy_state legacy_list;
+static volatile unsigned long sink;
+
+static const unsigned int bench_sizes[] = { 10, 1000, 100000 };
+
+static bool timing;
+module_param( timing, bool, 0444 );
+MODULE_PARM_DESC( timing, "Time command startup and play a sequence on the red led with both timer backends" );
+
+/**
+ * Legacy list lookup, as done by trigger_led()
+ * and get_delay() before the step array.
+ **/
+static struct legacy_state * legacy_lookup( unsigned long value ){
+    struct legacy_state *state;
+
+    list_for_each_entry( state, &(legacy_list.head), head ){
+        if( value==state->id )
+            return state;
+    }
+    return NULL;
+}
+
+static void legacy_destroy( void ){
+    struct legacy_state *state_iter;
+    struct legacy_state *state_iter_tmp;
+
+    list_for_each_entry_safe( state_iter, state_iter_tmp, &(legacy_list.head), head ){
+        list_del( &(state_iter->head) );
+        kfree( state_iter );
+    }
+}
+
+/**
+ * Time the list walk for a sequence of steps
+ * and return the average cost of a tick in ns.
+ **/
+static u64 bench_list( unsigned int steps ){
+    struct legacy_state *new_state;
+    unsigned int stride;
+    unsigned int ticks = 0;
+    unsigned long i;
+    u64 start, elapsed;
+
+    INIT_LIST_HEAD( &legacy_list.head );
+    for( i=0; i<steps; i++ ){
+        new_state = kmalloc( sizeof( *new_state ), GFP_KERNEL );
+        if( !new_state ){
+            legacy_destroy();
+            return 0;
+        }
+        new_state->id       = i;
+        new_state->color    = RED;
+        new_state->delay    = SHORT_DELAY;
+        new_state->state    = i & 1;
+        list_add_tail( &(new_state->head), &(legacy_list.head) );
+    }
+
+    stride = steps > LIST_SAMPLES ? steps / LIST_SAMPLES : 1;
+
+    start = ktime_get_ns();
+    for( i=0; i<steps; i+=stride ){
+        //trigger_led() and get_delay() both walked the list
+        new_state = legacy_lookup( i );
+        sink += new_state->state;
+        new_state = legacy_lookup( i+1 );
+        sink += new_state ? new_state->delay : DELAY_TIME;
+        ticks++;
+        cond_resched();
+    }
+    elapsed = ktime_get_ns() - start;
+
+    legacy_destroy();
+    return div_u64( elapsed, ticks );
+}
+
+/**
+ * Time the step array for a sequence of steps
+ * and return the average cost of a tick in ns.
+ * A command only takes three steps whatever its
+ * repeat count, so the sequence is built from
+ * steps / 2 single blinks laid out one after
+ * the other.
+ **/
+static u64 bench_array( unsigned int steps ){
+    struct sled_cmd cmd = {
+        .channel    = SLED_RED,
+        .brightness = 255,
+        .repeat     = 1,
+        .on_us      = 10000,
+        .off_us     = 10000
+    };
+    struct led_sequence *seq;
+    struct led_step *step;
+    unsigned long i;
+    u64 start, elapsed;
+
+    seq = alloc_sequence( SLED_RED, steps );
+    if( !seq )
+        return 0;
+    for( i=0; i<steps; i+=2 )
+        fill_steps( &seq->steps[i], &cmd, i );
+
+    start = ktime_get_ns();
+    for( i=0; i<seq->len; i++ ){
+        step = get_step( seq, i );
+        sink += step->level;
+        sink += get_delay( seq, i );
+    }
+    elapsed = ktime_get_ns() - start;
+
+    destroy_task_list( seq );
+    return div_u64( elapsed, steps );
+}
+
+/**
+ * Play 500 blinks of 1ms on the red led with
+ * the given backend and wait for them to end.
+ **/
+static void bench_timing( bool hrtimer ){
+    struct sled_cmd cmd = {
+        .channel    = SLED_RED,
+        .brightness = 255,
+        .repeat     = 500,
+        .on_us      = 1000,
+        .off_us     = 1000
+    };
+
+    int saved = verbosity;
+
+    use_hrtimer = hrtimer;
+    kern_info( "Timing the %s backend", hrtimer ? "hrtimer" : "jiffy" );
+    verbosity = SLED_LOG_DEBUG;
+    if( start_timer_interrupt( &cmd, 0 ) ){
+        while( !channel_idle( &channels[ SLED_RED ] ) ){
+            msleep( 10 );
+        }
+    }
+    verbosity = saved;
+}
+
+/**
+ * Start 100 single blinks on an idle red channel and
+ * return the mean time start_timer_interrupt() takes,
+ * the startup cost of a command before its first tick.
+ *
+ * With per_command the pins are given back while the
+ * channel is idle and every command requests them with
+ * gpio_request_array() and frees them with
+ * gpio_free_array() once it is over, the way the driver
+ * did before it held them for the life of the module.
+ * Both calls are timed along with the start.
+ **/
+#define START_SAMPLES   100
+
+static u64 bench_start( bool per_command ){
+    struct sled_cmd cmd = {
+        .channel    = SLED_RED,
+        .brightness = 255,
+        .repeat     = 1,
+        .on_us      = 100,
+        .off_us     = 100
+    };
+    u64 start, elapsed = 0;
+    int i, ret = 0;
+
+    if( per_command )
+        gpio_free_array( leds, led_count );
+
+    for( i=0; i<START_SAMPLES; i++ ){
+        start = ktime_get_ns();
+        if( per_command ){
+            ret = gpio_request_array( leds, led_count );
+            if( ret )
+                break;
+        }
+        if( !start_timer_interrupt( &cmd, 0 ) ){
+            if( per_command )
+                gpio_free_array( leds, led_count );
+            ret = -ENOMEM;
+            break;
+        }
+        elapsed += ktime_get_ns() - start;
+
+        while( !channel_idle( &channels[ SLED_RED ] ) ){
+            msleep( 1 );
+        }
+
+        if( per_command ){
+            start = ktime_get_ns();
+            gpio_free_array( leds, led_count );
+            elapsed += ktime_get_ns() - start;
+        }
+    }
+
+    //Hand the pins back to the module as it found them
+    if( per_command && gpio_request_array( leds, led_count ) )
+        kern_alert( "Failed to request the leds again" );
+    return ret ? 0 : div_u64( elapsed, START_SAMPLES );
+}
+
+/**
+ * Module initialization
+ *
+ */
+static int __init sled_bench_init(void){
+    size_t i;
+    unsigned int steps;
+    int ret;
+
+    //The pools have to hold the largest sequence and its header
+    pool_steps = bench_sizes[ ARRAY_SIZE( bench_sizes ) - 1 ] + 64;
+    ret = setup_leds();
+    if( ret )
+        return ret;
+    ret = initiate_leds();
+    if( ret )
+        return ret;
+    ret = setup_timer_interrupt();
+    if( ret ){
+        release_leds();
+        return ret;
+    }
+
+    kern_info( "Scheduler benchmark (ns per tick)" );
+    for( i=0; i<ARRAY_SIZE( bench_sizes ); i++ ){
+        steps = bench_sizes[i];
+        kern_info( "%6u steps : list %8llu | array %4llu",
+                   steps, bench_list( steps ), bench_array( steps ) );
+    }
+
+    if( timing ){
+        kern_info( "Command startup : %llu ns held, %llu ns requested per command",
+                   bench_start( false ), bench_start( true ) );
+        bench_timing( false );
+        bench_timing( true );
+    }
+
+    remove_timer();
+    release_leds();
+    return 0;
+}
+
+/**
+ * Module termination
+ *
+ */
+static void __exit sled_bench_exit(void){
+    return;
+}
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Module to benchmark the sled blink scheduler");
+
+module_init( sled_bench_init );
+module_exit( sled_bench_exit );
@@ -0,0 +1 @@
+#include "../sled_mock.h"
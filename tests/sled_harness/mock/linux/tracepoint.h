@@ -0,0 +1,14 @@
+/**
+ * The tracepoints of the driver compile to
+ * empty functions in the harness.
+ **/
+#ifndef _SLED_MOCK_TRACEPOINT_H_
+#define _SLED_MOCK_TRACEPOINT_H_
+
+#define TP_PROTO( ... )         __VA_ARGS__
+#define TP_ARGS( ... )          __VA_ARGS__
+
+#define TRACE_EVENT( name, proto, args, tstruct, assign, print ) \
+    static inline void trace_##name( proto ){ }
+
+#endif
@@ -0,0 +1,7 @@
+/**
+ * The harness plays the newest kernel the modules
+ * build on, so set_leds() takes the batched
+ * gpiod_set_array_value() path.
+ **/
+#define KERNEL_VERSION( a, b, c )   ( ( ( a ) << 16 ) + ( ( b ) << 8 ) + ( c ) )
+#define LINUX_VERSION_CODE          KERNEL_VERSION( 4, 14, 0 )
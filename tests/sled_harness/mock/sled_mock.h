@@ -0,0 +1,1044 @@
+/**
+ * @file    sled_mock.h
+ * @version 0.1
+ * @brief   Just enough of the kernel for the headers of
+ *          the driver to build as a user space program.
+ *          Time is virtual: timers go into an event list
+ *          and only fire when the harness runs the clock,
+ *          so a second of blinking costs a few microseconds.
+ *          The gpio's are an array of pins which remembers
+ *          every write and the time of every edge.
+ *
+ *          Everything runs on one thread. The locks do not
+ *          lock anything, they only catch a lock taken twice
+ *          or released without being held.
+ *
+ **/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <linux/types.h>
+
+#ifndef _SLED_MOCK_H_
+#define _SLED_MOCK_H_
+
+//Types
+//-----
+
+typedef uint8_t             u8;
+typedef uint16_t            u16;
+typedef uint32_t            u32;
+typedef unsigned long long  u64;
+typedef int8_t              s8;
+typedef int16_t             s16;
+typedef int32_t             s32;
+typedef long long           s64;
+typedef unsigned            gfp_t;
+
+#define __user
+#define __iomem
+
+//Helpers
+//-------
+
+#define BITS_PER_LONG       ( __SIZEOF_LONG__ * 8 )
+#define BIT( nr )           ( 1UL << ( nr ) )
+#define ARRAY_SIZE( a )     ( sizeof( a ) / sizeof( ( a )[0] ) )
+#define likely( x )         __builtin_expect( !!( x ), 1 )
+#define unlikely( x )       __builtin_expect( !!( x ), 0 )
+#define BUILD_BUG_ON( c )   _Static_assert( !( c ), #c )
+#define READ_ONCE( x )      ( *(const volatile __typeof__( x ) *) &( x ) )
+#define WRITE_ONCE( x, v )  ( *(volatile __typeof__( x ) *) &( x ) = ( v ) )
+#define barrier()           __asm__ __volatile__( "" ::: "memory" )
+#define smp_rmb()           barrier()
+#define smp_wmb()           barrier()
+#define smp_mb()            __sync_synchronize()
+
+#define container_of( ptr, type, member ) \
+    ( (type *)( (char *)( ptr ) - offsetof( type, member ) ) )
+
+static inline unsigned long __fls( unsigned long word ){
+    return BITS_PER_LONG - 1 - __builtin_clzl( word );
+}
+
+#define min( a, b )         ( ( a ) < ( b ) ? ( a ) : ( b ) )
+#define max( a, b )         ( ( a ) > ( b ) ? ( a ) : ( b ) )
+#define min_t( t, a, b )    min( (t)( a ), (t)( b ) )
+#define max_t( t, a, b )    max( (t)( a ), (t)( b ) )
+
+#define U16_MAX             ( (u16) ~0U )
+#define U32_MAX             ( (u32) ~0U )
+#define MAX_ERRNO           4095
+#define IS_ERR_VALUE( x )   ( (unsigned long)( x ) >= (unsigned long) -MAX_ERRNO )
+
+static inline void *ERR_PTR( long error ){ return (void *) error; }
+static inline long PTR_ERR( const void *ptr ){ return (long) ptr; }
+static inline bool IS_ERR( const void *ptr ){ return IS_ERR_VALUE( ptr ); }
+static inline bool IS_ERR_OR_NULL( const void *ptr ){
+    return !ptr || IS_ERR_VALUE( ptr );
+}
+
+static inline u64 div64_u64( u64 a, u64 b ){ return a / b; }
+static inline u64 div_u64( u64 a, u32 b ){ return a / b; }
+static inline s64 div_s64( s64 a, s32 b ){ return a / b; }
+
+_Static_assert( __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+                "the harness runs on little endian hosts" );
+
+static inline u64 le64_to_cpu( u64 x ){ return x; }
+static inline u64 get_unaligned_le64( const void *p ){
+    u64 x;
+
+    memcpy( &x, p, sizeof( x ) );
+    return x;
+}
+
+#define strlcpy( dst, src, size )   sim_strlcpy( dst, src, size )
+
+static inline size_t sim_strlcpy( char *dst, const char *src, size_t size ){
+    size_t len = strlen( src );
+
+    if( size ){
+        size_t n = len >= size ? size - 1 : len;
+        memcpy( dst, src, n );
+        dst[n] = '\0';
+    }
+    return len;
+}
+
+//Failures
+//--------
+
+/**
+ * Sim Bug
+ *
+ * @brief   Stops the harness on a misuse of a kernel
+ *          api which the kernel would not survive.
+ *
+ **/
+#define sim_bug( format, ... )                                          \
+do {                                                                    \
+    fprintf( stderr, "BUG: %s:%d: " format "\n",                        \
+             __FILE__, __LINE__, ##__VA_ARGS__ );                       \
+    abort();                                                            \
+} while( 0 )
+
+//Modules
+//-------
+
+struct module;
+#define THIS_MODULE                 ( (struct module *) NULL )
+#define module_param( name, type, perm )            \
+    _Static_assert( 1, #name )
+#define module_param_array( name, type, nump, perm ) \
+    _Static_assert( 1, #name )
+#define MODULE_PARM_DESC( name, desc )              \
+    _Static_assert( 1, #name )
+#define MODULE_LICENSE( x )         _Static_assert( 1, x )
+#define MODULE_AUTHOR( x )          _Static_assert( 1, x )
+#define MODULE_DESCRIPTION( x )     _Static_assert( 1, x )
+#define MODULE_VERSION( x )         _Static_assert( 1, x )
+
+//Printing
+//--------
+
+#define KERN_ALERT      ""
+#define KERN_ERR        ""
+#define KERN_WARNING    ""
+#define KERN_INFO       ""
+#define KERN_DEBUG      ""
+
+/**
+ * sim_log
+ *
+ * @brief   Whether printk reaches stderr. The log of
+ *          the driver is mostly noise in a test run.
+ *
+ **/
+static bool sim_log;
+
+static inline __attribute__(( format( printf, 1, 2 ) ))
+int printk( const char *format, ... ){
+    va_list args;
+    int ret = 0;
+
+    if( sim_log ){
+        va_start( args, format );
+        ret = vfprintf( stderr, format, args );
+        va_end( args );
+    }
+    return ret;
+}
+
+static inline __attribute__(( format( printf, 1, 2 ) ))
+int no_printk( const char *format, ... ){
+    return 0;
+}
+
+#define DEFAULT_RATELIMIT_INTERVAL  ( 5 * HZ )
+#define DEFAULT_RATELIMIT_BURST     10
+
+struct ratelimit_state {
+    int     interval;
+    int     burst;
+};
+
+#define DEFINE_RATELIMIT_STATE( name, i, b ) \
+    struct ratelimit_state name = { i, b }
+
+static inline int __ratelimit( struct ratelimit_state *rs ){
+    return 1;
+}
+
+//Locks
+//-----
+
+typedef struct {
+    int     held;
+} spinlock_t;
+
+#define DEFINE_SPINLOCK( x )    spinlock_t x = { 0 }
+
+static inline void spin_lock_init( spinlock_t *lock ){
+    lock->held = 0;
+}
+
+static inline void spin_lock( spinlock_t *lock ){
+    if( lock->held++ )
+        sim_bug( "spinlock %p taken twice", (void *) lock );
+}
+
+static inline void spin_unlock( spinlock_t *lock ){
+    if( lock->held-- != 1 )
+        sim_bug( "spinlock %p released while not held", (void *) lock );
+}
+
+#define spin_lock_irqsave( lock, flags ) \
+    do { ( flags ) = 0; spin_lock( lock ); } while( 0 )
+#define spin_unlock_irqrestore( lock, flags ) \
+    do { (void)( flags ); spin_unlock( lock ); } while( 0 )
+#define spin_lock_irq( lock )       spin_lock( lock )
+#define spin_unlock_irq( lock )     spin_unlock( lock )
+#define spin_lock_bh( lock )        spin_lock( lock )
+#define spin_unlock_bh( lock )      spin_unlock( lock )
+
+struct mutex {
+    int     held;
+};
+
+#define DEFINE_MUTEX( x )       struct mutex x = { 0 }
+
+static inline void mutex_init( struct mutex *lock ){
+    lock->held = 0;
+}
+
+static inline void mutex_lock( struct mutex *lock ){
+    if( lock->held++ )
+        sim_bug( "mutex %p taken twice", (void *) lock );
+}
+
+static inline void mutex_unlock( struct mutex *lock ){
+    if( lock->held-- != 1 )
+        sim_bug( "mutex %p released while not held", (void *) lock );
+}
+
+typedef struct {
+    int     counter;
+} atomic_t;
+
+#define ATOMIC_INIT( i )        { ( i ) }
+
+static inline int atomic_read( const atomic_t *v ){ return v->counter; }
+static inline void atomic_set( atomic_t *v, int i ){ v->counter = i; }
+static inline int atomic_inc_return( atomic_t *v ){ return ++v->counter; }
+static inline int atomic_dec_return( atomic_t *v ){ return --v->counter; }
+static inline bool atomic_dec_and_test( atomic_t *v ){ return --v->counter == 0; }
+
+//Per cpu, a single cpu
+//---------------------
+
+#define DEFINE_PER_CPU( type, name )    type name
+#define this_cpu_inc( x )               ( ( x )++ )
+#define this_cpu_add( x, n )            ( ( x ) += ( n ) )
+#define this_cpu_read( x )              ( x )
+#define this_cpu_write( x, v )          ( ( x ) = ( v ) )
+#define per_cpu_ptr( ptr, cpu )         ( (void)( cpu ), ( ptr ) )
+#define for_each_possible_cpu( cpu )    for( ( cpu ) = 0; ( cpu ) < 1; ( cpu )++ )
+
+//Memory
+//------
+
+#define GFP_KERNEL      0u
+#define GFP_ATOMIC      1u
+#define PAGE_SIZE       4096UL
+
+static inline void *kmalloc( size_t size, gfp_t flags ){ return malloc( size ); }
+static inline void *kzalloc( size_t size, gfp_t flags ){ return calloc( 1, size ); }
+static inline void *kmalloc_array( size_t n, size_t size, gfp_t flags ){
+    if( size && n > SIZE_MAX / size )
+        return NULL;
+    return malloc( n * size );
+}
+static inline void *kcalloc( size_t n, size_t size, gfp_t flags ){
+    return calloc( n, size );
+}
+static inline void kfree( const void *ptr ){ free( (void *) ptr ); }
+static inline void *vzalloc( unsigned long size ){ return calloc( 1, size ); }
+static inline void *vmalloc( unsigned long size ){ return malloc( size ); }
+static inline void vfree( const void *ptr ){ free( (void *) ptr ); }
+
+static inline unsigned long get_zeroed_page( gfp_t flags ){
+    return (unsigned long) calloc( 1, PAGE_SIZE );
+}
+static inline void free_page( unsigned long addr ){ free( (void *) addr ); }
+
+/**
+ * The user pointers of the harness are plain pointers
+ **/
+static inline unsigned long copy_from_user( void *to, const void *from,
+                                            unsigned long n ){
+    memcpy( to, from, n );
+    return 0;
+}
+
+static inline unsigned long copy_to_user( void *to, const void *from,
+                                          unsigned long n ){
+    memcpy( to, from, n );
+    return 0;
+}
+
+static inline void *memdup_user( const void *src, size_t len ){
+    void *p = malloc( len );
+
+    if( !p )
+        return ERR_PTR( -ENOMEM );
+    memcpy( p, src, len );
+    return p;
+}
+
+/**
+ * Gen Pool
+ *
+ * @brief   First fit over a map of blocks of 1 << order
+ *          bytes, the way lib/genalloc.c hands them out.
+ *          Only one chunk per pool.
+ *
+ **/
+struct gen_pool {
+    int             order;
+    unsigned long   base;
+    size_t          size;
+    size_t          avail;
+    size_t          blocks;
+    u8              *used;
+};
+
+static inline struct gen_pool *gen_pool_create( int order, int nid ){
+    struct gen_pool *pool = calloc( 1, sizeof( *pool ) );
+
+    if( pool )
+        pool->order = order;
+    return pool;
+}
+
+static inline int gen_pool_add( struct gen_pool *pool, unsigned long addr,
+                                size_t size, int nid ){
+    if( pool->used )
+        sim_bug( "only one chunk per pool" );
+    pool->blocks = size >> pool->order;
+    pool->used = calloc( pool->blocks ? pool->blocks : 1, 1 );
+    if( !pool->used )
+        return -ENOMEM;
+    pool->base = addr;
+    pool->size = pool->avail = pool->blocks << pool->order;
+    return 0;
+}
+
+static inline unsigned long gen_pool_alloc( struct gen_pool *pool, size_t size ){
+    size_t n = ( size + ( 1UL << pool->order ) - 1 ) >> pool->order;
+    size_t i, run = 0;
+
+    if( !n || n << pool->order > pool->avail )
+        return 0;
+    for( i=0; i<pool->blocks; i++ ){
+        run = pool->used[i] ? 0 : run + 1;
+        if( run == n ){
+            memset( &pool->used[ i + 1 - n ], 1, n );
+            pool->avail -= n << pool->order;
+            return pool->base + ( ( i + 1 - n ) << pool->order );
+        }
+    }
+    return 0;
+}
+
+/**
+ * Globals
+ *
+ * @param   sim_in_timer    Whether a timer routine is running.
+ * @param   sim_timer_frees The number of gen_pool_free() calls
+ *                          made from a timer routine.
+ *
+ **/
+static bool sim_in_timer;
+static u64 sim_timer_frees;
+
+static inline void gen_pool_free( struct gen_pool *pool, unsigned long addr,
+                                  size_t size ){
+    size_t n = ( size + ( 1UL << pool->order ) - 1 ) >> pool->order;
+    size_t first = ( addr - pool->base ) >> pool->order;
+    size_t i;
+
+    if( addr < pool->base || first + n > pool->blocks )
+        sim_bug( "freeing %#lx outside of the pool", addr );
+    if( sim_in_timer )
+        sim_timer_frees++;
+    for( i=first; i<first+n; i++ ){
+        if( !pool->used[i] )
+            sim_bug( "freeing %#lx twice", addr );
+        pool->used[i] = 0;
+    }
+    pool->avail += n << pool->order;
+}
+
+static inline size_t gen_pool_avail( struct gen_pool *pool ){ return pool->avail; }
+static inline size_t gen_pool_size( struct gen_pool *pool ){ return pool->size; }
+
+static inline void gen_pool_destroy( struct gen_pool *pool ){
+    if( pool->avail != pool->size )
+        sim_bug( "pool destroyed with %zu bytes in use", pool->size - pool->avail );
+    free( pool->used );
+    free( pool );
+}
+
+//Virtual clock
+//-------------
+
+#ifndef HZ
+#define HZ              100
+#endif
+#define NSEC_PER_USEC   1000L
+#define NSEC_PER_MSEC   1000000L
+#define NSEC_PER_SEC    1000000000L
+#define USEC_PER_MSEC   1000L
+#define USEC_PER_SEC    1000000L
+#define TICK_NSEC       ( NSEC_PER_SEC / HZ )
+
+typedef s64 ktime_t;
+
+/**
+ * Sim Event
+ *
+ * @brief   Something which fires at a virtual time,
+ *          a timer_list or a hrtimer.
+ *
+ * @param   when    The time it fires.
+ * @param   order   Breaks ties between events of the same
+ *                  time, the older one goes first.
+ * @param   slot    Where it sits in sim_events[], -1 when
+ *                  it is not pending.
+ * @param   running Whether its routine is running.
+ * @param   fire    Runs the routine.
+ *
+ **/
+struct sim_event {
+    s64     when;
+    u64     order;
+    int     slot;
+    bool    running;
+    void    (*fire)( struct sim_event *ev );
+};
+
+#define SIM_MAX_EVENTS  256
+
+/**
+ * Globals
+ *
+ * @param   sim_now         The virtual time in nanoseconds.
+ * @param   sim_latency_ns  Added to the time of every event,
+ *                          the interrupt latency of the board.
+ * @param   sim_events      The pending events, unordered.
+ * @param   sim_pending     The number of pending events.
+ * @param   sim_fired       The number of events which fired.
+ *
+ **/
+static s64 sim_now;
+static s64 sim_latency_ns;
+static struct sim_event *sim_events[ SIM_MAX_EVENTS ];
+static int sim_pending;
+static u64 sim_order;
+static u64 sim_fired;
+
+#define jiffies     ( (unsigned long)( sim_now / TICK_NSEC ) )
+
+static inline ktime_t ktime_get( void ){ return sim_now; }
+static inline u64 ktime_get_ns( void ){ return sim_now; }
+static inline ktime_t ktime_add_us( ktime_t k, u64 us ){ return k + us * NSEC_PER_USEC; }
+static inline ktime_t ktime_add_ns( ktime_t k, u64 ns ){ return k + ns; }
+static inline ktime_t ktime_sub( ktime_t a, ktime_t b ){ return a - b; }
+static inline s64 ktime_to_ns( ktime_t k ){ return k; }
+static inline s64 ktime_to_us( ktime_t k ){ return k / NSEC_PER_USEC; }
+static inline ktime_t ns_to_ktime( u64 ns ){ return ns; }
+
+static inline unsigned long usecs_to_jiffies( unsigned int us ){
+    return ( (u64) us * HZ + USEC_PER_SEC - 1 ) / USEC_PER_SEC;
+}
+static inline unsigned long msecs_to_jiffies( unsigned int ms ){
+    return usecs_to_jiffies( ms * USEC_PER_MSEC );
+}
+static inline unsigned int jiffies_to_usecs( unsigned long j ){
+    return j * ( USEC_PER_SEC / HZ );
+}
+static inline unsigned int jiffies_to_msecs( unsigned long j ){
+    return j * ( 1000 / HZ );
+}
+
+static inline void sim_event_add( struct sim_event *ev, s64 when ){
+    if( ev->slot < 0 ){
+        if( sim_pending == SIM_MAX_EVENTS )
+            sim_bug( "too many timers" );
+        ev->slot = sim_pending;
+        sim_events[ sim_pending++ ] = ev;
+    }
+    ev->when = when + sim_latency_ns;
+    ev->order = sim_order++;
+}
+
+static inline bool sim_event_del( struct sim_event *ev ){
+    if( ev->slot < 0 )
+        return false;
+    sim_events[ ev->slot ] = sim_events[ --sim_pending ];
+    sim_events[ ev->slot ]->slot = ev->slot;
+    ev->slot = -1;
+    return true;
+}
+
+/**
+ * Sim Next
+ *
+ * @brief   The pending event which fires first,
+ *          NULL when nothing is pending.
+ *
+ **/
+static inline struct sim_event *sim_next( void ){
+    struct sim_event *next = NULL;
+    int i;
+
+    for( i=0; i<sim_pending; i++ ){
+        if( !next || sim_events[i]->when < next->when ||
+            ( sim_events[i]->when == next->when &&
+              sim_events[i]->order < next->order ) )
+            next = sim_events[i];
+    }
+    return next;
+}
+
+/**
+ * Sim Step
+ *
+ * @brief   Moves the clock to the next event and fires
+ *          it. Returns false when nothing is pending.
+ *
+ **/
+static inline bool sim_step( void ){
+    struct sim_event *ev = sim_next();
+
+    if( !ev )
+        return false;
+    sim_event_del( ev );
+    if( ev->when > sim_now )
+        sim_now = ev->when;
+    sim_fired++;
+    ev->running = true;
+    ev->fire( ev );
+    ev->running = false;
+    return true;
+}
+
+/**
+ * Sim Run Until
+ *
+ * @brief   Fires every event up to a time and leaves
+ *          the clock there.
+ *
+ * @param   until   The virtual time to stop at.
+ *
+ **/
+static inline void sim_run_until( s64 until ){
+    struct sim_event *ev;
+
+    while( ( ev = sim_next() ) && ev->when <= until )
+        sim_step();
+    if( until > sim_now )
+        sim_now = until;
+}
+
+/**
+ * Sim Run
+ *
+ * @brief   Fires events until nothing is pending or
+ *          limit events have fired. Returns the number
+ *          of events fired.
+ *
+ **/
+static inline u64 sim_run( u64 limit ){
+    u64 n = 0;
+
+    while( n < limit && sim_step() )
+        n++;
+    return n;
+}
+
+//Timers
+//------
+
+struct timer_list {
+    unsigned long       expires;
+    void                (*function)( unsigned long data );
+    unsigned long       data;
+    struct sim_event    ev;
+};
+
+static inline void sim_timer_fire( struct sim_event *ev ){
+    struct timer_list *timer = container_of( ev, struct timer_list, ev );
+
+    sim_in_timer = true;
+    timer->function( timer->data );
+    sim_in_timer = false;
+}
+
+static inline void init_timer( struct timer_list *timer ){
+    memset( timer, 0, sizeof( *timer ) );
+    timer->ev.slot = -1;
+    timer->ev.fire = sim_timer_fire;
+}
+
+static inline int timer_pending( const struct timer_list *timer ){
+    return timer->ev.slot >= 0;
+}
+
+/**
+ * A timer fires on the tick where jiffies reaches its
+ * expiry, one which is already due on the next tick.
+ **/
+static inline int mod_timer( struct timer_list *timer, unsigned long expires ){
+    bool pending = timer_pending( timer );
+
+    if( !timer->function )
+        sim_bug( "timer %p has no function", (void *) timer );
+    timer->expires = expires;
+    if( (long)( expires - jiffies ) <= 0 )
+        expires = jiffies + 1;
+    sim_event_add( &timer->ev, (s64) expires * TICK_NSEC );
+    return pending;
+}
+
+static inline int del_timer( struct timer_list *timer ){
+    return sim_event_del( &timer->ev );
+}
+
+static inline int del_timer_sync( struct timer_list *timer ){
+    if( timer->ev.running )
+        sim_bug( "del_timer_sync() from the routine of the timer" );
+    return sim_event_del( &timer->ev );
+}
+
+enum hrtimer_mode {
+    HRTIMER_MODE_ABS,
+    HRTIMER_MODE_REL,
+};
+
+enum hrtimer_restart {
+    HRTIMER_NORESTART,
+    HRTIMER_RESTART,
+};
+
+struct hrtimer {
+    ktime_t                 expires;
+    enum hrtimer_restart    (*function)( struct hrtimer *timer );
+    struct sim_event        ev;
+};
+
+static inline void sim_hrtimer_fire( struct sim_event *ev ){
+    struct hrtimer *timer = container_of( ev, struct hrtimer, ev );
+    enum hrtimer_restart restart;
+
+    sim_in_timer = true;
+    restart = timer->function( timer );
+    sim_in_timer = false;
+    if( restart == HRTIMER_RESTART ){
+        if( ev->slot >= 0 )
+            sim_bug( "hrtimer %p restarted while queued", (void *) timer );
+        sim_event_add( ev, timer->expires );
+    }
+}
+
+static inline void hrtimer_init( struct hrtimer *timer, clockid_t clock,
+                                 enum hrtimer_mode mode ){
+    memset( timer, 0, sizeof( *timer ) );
+    timer->ev.slot = -1;
+    timer->ev.fire = sim_hrtimer_fire;
+}
+
+static inline void hrtimer_start( struct hrtimer *timer, ktime_t time,
+                                  enum hrtimer_mode mode ){
+    if( !timer->function )
+        sim_bug( "hrtimer %p has no function", (void *) timer );
+    timer->expires = mode == HRTIMER_MODE_REL ? sim_now + time : time;
+    sim_event_add( &timer->ev, max( timer->expires, sim_now ) );
+}
+
+static inline void hrtimer_set_expires( struct hrtimer *timer, ktime_t time ){
+    timer->expires = time;
+}
+
+static inline int hrtimer_try_to_cancel( struct hrtimer *timer ){
+    if( sim_event_del( &timer->ev ) )
+        return 1;
+    return timer->ev.running ? -1 : 0;
+}
+
+static inline int hrtimer_cancel( struct hrtimer *timer ){
+    if( timer->ev.running )
+        sim_bug( "hrtimer_cancel() from the routine of the timer" );
+    return sim_event_del( &timer->ev );
+}
+
+static inline bool hrtimer_active( const struct hrtimer *timer ){
+    return timer->ev.slot >= 0 || timer->ev.running;
+}
+
+//Work
+//----
+
+/**
+ * Work Struct
+ *
+ * @brief   Queued work runs in process context as an
+ *          event of its own, right after the one which
+ *          queued it.
+ *
+ **/
+struct work_struct {
+    void                (*func)( struct work_struct *work );
+    struct sim_event    ev;
+};
+
+static inline void sim_work_fire( struct sim_event *ev ){
+    struct work_struct *work = container_of( ev, struct work_struct, ev );
+
+    work->func( work );
+}
+
+#define DECLARE_WORK( name, f ) \
+    struct work_struct name = { .func = ( f ), .ev = { .slot = -1, .fire = sim_work_fire } }
+
+static inline void INIT_WORK( struct work_struct *work,
+                              void (*func)( struct work_struct * ) ){
+    memset( work, 0, sizeof( *work ) );
+    work->func = func;
+    work->ev.slot = -1;
+    work->ev.fire = sim_work_fire;
+}
+
+static inline bool schedule_work( struct work_struct *work ){
+    if( work->ev.slot >= 0 )
+        return false;
+    sim_event_add( &work->ev, sim_now );
+    return true;
+}
+
+static inline bool flush_work( struct work_struct *work ){
+    if( work->ev.running )
+        sim_bug( "flush_work() from the work itself" );
+    if( !sim_event_del( &work->ev ) )
+        return false;
+    work->ev.running = true;
+    work->func( work );
+    work->ev.running = false;
+    return true;
+}
+
+static inline bool cancel_work_sync( struct work_struct *work ){
+    if( work->ev.running )
+        sim_bug( "cancel_work_sync() from the work itself" );
+    return sim_event_del( &work->ev );
+}
+
+//Gpio's
+//------
+
+#define SIM_GPIOS           512
+#define SIM_EDGE_LOG        4096
+#define GPIOF_OUT_INIT_LOW  0
+#define GPIOF_OUT_INIT_HIGH 2
+
+struct gpio {
+    unsigned        gpio;
+    unsigned long   flags;
+    const char      *label;
+};
+
+struct gpio_desc {
+    unsigned        gpio;
+};
+
+/**
+ * Sim Gpio
+ *
+ * @param   requested   Whether the pin is owned by the driver.
+ * @param   value       The level of the pin.
+ * @param   writes      The number of writes to the pin.
+ * @param   edges       The number of writes which changed it.
+ * @param   last_edge   The time of the last edge.
+ *
+ **/
+struct sim_gpio {
+    bool    requested;
+    int     value;
+    u64     writes;
+    u64     edges;
+    s64     last_edge;
+};
+
+/**
+ * Sim Edge
+ *
+ * @brief   An entry of the edge log, the harness
+ *          clears it and reads it back.
+ *
+ **/
+struct sim_edge {
+    s64         time;
+    unsigned    gpio;
+    int         value;
+};
+
+static struct sim_gpio sim_gpios[ SIM_GPIOS ];
+static struct gpio_desc sim_gpio_descs[ SIM_GPIOS ];
+static struct sim_edge sim_edges[ SIM_EDGE_LOG ];
+static size_t sim_edge_count;
+static bool sim_edge_logging = true;
+
+static inline bool gpio_is_valid( int gpio ){
+    return gpio >= 0 && gpio < SIM_GPIOS;
+}
+
+static inline void sim_gpio_write( unsigned gpio, int value ){
+    struct sim_gpio *pin = &sim_gpios[ gpio ];
+
+    if( !pin->requested )
+        sim_bug( "gpio %u written without being requested", gpio );
+    value = !!value;
+    pin->writes++;
+    if( pin->value == value )
+        return;
+    pin->value = value;
+    pin->edges++;
+    pin->last_edge = sim_now;
+    if( sim_edge_logging && sim_edge_count < SIM_EDGE_LOG ){
+        sim_edges[ sim_edge_count ].time = sim_now;
+        sim_edges[ sim_edge_count ].gpio = gpio;
+        sim_edges[ sim_edge_count ].value = value;
+        sim_edge_count++;
+    }
+}
+
+/**
+ * Sim Chips
+ *
+ * @brief   The chips gpiochip_find() knows about,
+ *          carved out of sim_gpios[].
+ *
+ **/
+struct gpio_chip {
+    const char  *label;
+    int         base;
+    u16         ngpio;
+};
+
+static struct gpio_chip sim_chips[] = {
+    { "pinctrl-bcm2835",    0,      54 },
+    { "gpio-mockup-A",      496,    16 },
+};
+
+static inline struct gpio_chip *gpiochip_find( void *data,
+        int (*match)( struct gpio_chip *gc, void *data ) ){
+    size_t i;
+
+    for( i=0; i<ARRAY_SIZE( sim_chips ); i++ ){
+        if( match( &sim_chips[i], data ) )
+            return &sim_chips[i];
+    }
+    return NULL;
+}
+
+static inline int gpio_request_one( unsigned gpio, unsigned long flags,
+                                    const char *label ){
+    if( !gpio_is_valid( gpio ) )
+        return -EINVAL;
+    if( sim_gpios[ gpio ].requested )
+        return -EBUSY;
+    memset( &sim_gpios[ gpio ], 0, sizeof( sim_gpios[ gpio ] ) );
+    sim_gpios[ gpio ].requested = true;
+    sim_gpios[ gpio ].value = !!( flags & GPIOF_OUT_INIT_HIGH );
+    sim_gpio_descs[ gpio ].gpio = gpio;
+    return 0;
+}
+
+static inline void gpio_free( unsigned gpio ){
+    if( !sim_gpios[ gpio ].requested )
+        sim_bug( "gpio %u freed without being requested", gpio );
+    sim_gpios[ gpio ].requested = false;
+}
+
+static inline int gpio_request_array( const struct gpio *array, size_t num ){
+    size_t i;
+    int ret;
+
+    for( i=0; i<num; i++ ){
+        ret = gpio_request_one( array[i].gpio, array[i].flags, array[i].label );
+        if( ret ){
+            while( i-- )
+                gpio_free( array[i].gpio );
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static inline void gpio_free_array( const struct gpio *array, size_t num ){
+    while( num-- )
+        gpio_free( array[ num ].gpio );
+}
+
+static inline void gpio_set_value( unsigned gpio, int value ){
+    sim_gpio_write( gpio, value );
+}
+
+static inline int gpio_get_value( unsigned gpio ){
+    return sim_gpios[ gpio ].value;
+}
+
+static inline struct gpio_desc *gpio_to_desc( unsigned gpio ){
+    return gpio_is_valid( gpio ) ? &sim_gpio_descs[ gpio ] : NULL;
+}
+
+static inline int desc_to_gpio( const struct gpio_desc *desc ){
+    return desc->gpio;
+}
+
+static inline void gpiod_set_array_value( unsigned int array_size,
+                                          struct gpio_desc **desc_array,
+                                          int *value_array ){
+    unsigned int i;
+
+    for( i=0; i<array_size; i++ )
+        sim_gpio_write( desc_array[i]->gpio, !!value_array[i] );
+}
+
+//Files
+//-----
+
+struct inode;
+struct dentry;
+
+struct file {
+    unsigned int    f_flags;
+    void            *private_data;
+};
+
+struct seq_file {
+    char    buf[ 4096 ];
+    size_t  count;
+};
+
+struct file_operations {
+    struct module   *owner;
+    int             (*open)( struct inode *inode, struct file *file );
+    ssize_t         (*read)( struct file *file, char __user *buf,
+                             size_t len, loff_t *off );
+    loff_t          (*llseek)( struct file *file, loff_t off, int whence );
+    int             (*release)( struct inode *inode, struct file *file );
+};
+
+static inline __attribute__(( format( printf, 2, 3 ) ))
+void seq_printf( struct seq_file *m, const char *format, ... ){
+    va_list args;
+    int n;
+
+    va_start( args, format );
+    n = vsnprintf( m->buf + m->count, sizeof( m->buf ) - m->count, format, args );
+    va_end( args );
+    if( n > 0 )
+        m->count = min( m->count + n, sizeof( m->buf ) - 1 );
+}
+
+static inline int single_open( struct file *file,
+                               int (*show)( struct seq_file *m, void *v ),
+                               void *data ){
+    return -ENOSYS;
+}
+
+static inline ssize_t seq_read( struct file *file, char __user *buf,
+                                size_t len, loff_t *off ){
+    return -ENOSYS;
+}
+
+static inline loff_t seq_lseek( struct file *file, loff_t off, int whence ){
+    return -ENOSYS;
+}
+
+static inline int single_release( struct inode *inode, struct file *file ){
+    return 0;
+}
+
+/**
+ * There is no debugfs, the harness reads the
+ * counters straight out of sled_stats.
+ **/
+static inline struct dentry *debugfs_create_dir( const char *name,
+                                                 struct dentry *parent ){
+    return NULL;
+}
+
+static inline struct dentry *debugfs_create_file( const char *name,
+                                                  unsigned short mode,
+                                                  struct dentry *parent,
+                                                  void *data,
+                                                  const struct file_operations *fops ){
+    return NULL;
+}
+
+static inline void debugfs_remove_recursive( struct dentry *dentry ){
+}
+
+/**
+ * Sim Reset
+ *
+ * @brief   Drops every pending event and puts the clock,
+ *          the pins and the edge log back to zero. Only
+ *          between two runs of the driver.
+ *
+ **/
+static inline void sim_reset( void ){
+    while( sim_pending )
+        sim_event_del( sim_events[0] );
+    sim_now = 0;
+    sim_latency_ns = 0;
+    sim_fired = 0;
+    sim_edge_count = 0;
+    sim_timer_frees = 0;
+    memset( sim_gpios, 0, sizeof( sim_gpios ) );
+}
+
+#endif
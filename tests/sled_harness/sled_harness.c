@@ -0,0 +1,1123 @@
+/**
+ * @file    sled_harness.c
+ * @version 0.1
+ * @brief   Runs the command parser and the sequencers of
+ *          the driver in user space, on top of the mock
+ *          kernel in mock/. Timers fire on a virtual clock
+ *          and every gpio edge is logged with its time, so
+ *          the timing of the blinks is checked exactly and
+ *          without a board.
+ *
+ *          ./sled_harness          runs the tests
+ *          ./sled_harness -b [n]   simulates n ticks per backend
+ *                                  and reports the rates
+ *          ./sled_harness -f [n]   checks the text parser against
+ *                                  a plain one on n generated texts
+ *          ./sled_harness -v       prints the log of the driver
+ *
+ **/
+
+#include "sled_mock.h"
+#include "command_process.h"
+#include "pattern.h"
+#include "program.h"
+
+#define MS( x )     ( (s64)( x ) * NSEC_PER_MSEC )
+#define US( x )     ( (s64)( x ) * NSEC_PER_USEC )
+
+static int checks;
+static int failures;
+
+#define CHECK( cond )                                                   \
+do {                                                                    \
+    checks++;                                                           \
+    if( !( cond ) ){                                                    \
+        failures++;                                                     \
+        fprintf( stderr, "%s:%d: %s: failed: %s\n",                     \
+                 __FILE__, __LINE__, __func__, #cond );                 \
+    }                                                                   \
+} while( 0 )
+
+#define CHECK_EQ( a, b )                                                \
+do {                                                                    \
+    long long _a = (long long)( a ), _b = (long long)( b );             \
+    checks++;                                                           \
+    if( _a != _b ){                                                     \
+        failures++;                                                     \
+        fprintf( stderr, "%s:%d: %s: %s == %lld, expected %lld\n",      \
+                 __FILE__, __LINE__, __func__, #a, _a, _b );            \
+    }                                                                   \
+} while( 0 )
+
+//Driver lifetime
+//---------------
+
+/**
+ * Harness Start
+ *
+ * @brief   Loads the driver the way start.c does, on a
+ *          clean clock and clean pins.
+ *
+ * @param   backend     The timer_backend parameter.
+ *
+ **/
+static void harness_start( const char *backend ){
+    sim_reset();
+    memset( &sled_stats, 0, sizeof( sled_stats ) );
+    timer_backend = (char *) backend;
+
+    if( setup_leds() || initiate_leds() )
+        sim_bug( "leds failed to set up" );
+    setup_stats( led_count );
+    if( setup_control() || setup_timer_interrupt() )
+        sim_bug( "driver failed to set up" );
+}
+
+/**
+ * Harness Stop
+ *
+ * @brief   Unloads the driver in the order of start.c.
+ *          The mock pools catch any leaked sequence.
+ *
+ **/
+static void harness_stop( void ){
+    remove_timer();
+    remove_patterns();
+    remove_control();
+    remove_stats();
+    release_leds();
+}
+
+static struct sled_cmd blink( u8 channel, u8 brightness, u16 repeat,
+                              u32 on_us, u32 off_us ){
+    struct sled_cmd cmd = {
+        .channel    = channel,
+        .brightness = brightness,
+        .repeat     = repeat,
+        .on_us      = on_us,
+        .off_us     = off_us,
+    };
+    return cmd;
+}
+
+/**
+ * Edges Of
+ *
+ * @brief   Copies the logged edges of one gpio.
+ *          Returns their number.
+ *
+ **/
+static size_t edges_of( unsigned gpio, struct sim_edge *out, size_t max ){
+    size_t i, n = 0;
+
+    for( i=0; i<sim_edge_count; i++ ){
+        if( sim_edges[i].gpio == gpio && n < max )
+            out[ n++ ] = sim_edges[i];
+    }
+    return n;
+}
+
+//Parser
+//------
+
+static void test_validate_buffer( void ){
+    CHECK( validate_buffer( "3 6 1\n", 6 ) );
+    CHECK( validate_buffer( "5 8 9\n", 6 ) );
+    CHECK( !validate_buffer( "3 6 12\n", 7 ) );
+    CHECK( !validate_buffer( "3 6\n", 4 ) );
+    CHECK( !validate_buffer( "a 6 1\n", 6 ) );
+    CHECK( !validate_buffer( "3-6 1\n", 6 ) );
+    CHECK( !validate_buffer( "3  6 1\n", 7 ) );
+    CHECK( !validate_buffer( "", 0 ) );
+    CHECK( !validate_buffer( "\n", 1 ) );
+    CHECK( validate_buffer( "3 6 1", 5 ) );
+    CHECK( !validate_buffer( "3 6 1 ", 6 ) );
+    CHECK( !validate_buffer( "36 1 \n", 6 ) );
+    CHECK( !validate_buffer( "3 6 :\n", 6 ) );
+    CHECK( !validate_buffer( "3 6 /\n", 6 ) );
+    CHECK( !validate_buffer( "3 \xb6 1\n", 6 ) );
+    CHECK( !validate_buffer( "3 6 1\n3 6 1\n", 12 ) );
+}
+
+static void test_parse_command( void ){
+    struct sled_cmd cmd;
+
+    CHECK( parse_command( "3 6 2\n", 6, -1, &cmd ) );
+    CHECK_EQ( cmd.channel, SLED_RED );
+    CHECK_EQ( cmd.brightness, 255 );
+    CHECK_EQ( cmd.repeat, 2 );
+    CHECK_EQ( cmd.on_us, jiffies_to_usecs( SHORT_DELAY ) );
+    CHECK_EQ( cmd.off_us, cmd.on_us );
+
+    CHECK( parse_command( "5 8 9\n", 6, -1, &cmd ) );
+    CHECK_EQ( cmd.channel, SLED_BLUE );
+    CHECK_EQ( cmd.on_us, jiffies_to_usecs( LONG_DELAY ) );
+
+    //The device picks the channel, the color is ignored
+    CHECK( parse_command( "9 7 1\n", 6, 1, &cmd ) );
+    CHECK_EQ( cmd.channel, 1 );
+
+    CHECK( !parse_command( "9 7 1\n", 6, -1, &cmd ) );
+    CHECK( !parse_command( "3 7 0\n", 6, -1, &cmd ) );
+    CHECK( !parse_command( "3 7 1\n", 6, 7, &cmd ) );
+    CHECK( !parse_command( "3 7 1\n", 0, -1, &cmd ) );
+    CHECK( !parse_command( "3 7 1\n3 7 1\n", 12, -1, &cmd ) );
+}
+
+static void test_parse_commands( void ){
+    static const char text[] = "3 6 1\n4 7 2\n5 8 3";
+    struct sled_cmd cmds[ 4 ];
+    size_t len = strlen( text );
+    int i;
+
+    CHECK_EQ( TEXT_CMDS( len ), 3 );
+    CHECK_EQ( parse_commands( text, len, -1, cmds, 4 ), 3 );
+    for( i=0; i<3; i++ ){
+        CHECK_EQ( cmds[i].channel, SLED_RED + i );
+        CHECK_EQ( cmds[i].repeat, 1 + i );
+    }
+    CHECK_EQ( parse_commands( text, len + 1, -1, cmds, 4 ), -EINVAL );
+    CHECK_EQ( parse_commands( text, len, -1, cmds, 2 ), -E2BIG );
+    CHECK_EQ( parse_commands( text, len - 1, -1, cmds, 4 ), -EINVAL );
+    CHECK_EQ( parse_commands( "3 6 1\n\n", 7, -1, cmds, 4 ), -EINVAL );
+    CHECK_EQ( parse_commands( "3 6 1\n4 7 0\n", 12, -1, cmds, 4 ), -EINVAL );
+    CHECK_EQ( parse_commands( "", 0, -1, cmds, 4 ), -EINVAL );
+}
+
+static void test_validate_command( void ){
+    struct sled_cmd cmd = blink( SLED_RED, 255, 65535, SLED_MIN_STEP_US,
+                                 SLED_MIN_STEP_US );
+
+    //Zero length steps would fire the timer back to back
+    CHECK( validate_command( &cmd ) );
+    cmd.on_us = 0;
+    CHECK( !validate_command( &cmd ) );
+    cmd.on_us = SLED_MIN_STEP_US;
+    cmd.off_us = SLED_MIN_STEP_US - 1;
+    CHECK( !validate_command( &cmd ) );
+    cmd.on_us = cmd.off_us = 0;
+    CHECK( !validate_command( &cmd ) );
+}
+
+/**
+ * Reference Parse
+ *
+ * @brief   The text parser written the plain way,
+ *          a byte at a time, to check parse_commands()
+ *          against.
+ *
+ **/
+static int reference_parse( const char *buff, size_t len, int channel,
+                            struct sled_cmd *cmds, size_t max ){
+    static const char shape[] = "0 0 0";
+    size_t at = 0, count = 0, i;
+    struct sled_cmd *cmd;
+    int led;
+
+    while( at < len ){
+        if( len - at < TEXT_CMD_LEN )
+            return -EINVAL;
+        if( count == max )
+            return -E2BIG;
+        for( i=0; i<TEXT_CMD_LEN; i++ ){
+            char c = buff[ at + i ];
+            if( shape[i] == '0' ? c < '0' || c > '9' : c != ' ' )
+                return -EINVAL;
+        }
+
+        led = channel < 0 ? resolve_led( buff[ at ] - '0' ) : channel;
+        if( led < 0 )
+            return -EINVAL;
+        cmd = &cmds[ count++ ];
+        memset( cmd, 0, sizeof( *cmd ) );
+        cmd->channel    = led;
+        cmd->brightness = 255;
+        cmd->repeat     = buff[ at + 4 ] - '0';
+        cmd->on_us      = resolve_delay( buff[ at + 2 ] - '0' );
+        cmd->off_us     = cmd->on_us;
+        if( !validate_command( cmd ) )
+            return -EINVAL;
+
+        at += TEXT_CMD_LEN;
+        if( at == len )
+            break;
+        if( buff[ at++ ] != '\n' )
+            return -EINVAL;
+    }
+    if( !count )
+        return -EINVAL;
+    return count;
+}
+
+static unsigned fuzz_rand( void ){
+    static u64 seed = 0x5eed;
+
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return seed >> 33;
+}
+
+/**
+ * Fuzz Text
+ *
+ * @brief   Feeds generated texts, mostly valid commands
+ *          with a few bytes changed or cut short, to both
+ *          parsers and compares what they decode. Every
+ *          text sits in an allocation of its exact size,
+ *          built with -fsanitize=address (make fuzz) any
+ *          read past it is caught.
+ *
+ **/
+static void fuzz_text( u64 count ){
+    static const char bytes[] = "0123456789 \n/:;?\0\x80\xb0\xff";
+    struct sled_cmd got[ 8 ], want[ 8 ];
+    char text[ 64 ], *copy;
+    u64 n;
+    size_t len, max, i;
+    int channel, a, b;
+
+    for( n=0; n<count; n++ ){
+        len = 0;
+        for( i=fuzz_rand() % 8; i>0; i-- ){
+            len += sprintf( text + len, "%u %u %u\n", 2 + fuzz_rand() % 5,
+                            5 + fuzz_rand() % 5, fuzz_rand() % 10 );
+        }
+        if( len && fuzz_rand() % 2 )
+            len--;
+        for( i=fuzz_rand() % 3; i>0 && len; i-- )
+            text[ fuzz_rand() % len ] = bytes[ fuzz_rand() % ( sizeof( bytes ) - 1 ) ];
+        if( len && !( fuzz_rand() % 4 ) )
+            len -= fuzz_rand() % len;
+
+        channel = fuzz_rand() % 5 - 1;
+        max = fuzz_rand() % 9;
+        copy = malloc( len ? len : 1 );
+        memcpy( copy, text, len );
+        memset( got, 0, sizeof( got ) );
+        memset( want, 0, sizeof( want ) );
+
+        a = parse_commands( copy, len, channel, got, max );
+        b = reference_parse( copy, len, channel, want, max );
+        checks++;
+        if( a != b || ( a > 0 && memcmp( got, want, a * sizeof( *got ) ) ) ){
+            failures++;
+            fprintf( stderr, "%s: \"%.*s\" channel %d max %zu: %d, expected %d\n",
+                     __func__, (int) len, text, channel, max, a, b );
+        }
+        free( copy );
+    }
+}
+
+static void test_chip_lines( void ){
+    struct sled_cmd cmd = blink( SLED_GREEN, 255, 1, 1000, 1000 );
+    struct sim_edge e[ 4 ];
+    int saved[ 3 ];
+
+    memcpy( saved, gpios, sizeof( saved ) );
+    gpios[0] = 2; gpios[1] = 0; gpios[2] = 15;
+    chip = "gpio-mockup-A";
+
+    //Line offsets on the chip, not global numbers
+    harness_start( "hrtimer" );
+    CHECK_EQ( leds[0].gpio, 498 );
+    CHECK_EQ( leds[1].gpio, 496 );
+    CHECK_EQ( leds[2].gpio, 511 );
+    CHECK( start_timer_interrupt( &cmd, 0 ) );
+    sim_run( ~0ULL );
+    CHECK_EQ( edges_of( 496, e, 4 ), 2 );
+    harness_stop();
+
+    gpios[2] = 16;
+    CHECK_EQ( setup_leds(), -EINVAL );
+    chip = "gpio-mockup-B";
+    CHECK_EQ( setup_leds(), -ENODEV );
+
+    chip = NULL;
+    memcpy( gpios, saved, sizeof( saved ) );
+}
+
+//Sequences
+//---------
+
+static void test_task_list( void ){
+    struct sled_cmd cmd = blink( SLED_GREEN, 200, 3, 1000, 2000 );
+    struct gen_pool *pool;
+    struct led_sequence *seq;
+    size_t i;
+
+    harness_start( "hrtimer" );
+    pool = channels[ SLED_GREEN ].pool;
+
+    //One blink and a loop step, whatever the repeat count
+    seq = create_task_list( &cmd );
+    CHECK( seq );
+    CHECK_EQ( seq->len, 3 );
+    CHECK( seq->owned );
+    CHECK( !seq->active );
+    CHECK( gen_pool_avail( pool ) < gen_pool_size( pool ) );
+    for( i=0; i<2; i++ ){
+        CHECK_EQ( seq->steps[i].led, SLED_GREEN );
+        CHECK( !seq->steps[i].loop );
+        CHECK_EQ( seq->steps[i].level, i % 2 ? 0 : 200 );
+        CHECK_EQ( seq->steps[i].duration_us, i % 2 ? 2000 : 1000 );
+    }
+    CHECK( seq->steps[2].loop );
+    CHECK_EQ( seq->steps[2].target, 0 );
+    CHECK_EQ( seq->steps[2].count, 3 );
+    destroy_task_list( seq );
+
+    cmd.repeat = 1;
+    seq = create_task_list( &cmd );
+    CHECK_EQ( seq->len, 2 );
+
+    destroy_task_list( seq );
+    CHECK_EQ( gen_pool_avail( pool ), gen_pool_size( pool ) );
+    harness_stop();
+}
+
+static void test_pool_exhaustion( void ){
+    struct sled_cmd cmd = blink( SLED_RED, 255, 9, 1000, 1000 );
+    struct gen_pool *pool;
+    unsigned int saved = pool_steps;
+    int queued = 0;
+
+    pool_steps = 64;
+    harness_start( "hrtimer" );
+    pool = channels[ SLED_RED ].pool;
+
+    while( start_timer_interrupt( &cmd, 0 ) )
+        queued++;
+    CHECK( queued > 1 );
+    CHECK_EQ( sled_stats.count[ STAT_ALLOC_FAILURES ], 1 );
+    CHECK_EQ( channels[ SLED_RED ].queue_len, queued - 1 );
+
+    //Cancelled sequences wait for the reclaim work, a full
+    //pool takes them back straight away
+    CHECK_EQ( cancel_channel( &channels[ SLED_RED ], 0 ), queued );
+    CHECK( start_timer_interrupt( &cmd, 0 ) );
+    CHECK_EQ( channels[ SLED_RED ].queue_len, 1 );
+
+    //Every finished sequence goes back to the pool, never from a timer
+    sim_run( ~0ULL );
+    CHECK( channel_idle( &channels[ SLED_RED ] ) );
+    CHECK_EQ( gen_pool_avail( pool ), gen_pool_size( pool ) );
+    CHECK_EQ( sim_timer_frees, 0 );
+
+    harness_stop();
+    pool_steps = saved;
+}
+
+//Programs
+//--------
+
+static void test_compile_program( void ){
+    struct program_op ops[ PROGRAM_MAX_STEPS ];
+    struct program prog = { .ops = ops };
+    static const char * const bad[] = {
+        "", "off100", "R", "R200x3", "x3", "R100 )", "(R100", "()x2",
+        "R100 x0", "Q100", "on100", "R100 (x2)", "R5000000",
+        "(((((((((R1)))))))))",
+        "R1 x2 x2 x2 x2 x2 x2 x2 x2 x2",
+        "R0", "R10 off0", "R0 off0 x1000000", "R10 x65536",
+    };
+    size_t i;
+
+    harness_start( "hrtimer" );
+
+    CHECK_EQ( compile_program( "R200 G50 off100 x10\n", -1, &prog ), 0 );
+    CHECK_EQ( prog.len, 4 );
+    CHECK_EQ( prog.priority, 0 );
+    CHECK_EQ( prog.used, BIT( SLED_RED ) | BIT( SLED_GREEN ) );
+    CHECK_EQ( ops[0].mask, BIT( SLED_RED ) );
+    CHECK_EQ( ops[0].value, 200000 );
+    CHECK_EQ( ops[2].mask, 0 );
+    CHECK( ops[3].loop );
+    CHECK_EQ( ops[3].target, 0 );
+    CHECK_EQ( ops[3].value, 10 );
+
+    //A repeat only costs one step, however large
+    CHECK_EQ( compile_program( "(rb100 off100 x65535) G1", -1, &prog ), 0 );
+    CHECK_EQ( prog.len, 4 );
+    CHECK_EQ( ops[0].mask, BIT( SLED_RED ) | BIT( SLED_BLUE ) );
+    CHECK_EQ( ops[2].value, 65535 );
+
+    //Everything before x in the group, groups for less
+    CHECK_EQ( compile_program( "R1 x2 G1 x3 (B1 x4) x1", -1, &prog ), 0 );
+    CHECK_EQ( prog.len, 6 );
+    CHECK_EQ( ops[1].target, 0 );
+    CHECK_EQ( ops[3].target, 0 );
+    CHECK_EQ( ops[5].target, 4 );
+
+    CHECK_EQ( compile_program( " p7 R1", -1, &prog ), 0 );
+    CHECK_EQ( prog.priority, 7 );
+    CHECK_EQ( prog.len, 1 );
+
+    //Every led is the led of the device
+    CHECK_EQ( compile_program( "on10 R10 off10", 2, &prog ), 0 );
+    CHECK_EQ( prog.used, BIT( 2 ) );
+    CHECK_EQ( ops[1].mask, BIT( 2 ) );
+
+    for( i=0; i<ARRAY_SIZE( bad ); i++ ){
+        if( !compile_program( bad[i], -1, &prog ) ){
+            failures++;
+            fprintf( stderr, "%s: \"%s\" compiled\n", __func__, bad[i] );
+        }
+        checks++;
+    }
+    harness_stop();
+}
+
+static void test_play_program( void ){
+    struct sim_edge e[ 64 ];
+    size_t i, n;
+    s64 t;
+
+    harness_start( "hrtimer" );
+    CHECK_EQ( play_program( "R20 G10 off30 x3", -1, 0 ), 0 );
+    CHECK( channel_idle( &channels[ SLED_BLUE ] ) );
+    sim_run( ~0ULL );
+
+    //Red and green take turns, three rounds of 60ms
+    n = edges_of( leds[ SLED_RED ].gpio, e, 64 );
+    CHECK_EQ( n, 6 );
+    for( i=0; i<n; i++ )
+        CHECK_EQ( e[i].time, ( i / 2 ) * MS( 60 ) + ( i % 2 ) * MS( 20 ) );
+    n = edges_of( leds[ SLED_GREEN ].gpio, e, 64 );
+    CHECK_EQ( n, 6 );
+    for( i=0; i<n; i++ )
+        CHECK_EQ( e[i].time, ( i / 2 ) * MS( 60 ) + MS( 20 ) + ( i % 2 ) * MS( 10 ) );
+    CHECK_EQ( gen_pool_avail( channels[ SLED_RED ].pool ),
+              gen_pool_size( channels[ SLED_RED ].pool ) );
+
+    //Nested loops
+    sim_edge_count = 0;
+    t = sim_now;
+    CHECK_EQ( play_program( "((B1 off1 x3) off10 x2) x2", -1, 0 ), 0 );
+    sim_run( ~0ULL );
+    n = edges_of( leds[ SLED_BLUE ].gpio, e, 64 );
+    CHECK_EQ( n, 2 * 3 * 2 * 2 );
+    for( i=0; i<n; i++ ){
+        size_t blink = i / 2, round = blink / 3;
+        CHECK_EQ( e[i].time - t, round * MS( 16 ) + ( blink % 3 ) * MS( 2 ) + ( i % 2 ) * MS( 1 ) );
+    }
+
+    //A million rounds in the same few steps of the pool
+    CHECK_EQ( play_program( "(G1 off1 x1000) x1000", -1, 0 ), 0 );
+    CHECK( gen_pool_size( channels[ SLED_GREEN ].pool ) -
+           gen_pool_avail( channels[ SLED_GREEN ].pool ) <= 128 );
+    sim_edge_logging = false;
+    sim_run( ~0ULL );
+    sim_edge_logging = true;
+    CHECK_EQ( sim_gpios[ leds[ SLED_GREEN ].gpio ].edges, 2000000 + 6 );
+
+    CHECK_EQ( play_program( "R1 (G1", -1, 0 ), -EINVAL );
+
+    //Zero length steps would fire the timer back to back
+    CHECK_EQ( play_program( "R0 off0 x1000", -1, 0 ), -EINVAL );
+    CHECK_EQ( sim_pending, 0 );
+    harness_stop();
+}
+
+//Timing
+//------
+
+static void test_jiffy_timing( void ){
+    struct sled_cmd cmd = blink( SLED_RED, 255, 3, 100000, 100000 );
+    struct sim_edge e[ 16 ];
+    struct seq_file m;
+    char line[ 96 ];
+    unsigned gpio;
+    size_t i, n;
+
+    harness_start( "jiffy" );
+    gpio = leds[ SLED_RED ].gpio;
+    CHECK( start_timer_interrupt( &cmd, 0 ) );
+    CHECK( !channel_idle( &channels[ SLED_RED ] ) );
+    sim_run( ~0ULL );
+    CHECK( channel_idle( &channels[ SLED_RED ] ) );
+
+    //The first tick waits for the next jiffy, the
+    //others land on whole jiffies after it
+    n = edges_of( gpio, e, 16 );
+    CHECK_EQ( n, 6 );
+    for( i=0; i<n; i++ ){
+        CHECK_EQ( e[i].time, MS( 10 ) + i * MS( 100 ) );
+        CHECK_EQ( e[i].value, i % 2 );
+    }
+    CHECK_EQ( sim_gpios[ gpio ].value, 1 );
+    CHECK_EQ( sled_stats.count[ STAT_TICKS ], 7 );
+    CHECK_EQ( sled_stats.count[ STAT_LATE_TICKS ], 1 );
+    CHECK_EQ( sled_stats.late_max_ns, MS( 10 ) );
+    CHECK_EQ( sled_stats.toggles[ SLED_RED ], 7 );
+
+    //The stats file reports the pool back to full
+    memset( &m, 0, sizeof( m ) );
+    stats_show( &m, NULL );
+    snprintf( line, sizeof( line ), "pool_avail_%-9d %zu\npool_size_%-10d %zu\n",
+              SLED_RED, gen_pool_size( channels[ SLED_RED ].pool ),
+              SLED_RED, gen_pool_size( channels[ SLED_RED ].pool ) );
+    CHECK( strstr( m.buf, line ) );
+    harness_stop();
+}
+
+static void test_hrtimer_timing( void ){
+    struct sled_cmd cmd = blink( SLED_BLUE, 255, 3, 100000, 50000 );
+    struct sim_edge e[ 16 ];
+    unsigned gpio;
+    size_t i, n;
+
+    harness_start( "hrtimer" );
+    gpio = leds[ SLED_BLUE ].gpio;
+    sim_latency_ns = US( 50 );
+    CHECK( start_timer_interrupt( &cmd, 0 ) );
+    sim_run( ~0ULL );
+
+    //Late by the same 50us on every step, never more
+    n = edges_of( gpio, e, 16 );
+    CHECK_EQ( n, 6 );
+    for( i=0; i<n; i++ ){
+        CHECK_EQ( e[i].time, ( i / 2 ) * MS( 150 ) + ( i % 2 ) * MS( 100 ) + US( 50 ) );
+        CHECK_EQ( e[i].value, i % 2 );
+    }
+    CHECK_EQ( sled_stats.count[ STAT_TICKS ], 7 );
+    CHECK_EQ( sled_stats.count[ STAT_LATE_TICKS ], 0 );
+    CHECK_EQ( sled_stats.late_max_ns, US( 50 ) );
+    harness_stop();
+}
+
+static void test_queue_and_parallel( void ){
+    struct sled_cmd red = blink( SLED_RED, 255, 1, 10000, 10000 );
+    struct sled_cmd green = blink( SLED_GREEN, 255, 2, 5000, 5000 );
+    struct sim_edge e[ 16 ];
+    size_t i, n;
+
+    harness_start( "hrtimer" );
+    CHECK( start_timer_interrupt( &red, 0 ) );
+    CHECK( start_timer_interrupt( &red, 0 ) );
+    CHECK( start_timer_interrupt( &green, 0 ) );
+    CHECK_EQ( channels[ SLED_RED ].queue_len, 1 );
+    CHECK_EQ( channels[ SLED_GREEN ].queue_len, 0 );
+    sim_run( ~0ULL );
+
+    //The queued sequence starts as the first one ends
+    n = edges_of( leds[ SLED_RED ].gpio, e, 16 );
+    CHECK_EQ( n, 4 );
+    for( i=0; i<n; i++ )
+        CHECK_EQ( e[i].time, i * MS( 10 ) );
+
+    //Green runs alongside on its own timer
+    n = edges_of( leds[ SLED_GREEN ].gpio, e, 16 );
+    CHECK_EQ( n, 4 );
+    for( i=0; i<n; i++ )
+        CHECK_EQ( e[i].time, i * MS( 5 ) );
+
+    CHECK_EQ( channels[ SLED_RED ].queue_len, 0 );
+    CHECK_EQ( sim_pending, 0 );
+    harness_stop();
+}
+
+static void test_pwm( void ){
+    struct sled_cmd cmd = blink( SLED_RED, 128, 1, 20000, 20000 );
+    struct sim_edge e[ 32 ];
+    u32 on_us = pwm_gamma[ 128 ] * PWM_PERIOD_US / PWM_LEVEL_MAX;
+    size_t i, n;
+
+    harness_start( "hrtimer" );
+    CHECK( start_timer_interrupt( &cmd, 0 ) );
+    sim_run_until( MS( 20 ) - 1 );
+
+    //One pulse of the gamma corrected width per period
+    n = edges_of( leds[ SLED_RED ].gpio, e, 32 );
+    CHECK_EQ( n, 8 );
+    for( i=0; i+1<n; i+=2 ){
+        CHECK_EQ( e[i].value, 0 );
+        CHECK_EQ( e[i].time, ( i / 2 ) * US( PWM_PERIOD_US ) );
+        CHECK_EQ( e[i+1].time - e[i].time, US( on_us ) );
+    }
+    CHECK_EQ( pwm_engaged, 1 );
+
+    sim_run( ~0ULL );
+    CHECK_EQ( pwm_engaged, 0 );
+    CHECK( !pwm_running );
+    CHECK_EQ( sim_gpios[ leds[ SLED_RED ].gpio ].value, 1 );
+    CHECK_EQ( sim_pending, 0 );
+    harness_stop();
+}
+
+static void test_patterns( void ){
+    struct sled_cmd cmds[] = {
+        blink( SLED_RED, 255, 2, 10000, 10000 ),
+        blink( SLED_GREEN, 255, 1, 10000, 10000 ),
+    };
+    struct sled_pattern req = {
+        .id     = 3,
+        .count  = ARRAY_SIZE( cmds ),
+        .cmds   = (uintptr_t) cmds,
+    };
+    struct sim_edge e[ 16 ];
+    unsigned red;
+
+    harness_start( "hrtimer" );
+    red = leds[ SLED_RED ].gpio;
+
+    CHECK_EQ( pattern_ioctl( SLED_IOC_TRIGGER, 3, -1 ), -ENOENT );
+    cmds[1].off_us = 0;
+    CHECK_EQ( pattern_ioctl( SLED_IOC_UPLOAD, (unsigned long) &req, -1 ), -EINVAL );
+    cmds[1].off_us = 10000;
+    CHECK_EQ( pattern_ioctl( SLED_IOC_UPLOAD, (unsigned long) &req, -1 ), 0 );
+    CHECK_EQ( patterns[3].seqs[ SLED_RED ].len, 3 );
+    CHECK( patterns[3].seqs[ SLED_RED ].steps[2].loop );
+    CHECK_EQ( patterns[3].seqs[ SLED_GREEN ].len, 2 );
+    CHECK_EQ( patterns[3].seqs[ SLED_BLUE ].len, 0 );
+
+    CHECK_EQ( pattern_ioctl( SLED_IOC_TRIGGER, 3, -1 ), 0 );
+    CHECK_EQ( pattern_ioctl( SLED_IOC_TRIGGER, 3, -1 ), -EBUSY );
+
+    //Held on the second step until resumed
+    sim_run_until( MS( 15 ) );
+    CHECK_EQ( pattern_ioctl( SLED_IOC_PAUSE, 3, -1 ), 0 );
+    sim_run_until( MS( 200 ) );
+    CHECK_EQ( edges_of( red, e, 16 ), 2 );
+    CHECK( pattern_active( &patterns[3] ) );
+
+    CHECK_EQ( pattern_ioctl( SLED_IOC_RESUME, 3, -1 ), 0 );
+    sim_run( ~0ULL );
+    CHECK_EQ( edges_of( red, e, 16 ), 4 );
+    CHECK_EQ( e[2].time, MS( 200 ) );
+    CHECK( !pattern_active( &patterns[3] ) );
+
+    //Cancelled half way, the channels carry on idle
+    CHECK_EQ( pattern_ioctl( SLED_IOC_TRIGGER, 3, -1 ), 0 );
+    sim_run_until( sim_now + MS( 5 ) );
+    CHECK_EQ( pattern_ioctl( SLED_IOC_CANCEL, 3, -1 ), 0 );
+    sim_run( ~0ULL );
+    CHECK( !pattern_active( &patterns[3] ) );
+    CHECK( channel_idle( &channels[ SLED_RED ] ) );
+    CHECK_EQ( sim_gpios[ red ].value, 1 );
+
+    //Patterns are reused, nothing comes out of the pools
+    CHECK_EQ( gen_pool_avail( channels[ SLED_RED ].pool ),
+              gen_pool_size( channels[ SLED_RED ].pool ) );
+
+    //Uploaded on /dev/sled2 every command plays on that led
+    req.id = 4;
+    CHECK_EQ( pattern_ioctl( SLED_IOC_UPLOAD, (unsigned long) &req, SLED_BLUE ), 0 );
+    CHECK_EQ( patterns[4].seqs[ SLED_RED ].len, 0 );
+    CHECK_EQ( patterns[4].seqs[ SLED_GREEN ].len, 0 );
+    CHECK_EQ( patterns[4].seqs[ SLED_BLUE ].len, 5 );
+    CHECK_EQ( edges_of( red, e, 16 ), 6 );
+    CHECK_EQ( pattern_ioctl( SLED_IOC_TRIGGER, 4, SLED_BLUE ), 0 );
+    sim_run( ~0ULL );
+    CHECK_EQ( edges_of( leds[ SLED_BLUE ].gpio, e, 16 ), 6 );
+    CHECK_EQ( edges_of( red, e, 16 ), 6 );
+    harness_stop();
+}
+
+static void test_cancel( void ){
+    struct sled_cmd cmd = blink( SLED_RED, 255, 5, 10000, 10000 );
+    struct sim_edge e[ 32 ];
+    unsigned red;
+    size_t n;
+
+    harness_start( "hrtimer" );
+    red = leds[ SLED_RED ].gpio;
+    CHECK( start_timer_interrupt( &cmd, 1 ) );
+    CHECK( start_timer_interrupt( &cmd, 1 ) );
+    cmd.repeat = 1;
+    CHECK( start_timer_interrupt( &cmd, 2 ) );
+    CHECK_EQ( play_program( "G100 x5", -1, 1 ), 0 );
+    sim_run_until( MS( 5 ) );
+
+    //The blink of file 1 is cut short, the one of file 2 plays at
+    //once, so the led stays on and goes off 10ms after the cancel
+    CHECK_EQ( cancel_channel( &channels[ SLED_RED ], 3 ), 0 );
+    CHECK_EQ( cancel_channel( &channels[ SLED_RED ], 1 ), 2 );
+    CHECK_EQ( cancel_channel( &channels[ SLED_GREEN ], 1 ), 1 );
+    sim_run( ~0ULL );
+    n = edges_of( red, e, 32 );
+    CHECK_EQ( n, 2 );
+    CHECK_EQ( e[0].time, 0 );
+    CHECK_EQ( e[1].time, MS( 15 ) );
+    CHECK_EQ( edges_of( leds[ SLED_GREEN ].gpio, e, 32 ), 2 );
+    CHECK( channel_idle( &channels[ SLED_GREEN ] ) );
+
+    //Everything, with the jiffy backend within a jiffy
+    harness_stop();
+    harness_start( "jiffy" );
+    cmd.repeat = 9;
+    CHECK( start_timer_interrupt( &cmd, 1 ) );
+    CHECK( start_timer_interrupt( &cmd, 2 ) );
+    sim_run_until( MS( 25 ) );
+    CHECK_EQ( cancel_channel( &channels[ SLED_RED ], 0 ), 2 );
+    sim_run( ~0ULL );
+    CHECK( sim_now <= MS( 25 ) + TICK_NSEC );
+    CHECK_EQ( sim_gpios[ red ].value, 1 );
+    CHECK_EQ( gen_pool_avail( channels[ SLED_RED ].pool ),
+              gen_pool_size( channels[ SLED_RED ].pool ) );
+    CHECK_EQ( sim_timer_frees, 0 );
+    harness_stop();
+}
+
+static void test_priority( void ){
+    static const s64 times[] = { 0, 10, 15, 17, 29, 39, 49, 59 };
+    struct sled_cmd low = blink( SLED_RED, 255, 3, 10000, 10000 );
+    struct sled_cmd high = blink( SLED_RED, 255, 1, 2000, 2000 );
+    struct led_channel *ch = &channels[ SLED_RED ];
+    struct led_sequence *seq[ 4 ], *order[ 8 ], *cur = NULL;
+    struct sim_edge e[ 32 ];
+    size_t i, n = 0;
+
+    harness_start( "hrtimer" );
+
+    //The alarm cuts in during the first off step, which then
+    //plays again in full before the two blinks left
+    CHECK( start_timer_interrupt( &low, 0 ) );
+    sim_run_until( MS( 15 ) );
+    high.priority = 5;
+    CHECK( start_timer_interrupt( &high, 0 ) );
+    sim_run( ~0ULL );
+    CHECK_EQ( edges_of( leds[ SLED_RED ].gpio, e, 32 ), ARRAY_SIZE( times ) );
+    for( i=0; i<ARRAY_SIZE( times ); i++ )
+        CHECK_EQ( e[i].time, MS( times[i] ) );
+
+    //Nested, a lower priority waits for the higher ones and
+    //equal ones keep their order
+    for( i=0; i<4; i++ ){
+        seq[i] = create_task_list( &low );
+        CHECK( seq[i] );
+    }
+    seq[1]->priority = 3;
+    seq[2]->priority = 5;
+    seq[3]->priority = 3;
+    for( i=0; i<4; i++ ){
+        queue_sequence( ch, seq[i] );
+        sim_run_until( sim_now + MS( 25 ) );
+    }
+    CHECK( ch->current_seq == seq[2] );
+    CHECK_EQ( ch->prio_map, BIT( 0 ) | BIT( 3 ) );
+    CHECK_EQ( ch->queue_len, 3 );
+    CHECK( seq[0]->preempted && seq[1]->preempted && !seq[3]->preempted );
+
+    while( ch->current_seq && n < ARRAY_SIZE( order ) ){
+        if( ch->current_seq != cur )
+            order[ n++ ] = cur = ch->current_seq;
+        sim_step();
+    }
+    CHECK_EQ( n, 4 );
+    CHECK( order[0] == seq[2] && order[1] == seq[1] &&
+           order[2] == seq[3] && order[3] == seq[0] );
+
+    //A cancelled sequence does not come back
+    low.priority = 0;
+    high.priority = 7;
+    CHECK( start_timer_interrupt( &low, 1 ) );
+    sim_run_until( sim_now + MS( 5 ) );
+    CHECK( start_timer_interrupt( &high, 2 ) );
+    CHECK_EQ( cancel_channel( ch, 1 ), 1 );
+    CHECK_EQ( ch->prio_map, 0 );
+    sim_run( ~0ULL );
+    CHECK( channel_idle( ch ) );
+    CHECK_EQ( gen_pool_avail( ch->pool ), gen_pool_size( ch->pool ) );
+
+    //Preempted again before its first tick after resuming,
+    //it still resumes on the step it was playing, R50
+    CHECK_EQ( play_program( "R10 off10 x3 R50 off5", -1, 0 ), 0 );
+    cur = ch->current_seq;
+    sim_run_until( sim_now + MS( 70 ) );
+    high.priority = 5;
+    CHECK( start_timer_interrupt( &high, 0 ) );
+    while( ch->current_seq != cur && sim_step() )
+        ;
+    high.priority = 6;
+    CHECK( start_timer_interrupt( &high, 0 ) );
+    CHECK_EQ( cur->steps[ ch->resume[0].cursor ].duration_us, 50000 );
+    CHECK_EQ( ch->resume[0].depth, 0 );
+    i = sim_edge_count;
+    sim_run( ~0ULL );
+    n = 0;
+    for( ; i<sim_edge_count; i++ ){
+        if( sim_edges[i].gpio == leds[ SLED_RED ].gpio && n < ARRAY_SIZE( e ) )
+            e[ n++ ] = sim_edges[i];
+    }
+    CHECK_EQ( n, 4 );
+    CHECK_EQ( e[2].time - e[1].time, MS( 2 ) );
+    CHECK_EQ( e[3].time - e[2].time, MS( 50 ) );
+
+    CHECK_EQ( play_program( "p9 R10", -1, 0 ), -EINVAL );
+    CHECK_EQ( play_program( "R10 p1", -1, 0 ), -EINVAL );
+    high.priority = SLED_MAX_PRIORITY + 1;
+    CHECK( !validate_command( &high ) );
+    harness_stop();
+}
+
+static void test_teardown( void ){
+    struct sled_cmd cmd = blink( SLED_GREEN, 255, 9, 100000, 100000 );
+    unsigned gpio;
+
+    harness_start( "jiffy" );
+    gpio = leds[ SLED_GREEN ].gpio;
+    CHECK( start_timer_interrupt( &cmd, 0 ) );
+    CHECK( start_timer_interrupt( &cmd, 0 ) );
+    sim_run_until( MS( 50 ) );
+    CHECK_EQ( sim_gpios[ gpio ].value, 0 );
+
+    //Unloading mid blink leaves no timer and the led off
+    harness_stop();
+    CHECK_EQ( sim_pending, 0 );
+    CHECK( !sim_gpios[ gpio ].requested );
+    CHECK_EQ( sim_gpios[ gpio ].value, 1 );
+    CHECK_EQ( sim_timer_frees, 0 );
+}
+
+static void test_stopping( void ){
+    struct sled_cmd cmd = blink( SLED_RED, 255, 9, 1000, 1000 );
+    size_t i;
+    u64 fired;
+
+    //A channel which is stopping fires the tick in flight and no more
+    harness_start( "hrtimer" );
+    for( i=0; i<led_count; i++ ){
+        cmd.channel = i;
+        CHECK( start_timer_interrupt( &cmd, 0 ) );
+        CHECK( start_timer_interrupt( &cmd, 0 ) );
+    }
+    sim_run_until( US( 1500 ) );
+    for( i=0; i<led_count; i++ )
+        channels[i].stopping = true;
+    fired = sim_fired;
+    sim_run( ~0ULL );
+    CHECK( sim_fired - fired <= led_count );
+    CHECK_EQ( sim_pending, 0 );
+
+    harness_stop();
+    CHECK_EQ( sim_pending, 0 );
+    CHECK_EQ( sim_timer_frees, 0 );
+}
+
+//Benchmarks
+//----------
+
+static double elapsed_ns( const struct timespec *start ){
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return ( now.tv_sec - start->tv_sec ) * 1e9 + ( now.tv_nsec - start->tv_nsec );
+}
+
+/**
+ * Bench Ticks
+ *
+ * @brief   Keeps every channel busy with short blinks
+ *          and runs the clock until target timer events
+ *          have fired.
+ *
+ **/
+static void bench_ticks( const char *backend, u64 target ){
+    struct sled_cmd cmd;
+    struct timespec start;
+    u64 ticks;
+    double ns;
+    size_t i;
+
+    pool_steps = 1 << 16;
+    harness_start( backend );
+    sim_edge_logging = false;
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    while( sim_fired < target ){
+        for( i=0; i<led_count; i++ ){
+            if( !channel_idle( &channels[i] ) )
+                continue;
+            cmd = blink( i, i == 0 ? 255 : 128, 9, 700, 300 );
+            start_timer_interrupt( &cmd, 0 );
+        }
+        sim_run( 4096 );
+    }
+    ns = elapsed_ns( &start );
+    ticks = sled_stats.count[ STAT_TICKS ];
+
+    printf( "%-8s %12llu events %12llu ticks %8.1f ns/event %10.0f events/s, %.1f s simulated\n",
+            backend, (unsigned long long) sim_fired, (unsigned long long) ticks,
+            ns / sim_fired, sim_fired * 1e9 / ns, (double) sim_now / NSEC_PER_SEC );
+
+    sim_edge_logging = true;
+    harness_stop();
+}
+
+/**
+ * Bench Queue
+ *
+ * @brief   Queues depth sequences of random priorities on
+ *          one channel and plays them out, over and over
+ *          until about target have played. The sequences
+ *          are built before the clock starts, the mock pool
+ *          is a linear first fit, so only the queues and the
+ *          ticks are timed. The time per sequence stays flat
+ *          as the queues get deeper.
+ *
+ **/
+static void bench_queue( size_t depth, u64 target ){
+    struct sled_cmd cmd = blink( SLED_RED, 255, 1, 100, 100 );
+    struct led_sequence **seqs;
+    struct timespec start;
+    double ns = 0;
+    u64 done = 0;
+    size_t i;
+
+    seqs = calloc( depth, sizeof( *seqs ) );
+    if( !seqs )
+        return;
+    pool_steps = 1 << 17;
+    harness_start( "hrtimer" );
+    sim_edge_logging = false;
+
+    while( done < target ){
+        for( i=0; i<depth; i++ ){
+            seqs[i] = create_task_list( &cmd );
+            seqs[i]->priority = fuzz_rand() % ( SLED_MAX_PRIORITY + 1 );
+        }
+        clock_gettime( CLOCK_MONOTONIC, &start );
+        for( i=0; i<depth; i++ )
+            queue_sequence( &channels[ SLED_RED ], seqs[i] );
+        sim_run( ~0ULL );
+        ns += elapsed_ns( &start );
+        reclaim_sequences();
+        done += depth;
+    }
+
+    printf( "%-8s %12llu sequences %5zu deep %8.1f ns/sequence %10.0f sequences/s\n",
+            "queue", (unsigned long long) done, depth, ns / done, done * 1e9 / ns );
+
+    sim_edge_logging = true;
+    harness_stop();
+    free( seqs );
+}
+
+/**
+ * Bench Text
+ *
+ * @brief   Parses a batch of SLED_MAX_BATCH text commands
+ *          over and over, about target commands in all.
+ *
+ **/
+static void bench_text( const char *name,
+                        int (*parse)( const char *, size_t, int,
+                                      struct sled_cmd *, size_t ),
+                        u64 target ){
+    static struct sled_cmd cmds[ SLED_MAX_BATCH ];
+    static char text[ SLED_MAX_BATCH * ( TEXT_CMD_LEN + 1 ) ];
+    struct timespec start;
+    size_t len = 0;
+    u64 i, done = 0;
+    double ns;
+
+    for( i=0; i<SLED_MAX_BATCH; i++ )
+        len += sprintf( text + len, "%llu %llu %llu\n", 3 + i % 3, 6 + i % 3, 1 + i % 9 );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for( i=0; i<target; i+=SLED_MAX_BATCH ){
+        done += parse( text, len, -1, cmds, SLED_MAX_BATCH );
+        barrier();
+    }
+    ns = elapsed_ns( &start );
+
+    printf( "%-8s %12llu commands %8.1f ns/command %10.0f commands/s %8.1f MB/s\n",
+            name, (unsigned long long) done, ns / done, done * 1e9 / ns,
+            done * ( TEXT_CMD_LEN + 1 ) * 1e3 / ns );
+}
+
+/**
+ * Bench Parse
+ *
+ * @brief   Runs the text parser over a rotating
+ *          set of valid and invalid commands, then
+ *          over batched texts of many commands, next
+ *          to the plain parser for comparison.
+ *
+ **/
+static void bench_parse( u64 target ){
+    static const char * const lines[] = {
+        "3 6 1\n", "4 7 5\n", "5 8 9\n", "3 x 1\n", "3 6 12\n", "9 6 1\n",
+    };
+    struct sled_cmd cmd;
+    struct timespec start;
+    u64 i, ok = 0;
+    double ns;
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for( i=0; i<target; i++ ){
+        const char *line = lines[ i % ARRAY_SIZE( lines ) ];
+        ok += parse_command( line, strlen( line ), -1, &cmd );
+    }
+    ns = elapsed_ns( &start );
+
+    printf( "%-8s %12llu commands %10llu valid %8.1f ns/command %10.0f commands/s\n",
+            "parse", (unsigned long long) target, (unsigned long long) ok,
+            ns / target, target * 1e9 / ns );
+
+    bench_text( "text", parse_commands, target );
+    bench_text( "plain", reference_parse, target );
+}
+
+int main( int argc, char **argv ){
+    u64 target = 10000000;
+    bool bench = false;
+    u64 fuzz = 0;
+    int i;
+
+    for( i=1; i<argc; i++ ){
+        if( !strcmp( argv[i], "-b" ) ){
+            bench = true;
+            if( i + 1 < argc )
+                target = strtoull( argv[ ++i ], NULL, 0 );
+        }else if( !strcmp( argv[i], "-f" ) ){
+            fuzz = 10000000;
+            if( i + 1 < argc )
+                fuzz = strtoull( argv[ ++i ], NULL, 0 );
+        }else if( !strcmp( argv[i], "-v" ) ){
+            sim_log = true;
+        }else{
+            fprintf( stderr, "usage: %s [-v] [-b ticks] [-f texts]\n", argv[0] );
+            return 2;
+        }
+    }
+
+    if( bench ){
+        bench_ticks( "jiffy", target );
+        bench_ticks( "hrtimer", target );
+        bench_parse( target );
+        bench_queue( 16, target / 10 );
+        bench_queue( 4096, target / 10 );
+        return 0;
+    }
+
+    if( fuzz ){
+        fuzz_text( fuzz );
+        printf( "%d texts, %d failed\n", checks, failures );
+        return failures ? 1 : 0;
+    }
+
+    test_validate_buffer();
+    harness_start( "jiffy" );
+    test_parse_command();
+    test_parse_commands();
+    test_validate_command();
+    fuzz_text( 100000 );
+    harness_stop();
+    test_chip_lines();
+    test_task_list();
+    test_pool_exhaustion();
+    test_compile_program();
+    test_play_program();
+    test_jiffy_timing();
+    test_hrtimer_timing();
+    test_queue_and_parallel();
+    test_pwm();
+    test_patterns();
+    test_cancel();
+    test_priority();
+    test_teardown();
+    test_stopping();
+
+    printf( "%d checks, %d failed\n", checks, failures );
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,130 @@
+/**
+ * @file        sled_write_bench.c
+ * @version     0.1
+ * @brief       Measures the cost of a text command written
+ *              to /dev/sled, once with logging off and once
+ *              with every level enabled. The verbosity of the
+ *              driver is switched through its module parameter,
+ *              so this has to run as root.
+ *
+ *              The default command names an unknown color. It
+ *              goes through validation, parsing and logging and
+ *              is then dropped, so nothing is queued and the
+ *              numbers show the syscall and logging alone.
+ *
+ *              The write path only logs per command messages,
+ *              which are compiled out unless the module is built
+ *              with the SLED_DEBUG line of its Makefile enabled.
+ *              Against a module built without it both runs do
+ *              the same work and show the same numbers.
+ *
+ *  usage : sled_write_bench [writes] [command]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEVICE_FILE     "/dev/sled"
+#define VERBOSITY_FILE  "/sys/module/sled/parameters/verbosity"
+#define DEFAULT_WRITES  100000
+#define DEFAULT_COMMAND "9 6 1\n"
+
+static int read_verbosity( void ){
+    FILE *f = fopen( VERBOSITY_FILE, "r" );
+    int level = -1;
+
+    if( f ){
+        if( fscanf( f, "%d", &level ) != 1 )
+            level = -1;
+        fclose( f );
+    }
+    return level;
+}
+
+static int write_verbosity( int level ){
+    FILE *f = fopen( VERBOSITY_FILE, "w" );
+
+    if( !f )
+        return -1;
+    fprintf( f, "%d\n", level );
+    return fclose( f );
+}
+
+static long long now_ns( void ){
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * run
+ *
+ * @brief   Writes the command the given number of times
+ *          and prints the mean and worst write latency.
+ *
+ **/
+static int run( int fd, const char *label, const char *cmd, long writes ){
+    size_t len = strlen( cmd );
+    long long start, t, worst = 0, total = 0;
+    long i;
+
+    for( i=0; i<writes; i++ ){
+        start = now_ns();
+        if( write( fd, cmd, len ) < 0 ){
+            perror( "write" );
+            return -1;
+        }
+        t = now_ns() - start;
+        total += t;
+        if( t > worst )
+            worst = t;
+    }
+
+    printf( "\t%-12s %8.0f ns mean | %8lld ns worst\n",
+            label, (double) total / writes, worst );
+    return 0;
+}
+
+int main( int argc, char *argv[] ){
+    long writes = argc > 1 ? atol( argv[1] ) : DEFAULT_WRITES;
+    const char *cmd = argc > 2 ? argv[2] : DEFAULT_COMMAND;
+    int saved, fd, ret = 0;
+
+    if( writes <= 0 ){
+        fprintf( stderr, "writes has to be positive\n" );
+        return EXIT_FAILURE;
+    }
+
+    saved = read_verbosity();
+    if( saved < 0 ){
+        fprintf( stderr, "Can not read %s, is the sled module loaded?\n",
+                 VERBOSITY_FILE );
+        return EXIT_FAILURE;
+    }
+
+    fd = open( DEVICE_FILE, O_WRONLY );
+    if( fd < 0 ){
+        perror( "Failed to open " DEVICE_FILE );
+        return EXIT_FAILURE;
+    }
+
+    printf( "\t%ld writes of \"%.*s\"\n", writes,
+            (int) strcspn( cmd, "\n" ), cmd );
+    printf( "\tlogging on only differs from off with a module built with -DSLED_DEBUG\n" );
+
+    if( write_verbosity( 0 ) || run( fd, "logging off", cmd, writes ) )
+        ret = EXIT_FAILURE;
+    else if( write_verbosity( 2 ) || run( fd, "logging on", cmd, writes ) )
+        ret = EXIT_FAILURE;
+
+    write_verbosity( saved );
+    close( fd );
+    if( ret )
+        fprintf( stderr, "Benchmark failed : %s\n", strerror( errno ) );
+    return ret;
+}